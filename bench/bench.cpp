@@ -0,0 +1,427 @@
+// Host benchmarks for the scheduling core, built by [env:native]:
+//   pio run -e native && .pio/build/native/program [years]
+// Times are for the host running it, compare them between commits rather than with the ESP8266. The flash numbers
+// come from the real journal code on a fake sector, so they're what a lamp would do.
+#include <Arduino.h>
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+#include "config_format.h"
+#include "journal.h"
+#include "json_reader.h"
+#include "schedule.h"
+#include "schedule_form.h"
+#include "scheduler.h"
+#include "sun.h"
+#include "time_format.h"
+#include "time_zone.h"
+#include "rtc_cache.h"
+
+// Rated erase cycles of the flash sector, for the wear estimate.
+static const uint32_t sectorEraseCycles = 100000;
+// How often a schedule gets posted in the transition simulation.
+static const uint8_t configPostsPerYear = 12;
+static const uint32_t minutesPerYear = 365 * minutesPerDay + minutesPerDay / 4;
+
+// Heap use of the code under test, counted through operator new. Nothing in the portable modules should allocate.
+static uint32_t allocations = 0;
+static uint64_t allocatedBytes = 0;
+
+void *operator new(size_t size)
+{
+  allocations++;
+  allocatedBytes += size;
+  void *memory = malloc(size);
+  if (memory == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+  free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+  free(memory);
+}
+
+// Keeps results alive so the compiler can't drop the loops.
+static volatile uint32_t sink = 0;
+
+typedef std::chrono::steady_clock benchClock;
+
+static double elapsedNanos(benchClock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(benchClock::now() - start).count();
+}
+
+static Schedule scheduleAt(uint8_t startHour, uint8_t startMinute, uint8_t endHour, uint8_t endMinute)
+{
+  return makeSchedule(minuteOfDay(startHour, startMinute), minuteOfDay(endHour, endMinute));
+}
+
+static PersistedConfig dailyConfig()
+{
+  PersistedConfig config;
+  memset(&config, 0, sizeof(config));
+  config.dayIntensity = 80;
+  config.nightIntensity = 5;
+  config.day = scheduleAt(7, 0, 19, 30);
+  config.night = scheduleAt(19, 30, 6, 45);
+  config.weekendDay = scheduleAt(8, 30, 20, 30);
+  config.weekendNight = scheduleAt(20, 30, 8, 0);
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    config.fadeInSeconds[channel] = defaultFadeSeconds;
+    config.fadeOutSeconds[channel] = defaultFadeSeconds;
+  }
+  return config;
+}
+
+// Every slot of every day in use, the biggest table there is.
+static PersistedConfig weeklyConfig()
+{
+  PersistedConfig config = dailyConfig();
+  config.weeklyActive = true;
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      Schedule &schedule = config.week.slots[weekday][slot];
+      schedule = makeSchedule(slot * 6 * 60 + weekday * 5, slot * 6 * 60 + 150 + weekday * 5);
+      if (slot % 2 == 1)
+      {
+        schedule.flags |= scheduleNight;
+      }
+    }
+  }
+  return config;
+}
+
+// Night from half an hour after sunset to sunrise, day from sunrise to sunset.
+static PersistedConfig sunConfig()
+{
+  PersistedConfig config = dailyConfig();
+  parseScheduleEndpoint("sunrise", config.day, true);
+  parseScheduleEndpoint("sunset", config.day, false);
+  parseScheduleEndpoint("sunset+30", config.night, true);
+  parseScheduleEndpoint("sunrise", config.night, false);
+  config.weekendDay = disabledSchedule();
+  config.weekendNight = disabledSchedule();
+  return config;
+}
+
+static void compile(const PersistedConfig &config)
+{
+  if (config.weeklyActive)
+  {
+    schedulerCompileWeek(config.week);
+  }
+  else
+  {
+    schedulerCompile(config.day, config.night, config.weekendDay, config.weekendNight);
+  }
+}
+
+static bool saveConfig(const PersistedConfig &config)
+{
+  uint8_t buffer[configMaxEncodedLength];
+  uint16_t length = encodeConfig(config, buffer, sizeof(buffer));
+  return length > 0 && journalAppend(recordConfig, buffer, length);
+}
+
+// Jump from transition to transition for years of simulated time, flushing the runtime record at most every
+// runtimeFlushIntervall like loop() does (transitions themselves only go to RTC memory), and posting the config now and then.
+static void benchTransitions(const char *label, const PersistedConfig &config, uint32_t years)
+{
+  journalBegin();
+  uint32_t startWrites = journalWriteCount();
+  uint32_t startBytes = journalBytesWritten();
+  uint32_t startErases = journalEraseCount();
+
+  compile(config);
+  uint64_t simulated = 0;
+  uint64_t end = (uint64_t)years * minutesPerYear;
+  uint64_t nextPost = 0;
+  uint32_t transitions = 0;
+  uint32_t failures = 0;
+  const uint64_t flushMinutes = runtimeFlushIntervall / 60000;
+  uint64_t lastFlush = 0;
+  uint64_t changed = 0;
+  bool flushed = true;
+  uint8_t runtime = 0;
+  OutputState previous = schedulerStateAt(0);
+  benchClock::time_point start = benchClock::now();
+  while (simulated < end)
+  {
+    if (simulated >= nextPost)
+    {
+      failures += !saveConfig(config);
+      nextPost += minutesPerYear / configPostsPerYear;
+    }
+    uint16_t step = schedulerMinutesToNextTransition(simulated % minutesPerWeek);
+    if (step == 0)
+    {
+      break; // Nothing ever changes.
+    }
+    // loop() flushes as soon as the runtime changed and the interval is up, whichever comes later.
+    uint64_t due = changed > lastFlush + flushMinutes ? changed : lastFlush + flushMinutes;
+    if (!flushed && due < simulated + step)
+    {
+      failures += !journalAppend(recordRuntime, &runtime, sizeof(runtime));
+      flushed = true;
+      lastFlush = due;
+    }
+    simulated += step;
+    fakeClockAdvance((uint64_t)step * 60 * 1000000);
+    OutputState state = schedulerStateAt(simulated % minutesPerWeek);
+    if (state.dayActive != previous.dayActive || state.nightActive != previous.nightActive)
+    {
+      runtime = (state.dayActive ? runtimeDayActive : 0) | (state.nightActive ? runtimeNightActive : 0);
+      flushed = false;
+      changed = simulated;
+      transitions++;
+    }
+    previous = state;
+  }
+  double wall = elapsedNanos(start) / 1e6;
+
+  double perYear = 1.0 / years;
+  uint32_t erases = journalEraseCount() - startErases;
+  printf("%s, %u years simulated in %.1f ms\n", label, years, wall);
+  printf("  transitions per year:     %.0f (%u table entries)\n", transitions * perYear, schedulerTransitionCount());
+  printf("  flash writes per year:    %.0f records, %.0f bytes\n", (journalWriteCount() - startWrites) * perYear, (journalBytesWritten() - startBytes) * perYear);
+  // The journal takes turns between its two sectors.
+  printf("  sector erases per year:   %.1f, %.0f years to %u cycles\n", erases * perYear, erases > 0 ? 2 * sectorEraseCycles / (erases * perYear) : 0.0, sectorEraseCycles);
+  if (failures > 0)
+  {
+    printf("  FAILED journal writes:    %u\n", failures);
+  }
+}
+
+// Cost of what serviceSchedule() does on a tick, for every minute of the week.
+static void benchLookups(const char *label, const PersistedConfig &config)
+{
+  const uint16_t passes = 200;
+  compile(config);
+  benchClock::time_point start = benchClock::now();
+  for (uint16_t pass = 0; pass < passes; pass++)
+  {
+    for (uint16_t minute = 0; minute < minutesPerWeek; minute++)
+    {
+      OutputState state = schedulerStateAt(minute);
+      sink += state.dayActive + state.nightActive + schedulerMinutesToNextTransition(minute);
+    }
+  }
+  double perLookup = elapsedNanos(start) / ((double)passes * minutesPerWeek);
+
+  const uint16_t compiles = 2000;
+  start = benchClock::now();
+  for (uint16_t i = 0; i < compiles; i++)
+  {
+    // Alternate so every compile actually swaps the table.
+    PersistedConfig changed = config;
+    changed.day.startMinute += i % 2;
+    changed.week.slots[0][0].startMinute += i % 2;
+    compile(changed);
+  }
+  double perCompile = elapsedNanos(start) / compiles;
+  printf("%s: %.1f ns per tick lookup, %.2f us per compile\n", label, perLookup, perCompile / 1000);
+}
+
+// A year of once a minute conversions, as the clock would do them. Clock changes are counted by tzNextChange() moving.
+static void benchTimeZone(const char *rules)
+{
+  const time_t yearStart = 1704067200; // 2024-01-01 UTC
+  if (!tzBegin(rules))
+  {
+    printf("Time zone %s: FAILED to parse\n", rules);
+    return;
+  }
+  uint32_t conversions = 0;
+  uint32_t changes = 0;
+  time_t lastChange = 0;
+  benchClock::time_point start = benchClock::now();
+  for (time_t utc = yearStart; utc < yearStart + (time_t)minutesPerYear * 60; utc += 60)
+  {
+    sink += tzLocal(utc);
+    conversions++;
+    if (tzNextChange() != lastChange)
+    {
+      lastChange = tzNextChange();
+      changes++;
+    }
+  }
+  double perConversion = elapsedNanos(start) / conversions;
+  printf("Time zone %s: %.1f ns per conversion, %u offset periods in a year\n", rules, perConversion, changes);
+}
+
+// What the sketch does once a local day: sunrise and sunset for the week ahead, and a compile. In UTC here,
+// the local conversion is the time zone's cost above.
+static void benchSun(const char *label, double latitude, double longitude)
+{
+  const int32_t yearStartDay = 19723; // 2024-01-01
+  PersistedConfig config = sunConfig();
+  uint32_t changedTables = 0;
+  uint16_t shortestNight = minutesPerDay;
+  benchClock::time_point start = benchClock::now();
+  for (int32_t today = yearStartDay; today < yearStartDay + 365; today++)
+  {
+    SunDay days[daysPerWeek];
+    for (uint8_t i = 0; i < daysPerWeek; i++)
+    {
+      int16_t sunrise;
+      int16_t sunset;
+      sunTimes(today + i, latitude, longitude, sunrise, sunset);
+      days[(today + i + 4) % daysPerWeek] = {sunrise, sunset};
+    }
+    schedulerSetSun(days);
+    changedTables += schedulerCompile(config.day, config.night, config.weekendDay, config.weekendNight);
+    const SunDay &day = days[(today + 4) % daysPerWeek];
+    int16_t night = minutesPerDay - (day.sunset - day.sunrise);
+    night = night < 0 ? 0 : night;
+    shortestNight = night < shortestNight ? night : shortestNight;
+  }
+  double perDay = elapsedNanos(start) / 365;
+  printf("Sun at %s: %.2f us per daily update, %u of 365 changed the table, shortest night %u min\n", label, perDay / 1000, changedTables, shortestNight);
+}
+
+static void benchConfig()
+{
+  const uint32_t rounds = 100000;
+  PersistedConfig config = weeklyConfig();
+  uint8_t buffer[configMaxEncodedLength];
+  uint16_t length = 0;
+  benchClock::time_point start = benchClock::now();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    config.dayIntensity = i % 100;
+    length = encodeConfig(config, buffer, sizeof(buffer));
+    sink += length;
+  }
+  double perEncode = elapsedNanos(start) / rounds;
+
+  PersistedConfig decoded;
+  start = benchClock::now();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    sink += decodeConfig(buffer, length, decoded);
+  }
+  double perDecode = elapsedNanos(start) / rounds;
+  printf("Config record: %u bytes, %.0f ns per encode, %.0f ns per decode\n", length, perEncode, perDecode);
+}
+
+typedef const char *formPair_t[2];
+
+static void benchForm(const char *label, const formPair_t *fields, uint16_t fieldCount, const PersistedConfig &current)
+{
+  const uint32_t rounds = 20000;
+  uint32_t startAllocations = allocations;
+  uint64_t startBytes = allocatedBytes;
+  uint32_t invalid = 0;
+  benchClock::time_point start = benchClock::now();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    ScheduleForm form;
+    formBegin(form, current, "zuul");
+    for (uint16_t field = 0; field < fieldCount; field++)
+    {
+      formField(form, fields[field][0], fields[field][1]);
+    }
+    invalid += !formFinish(form);
+  }
+  double perRequest = elapsedNanos(start) / rounds;
+  printf("%s: %u fields, %.2f us per request, %.1f allocations and %.0f heap bytes per request, %u bytes of stack for the form%s\n",
+         label, fieldCount, perRequest / 1000, (double)(allocations - startAllocations) / rounds,
+         (double)(allocatedBytes - startBytes) / rounds, (unsigned)sizeof(ScheduleForm), invalid > 0 ? " (INVALID)" : "");
+}
+
+static void benchRequests()
+{
+  const formPair_t dailyFields[] = {
+      {"dayStart", "07:00"}, {"dayEnd", "19:30"}, {"dayIntensity", "80"}, {"nightStart", "19:30"}, {"nightEnd", "06:45"}, {"nightIntensity", "5"}, {"weekendDayStart", "08:30"}, {"weekendDayEnd", "20:30"}, {"weekendNightStart", "20:30"}, {"weekendNightEnd", "08:00"}, {"dayFadeIn", "2"}, {"dayFadeOut", "2"}, {"nightFadeIn", "600"}, {"nightFadeOut", "2"}, {"dst", "on"}, {"gatekeeper", "zuul"}};
+  benchForm("POST /time, daily form", dailyFields, sizeof(dailyFields) / sizeof(dailyFields[0]), dailyConfig());
+
+  // The weekly form posts every slot, used or not.
+  static char names[daysPerWeek * slotsPerDay * 3][formFieldNameLength];
+  static char times[daysPerWeek * slotsPerDay * 2][minuteTextLength];
+  formPair_t weeklyFields[daysPerWeek * slotsPerDay * 3 + 4];
+  uint16_t count = 0;
+  uint16_t timeCount = 0;
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      static const char *const parts[] = {"Start", "End", "Channel"};
+      for (uint8_t part = 0; part < 3; part++)
+      {
+        snprintf(names[count], sizeof(names[count]), "w%us%u%s", weekday, slot, parts[part]);
+        weeklyFields[count][0] = names[count];
+        if (part < 2)
+        {
+          weeklyFields[count][1] = formatMinuteOfDay(slot * 360 + part * 150, times[timeCount++]);
+        }
+        else
+        {
+          weeklyFields[count][1] = slot % 2 ? "night" : "day";
+        }
+        count++;
+      }
+    }
+  }
+  const formPair_t rest[] = {{"weekly", "1"}, {"dayIntensity", "80"}, {"nightIntensity", "5"}, {"gatekeeper", "zuul"}};
+  for (const formPair_t &field : rest)
+  {
+    weeklyFields[count][0] = field[0];
+    weeklyFields[count][1] = field[1];
+    count++;
+  }
+  benchForm("POST /time, weekly form", weeklyFields, count, weeklyConfig());
+
+  // A full PUT /api/schedule body, walked the way the handler does but without looking at the values.
+  static const char document[] =
+      "{\"weekly\":true,\"dst\":false,\"dayIntensity\":80,\"nightIntensity\":5,\"day\":{\"start\":\"07:00\",\"end\":\"19:30\"},"
+      "\"night\":{\"start\":\"19:30\",\"end\":\"06:45\"},\"weekendDay\":null,\"weekendNight\":null,\"fadeIn\":[2,600],\"fadeOut\":[2,2],"
+      "\"week\":[[{\"start\":\"00:00\",\"end\":\"02:30\",\"channel\":\"day\"},{\"start\":\"06:00\",\"end\":\"08:30\",\"channel\":\"night\"}],"
+      "[],[],[],[],[],[{\"start\":\"18:00\",\"end\":\"20:30\",\"channel\":\"night\"}]]}";
+  const uint32_t rounds = 100000;
+  uint32_t startAllocations = allocations;
+  benchClock::time_point start = benchClock::now();
+  for (uint32_t i = 0; i < rounds; i++)
+  {
+    JsonReader reader;
+    jsonBegin(reader, document, sizeof(document) - 1);
+    jsonSkip(reader);
+    sink += jsonFinished(reader);
+  }
+  printf("PUT /api/schedule, %u byte body: %.2f us per read, %.1f allocations per request\n", (unsigned)(sizeof(document) - 1),
+         elapsedNanos(start) / rounds / 1000, (double)(allocations - startAllocations) / rounds);
+}
+
+// The unit tests under test/ build against the same sources and bring their own main().
+#ifndef PIO_UNIT_TESTING
+int main(int argc, char **argv)
+{
+  uint32_t years = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10;
+  if (years == 0)
+  {
+    years = 1;
+  }
+  benchTransitions("Daily schedule with weekend", dailyConfig(), years);
+  benchTransitions("Weekly schedule, every slot", weeklyConfig(), years);
+  benchLookups("Daily schedule with weekend", dailyConfig());
+  benchLookups("Weekly schedule, every slot", weeklyConfig());
+  benchLookups("Sunrise and sunset schedule", sunConfig());
+  benchConfig();
+  benchRequests();
+  benchTimeZone("CET-1CEST,M3.5.0,M10.5.0/3");
+  benchTimeZone("AEST-10AEDT,M10.1.0,M4.1.0/3");
+  benchSun("Stockholm", 59.33, 18.07);
+  benchSun("Singapore", 1.35, 103.82);
+  return 0;
+}
+#endif
@@ -0,0 +1,37 @@
+/**********************************************************************************************************
+    Name    : Arduino (native)
+    Notes   : Just enough of the Arduino core for the portable modules to build on the host: a fake clock
+              that the benchmarks move forward by hand, and in-memory flash sectors behind ESP.
+ ***********************************************************************************************************/
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+unsigned long millis();
+unsigned long micros();
+// Moves millis() and micros() forward, nothing else does.
+void fakeClockAdvance(uint64_t micros);
+
+// Erased sectors, like the EEPROM and filesystem sectors on the ESP8266. Writes can only clear bits, like real flash.
+class EspClass
+{
+public:
+  bool flashEraseSector(uint32_t sector);
+  bool flashWrite(uint32_t address, const uint32_t *data, size_t size);
+  bool flashRead(uint32_t address, uint32_t *data, size_t size);
+  uint32_t random();
+};
+
+extern EspClass ESP;
+
+// Back to a chip that's erased all over.
+void fakeFlashErase();
+// Power cut after this many more erases and writes, the write it happens in only gets halfway and later ones fail.
+void fakeFlashCutAfter(int32_t operations);
+void fakeFlashRestorePower();
+
+#endif
@@ -0,0 +1,145 @@
+#include <Arduino.h>
+#include <spi_flash.h>
+
+// Only their addresses are used, the journal and the event log work out their sectors from them. Laid out like a
+// linker script would, a filesystem area of two sectors with the EEPROM sector after it.
+extern "C" uint8_t fakeFlashLayout[];
+alignas(SPI_FLASH_SEC_SIZE) uint8_t fakeFlashLayout[3 * SPI_FLASH_SEC_SIZE];
+asm(".globl _FS_start\n.set _FS_start, fakeFlashLayout\n"
+    ".globl _FS_end\n.set _FS_end, fakeFlashLayout + 2 * 4096\n"
+    ".globl _EEPROM_start\n.set _EEPROM_start, fakeFlashLayout + 2 * 4096\n");
+static_assert(SPI_FLASH_SEC_SIZE == 4096, "The layout above is in sectors of 4096");
+
+EspClass ESP;
+
+static uint64_t clockMicros = 0;
+// Sectors are handed out as they're first touched, enough for the layout above.
+static const uint8_t fakeSectors = 4;
+static uint8_t flash[fakeSectors][SPI_FLASH_SEC_SIZE];
+static uint32_t sectorNumbers[fakeSectors];
+static uint8_t sectorsUsed = 0;
+// Flash operations until the power goes out, -1 for never.
+static int32_t operationsLeft = -1;
+static bool powerOut = false;
+
+unsigned long millis()
+{
+  return clockMicros / 1000;
+}
+
+unsigned long micros()
+{
+  return clockMicros;
+}
+
+void fakeClockAdvance(uint64_t micros)
+{
+  clockMicros += micros;
+}
+
+static uint8_t *flashAt(uint32_t address, size_t size)
+{
+  uint32_t number = address / SPI_FLASH_SEC_SIZE;
+  uint32_t offset = address % SPI_FLASH_SEC_SIZE;
+  if (offset + size > SPI_FLASH_SEC_SIZE || address % 4 != 0)
+  {
+    return nullptr;
+  }
+  for (uint8_t i = 0; i < sectorsUsed; i++)
+  {
+    if (sectorNumbers[i] == number)
+    {
+      return &flash[i][offset];
+    }
+  }
+  if (sectorsUsed == fakeSectors)
+  {
+    return nullptr;
+  }
+  sectorNumbers[sectorsUsed] = number;
+  memset(flash[sectorsUsed], 0xFF, SPI_FLASH_SEC_SIZE);
+  return &flash[sectorsUsed++][offset];
+}
+
+// False for the operation the power goes out in, and every one after it.
+static bool powered()
+{
+  if (operationsLeft == 0)
+  {
+    return false;
+  }
+  if (operationsLeft > 0)
+  {
+    operationsLeft--;
+  }
+  return !powerOut;
+}
+
+void fakeFlashErase()
+{
+  sectorsUsed = 0;
+  fakeFlashRestorePower();
+}
+
+void fakeFlashCutAfter(int32_t operations)
+{
+  operationsLeft = operations;
+  powerOut = false;
+}
+
+void fakeFlashRestorePower()
+{
+  operationsLeft = -1;
+  powerOut = false;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector)
+{
+  uint8_t *target = flashAt(sector * SPI_FLASH_SEC_SIZE, 0);
+  if (target == nullptr || !powered())
+  {
+    powerOut = operationsLeft == 0;
+    return false;
+  }
+  memset(target, 0xFF, SPI_FLASH_SEC_SIZE);
+  return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, const uint32_t *data, size_t size)
+{
+  uint8_t *target = flashAt(address, size);
+  if (target == nullptr || size % 4 != 0)
+  {
+    return false;
+  }
+  // The write the power goes out in only gets halfway.
+  bool complete = powered();
+  size_t written = complete ? size : (powerOut ? 0 : size / 8 * 4);
+  powerOut = !complete;
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < written; i++)
+  {
+    target[i] &= bytes[i];
+  }
+  return complete;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t *data, size_t size)
+{
+  uint8_t *source = flashAt(address, size);
+  if (source == nullptr)
+  {
+    return false;
+  }
+  memcpy(data, source, size);
+  return true;
+}
+
+uint32_t EspClass::random()
+{
+  static uint32_t state = 0x6c616d70;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
@@ -0,0 +1,24 @@
+/**********************************************************************************************************
+    Name    : boot_guard
+    Notes   : Counts boots in a row that never got as far as a lamp that has been running for a while, in
+              RTC user memory (kept through resets and crashes, lost on a power cut). Once too many have
+              failed the sketch comes up in safe mode, with only wifi and OTA, so a bad image can be replaced
+              over the air instead of over USB. The ESP8266 has no second bank to boot back into.
+ ***********************************************************************************************************/
+#ifndef BOOT_GUARD_H
+#define BOOT_GUARD_H
+
+#include <stdint.h>
+
+// Failed boots in a row before safe mode.
+const uint8_t bootGuardMaxFailures = 3;
+// How long a boot has to run for to count as healthy.
+const unsigned long bootHealthyMillis = 30000;
+
+// Count this boot as failed until bootGuardHealthy() says otherwise. True when it should start in safe mode.
+bool bootGuardBegin();
+void bootGuardHealthy();
+// Failed boots in a row before this one.
+uint8_t bootGuardFailures();
+
+#endif
@@ -0,0 +1,177 @@
+/**********************************************************************************************************
+    Name    : channel
+    Notes   : Output channels fixed at compile time. The driver, the outputs of each channel and the gamma
+              curve come from build flags (see platformio.ini), every channel is its own type with its duty
+              table built by the compiler, and loops over the channels are unrolled. A channel drives one or
+              more outputs of the driver (pins, PCA9685 outputs or pixel colours, see output_driver.h), an
+              output of -1 isn't wired to anything and compiles to nothing, which is how a single channel
+              lamp is built.
+ ***********************************************************************************************************/
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+#include <type_traits>
+#include "output_driver.h"
+
+typedef enum : uint8_t
+{
+  gammaLinear = 0,
+  // CIE 1931 lightness, evenly spaced percent look evenly spaced.
+  gammaCie1931 = 1
+} gamma_t;
+
+// Comma separated outputs per channel, e.g. -DLAMPOMATIC_DAY_OUTPUTS=pixelRed,pixelGreen,pixelBlue. An output
+// belongs to one channel, two channels writing it would overwrite each other.
+#if defined(LAMPOMATIC_PCA9685)
+#define LAMPOMATIC_DEFAULT_DAY_OUTPUTS 0
+#define LAMPOMATIC_DEFAULT_NIGHT_OUTPUTS 1
+#elif defined(LAMPOMATIC_WS2812) && defined(LAMPOMATIC_WS2812_RGBW)
+#define LAMPOMATIC_DEFAULT_DAY_OUTPUTS pixelWhite
+#define LAMPOMATIC_DEFAULT_NIGHT_OUTPUTS pixelRed
+#elif defined(LAMPOMATIC_WS2812)
+#define LAMPOMATIC_DEFAULT_DAY_OUTPUTS pixelGreen, pixelBlue
+#define LAMPOMATIC_DEFAULT_NIGHT_OUTPUTS pixelRed
+#else
+#define LAMPOMATIC_DEFAULT_DAY_OUTPUTS D2
+#define LAMPOMATIC_DEFAULT_NIGHT_OUTPUTS D1
+#endif
+#ifndef LAMPOMATIC_DAY_OUTPUTS
+#define LAMPOMATIC_DAY_OUTPUTS LAMPOMATIC_DEFAULT_DAY_OUTPUTS
+#endif
+#ifndef LAMPOMATIC_NIGHT_OUTPUTS
+#define LAMPOMATIC_NIGHT_OUTPUTS LAMPOMATIC_DEFAULT_NIGHT_OUTPUTS
+#endif
+#ifndef LAMPOMATIC_GAMMA
+#define LAMPOMATIC_GAMMA gammaCie1931
+#endif
+
+// Perceptual percent to duty. Only multiplications, so it can be constexpr.
+template <uint16_t PwmRange, gamma_t Gamma>
+struct DutyTable
+{
+  uint16_t duty[101];
+
+  constexpr DutyTable() : duty()
+  {
+    for (int percent = 0; percent <= 100; percent++)
+    {
+      double lightness = percent;
+      double luminance = lightness / 100;
+      if (Gamma == gammaCie1931)
+      {
+        luminance = lightness <= 8 ? lightness / 903.3 : ((lightness + 16) / 116) * ((lightness + 16) / 116) * ((lightness + 16) / 116);
+      }
+      duty[percent] = static_cast<uint16_t>(luminance * PwmRange + 0.5);
+    }
+  }
+};
+
+template <typename OutputDriver, gamma_t Gamma, int... Outputs>
+struct Channel
+{
+  typedef OutputDriver Driver;
+  static constexpr uint16_t maxDuty = Driver::maxDuty;
+  static constexpr DutyTable<maxDuty, Gamma> table{};
+  static_assert(table.duty[0] == 0 && table.duty[100] == maxDuty, "Duty table must span the full duty range");
+
+  static void begin()
+  {
+    (beginOutput<Outputs>(), ...);
+  }
+
+  static uint16_t duty(uint8_t percent)
+  {
+    return table.duty[percent > 100 ? 100 : percent];
+  }
+
+  // Level is percent in 16.16 fixed point, fractions are interpolated between table entries.
+  static uint16_t levelDuty(int32_t level)
+  {
+    uint8_t index = level >> 16;
+    if (index >= 100)
+    {
+      return table.duty[100];
+    }
+    uint16_t low = table.duty[index];
+    uint16_t high = table.duty[index + 1];
+    return low + (((uint32_t)(high - low) * (level & 0xFFFF)) >> 16);
+  }
+
+  // Hands the duty to the driver, it only reaches a bus driven output once the set is flushed.
+  static void write(uint16_t duty)
+  {
+    (writeOutput<Outputs>(duty), ...);
+  }
+
+private:
+  template <int Output>
+  static void beginOutput()
+  {
+    if constexpr (Output >= 0)
+    {
+      Driver::template beginOutput<Output>();
+    }
+  }
+
+  template <int Output>
+  static void writeOutput(uint16_t duty)
+  {
+    if constexpr (Output >= 0)
+    {
+      Driver::template set<Output>(duty);
+    }
+  }
+};
+
+template <typename First, typename... Channels>
+struct ChannelSet
+{
+  typedef typename First::Driver Driver;
+  static constexpr uint8_t count = 1 + sizeof...(Channels);
+  // False when the driver keeps the outputs going by itself, then partial duty doesn't keep the ESP awake.
+  static constexpr bool needsTimer = Driver::needsTimer;
+  // True when flush() waits on a bus, see output_driver.h.
+  static constexpr bool blockingFlush = Driver::blockingFlush;
+  static_assert((std::is_same<typename Channels::Driver, Driver>::value && ...), "All channels must be on the same driver");
+
+  static void begin()
+  {
+    Driver::begin();
+    forEach([](auto channel, uint8_t) { decltype(channel)::begin(); });
+  }
+
+  // Sends what the channels wrote since the last flush, in one bus transaction for the drivers that have a bus.
+  static void flush()
+  {
+    Driver::flush();
+  }
+
+  // f(channel, index) for every channel in order, channel being a (stateless) instance of its type.
+  template <typename F>
+  static void forEach(F f)
+  {
+    uint8_t index = 0;
+    f(First{}, index++);
+    (f(Channels{}, index++), ...);
+  }
+
+  // f(channel) for the channel at index, nothing if there isn't one.
+  template <typename F>
+  static void with(uint8_t index, F f)
+  {
+    forEach([index, &f](auto channel, uint8_t at) {
+      if (at == index)
+      {
+        f(channel);
+      }
+    });
+  }
+};
+
+// In channel_t order.
+typedef Channel<OutputDriver, LAMPOMATIC_GAMMA, LAMPOMATIC_DAY_OUTPUTS> DayChannel;
+typedef Channel<OutputDriver, LAMPOMATIC_GAMMA, LAMPOMATIC_NIGHT_OUTPUTS> NightChannel;
+typedef ChannelSet<DayChannel, NightChannel> Outputs;
+
+#endif
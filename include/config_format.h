@@ -0,0 +1,66 @@
+/**********************************************************************************************************
+    Name    : config_format
+    Notes   : Binary format of the persisted config record. The packed config is wrapped in a ConfigHeader
+              with a magic value, format version and CRC32, so a later layout change can be read back
+              through a migration instead of being read as garbage. The only older format so far is the
+              StateContainer that firmware 1.2.1 stored with EEPROM.put, which is migrated straight to
+              the current layout.
+ ***********************************************************************************************************/
+#ifndef CONFIG_FORMAT_H
+#define CONFIG_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "schedule.h"
+
+// Current config layout. Changing it means bumping configFormatVersion, freezing a copy of this layout in
+// config_format.cpp and adding a migration from it.
+struct PersistedConfig
+{
+  uint8_t dstActive;
+  uint8_t dayIntensity;
+  uint8_t nightIntensity;
+  Schedule day;
+  Schedule night;
+  Schedule weekendDay;
+  Schedule weekendNight;
+  uint8_t weeklyActive;
+  WeekSchedule week;
+  // Seconds to fade a channel up when it turns on, and down when it turns off.
+  uint16_t fadeInSeconds[channelCount];
+  uint16_t fadeOutSeconds[channelCount];
+};
+
+struct ConfigHeader
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t length;
+  uint32_t crc;
+};
+
+static_assert(sizeof(PersistedConfig) <= UINT8_MAX, "PersistedConfig no longer fits ConfigHeader::length");
+
+// The runtime record is a single byte of these bits.
+const uint8_t runtimeDayActive = 0x01;
+const uint8_t runtimeNightActive = 0x02;
+
+const uint16_t configMagic = 0x4c4e; // "NL"
+// 0 is the 1.2.1 StateContainer, which has no header.
+const uint8_t configFormatVersion = 1;
+const uint16_t defaultFadeSeconds = 2;
+const uint16_t maxFadeSeconds = 3600;
+const uint16_t configMaxEncodedLength = sizeof(ConfigHeader) + sizeof(PersistedConfig);
+
+uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
+
+// Write header and config into buffer, returns the number of bytes used or 0 if it doesn't fit.
+uint16_t encodeConfig(const PersistedConfig &config, uint8_t *buffer, uint16_t size);
+// Validate and decode a config record, false for anything but the current version.
+bool decodeConfig(const uint8_t *buffer, uint16_t length, PersistedConfig &config);
+// Decode the StateContainer that firmware 1.2.1 and older stored with EEPROM.put at adress 0, runtime gets its output state.
+bool decodeLegacyConfig(const uint8_t *buffer, uint16_t length, PersistedConfig &config, uint8_t &runtime);
+// Size of the 1.2.1 StateContainer, i.e. how much to read for decodeLegacyConfig().
+uint16_t legacyConfigLength();
+
+#endif
@@ -0,0 +1,30 @@
+/**********************************************************************************************************
+    Name    : encoder
+    Notes   : Writes API responses as JSON or MessagePack straight into the page buffer. Callers describe the
+              document once, maps and arrays take their element count up front since MessagePack needs it.
+ ***********************************************************************************************************/
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stdint.h>
+
+typedef enum
+{
+  encodingJson,
+  encodingMsgpack
+} encoding_t;
+
+const uint8_t encoderMaxDepth = 8;
+
+void encodeBegin(encoding_t encoding);
+void encodeMap(uint8_t size);
+void encodeArray(uint8_t size);
+// Closes the innermost map or array.
+void encodeEnd();
+void encodeKey(const char *key);
+void encodeUint(uint32_t value);
+void encodeBool(bool value);
+void encodeString(const char *value);
+void encodeNull();
+
+#endif
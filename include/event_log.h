@@ -0,0 +1,81 @@
+/**********************************************************************************************************
+    Name    : event_log
+    Notes   : Always on event log for finding out afterwards what a lamp did. Events are fixed size binary
+              records in a RAM ring, written with a millis() read and a few stores, nothing is formatted
+              until /log asks for it. Record times are millis() and only become dates when decoded (or
+              mirrored), against the NTP clock at that point.
+              Built with -DLAMPOMATIC_EVENT_LOG_FLASH the ring is also mirrored, in batches, to two sectors
+              at the start of the filesystem area (the journal has its last sector), so the log of
+              earlier boots survives resets and power cuts.
+ ***********************************************************************************************************/
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+typedef enum : uint8_t
+{
+  // detail: rst_info reason (REASON_*), value: exception cause for crashes.
+  eventReset = 1,
+  // detail: runtime bits (runtimeDayActive...) now active, value: minute of the week.
+  eventTransition = 2,
+  // detail: eventSource*, value: CRC of the new config.
+  eventSchedule = 3,
+  // detail: server index, value: correction of the clock in ms, 0 for the first answer of a boot.
+  eventNtpAnswer = 4,
+  // detail: server index, value: failed attempts in a row.
+  eventNtpFailure = 5,
+  // value: RSSI in dBm.
+  eventWifiUp = 6,
+  // value: WiFi.status() once it was noticed.
+  eventWifiDown = 7,
+  // An update is being written, the lamp restarts once it's done.
+  eventUpdate = 8,
+} event_t;
+
+// Where a schedule change came from.
+const uint8_t eventSourcePage = 0;
+const uint8_t eventSourceApi = 1;
+const uint8_t eventSourceFleet = 2;
+
+struct EventRecord
+{
+  // millis() in the ring, UTC seconds once mirrored with a known clock (eventTimeUtc).
+  uint32_t time;
+  uint8_t type;
+  uint8_t detail;
+  uint16_t flags;
+  int32_t value;
+};
+
+const uint16_t eventTimeUtc = 0x0001;
+
+// A power of two, so the index wraps with a mask. 12 bytes per record.
+const uint16_t eventLogCapacity = 128;
+static_assert((eventLogCapacity & (eventLogCapacity - 1)) == 0, "eventLogCapacity must be a power of two");
+
+extern EventRecord eventLogRing[eventLogCapacity];
+// Records ever written, the newest being at (eventLogWritten - 1) % eventLogCapacity.
+extern uint32_t eventLogWritten;
+
+inline void eventLog(event_t type, uint8_t detail, int32_t value)
+{
+  EventRecord &record = eventLogRing[eventLogWritten++ & (eventLogCapacity - 1)];
+  record.time = millis();
+  record.type = type;
+  record.detail = detail;
+  record.flags = 0;
+  record.value = value;
+}
+
+// Finds the end of the flash mirror and logs the reset that started this boot.
+void eventLogBegin();
+// From loop(), mirrors the ring to flash once a batch has piled up. Nothing without LAMPOMATIC_EVENT_LOG_FLASH.
+void eventLogService();
+// Mirror whatever hasn't been yet, e.g. before a restart.
+void eventLogFlush();
+// The log as text, oldest first, one event per line. Output goes through the page module, as a pageSend() producer.
+void eventLogWrite();
+
+#endif
@@ -0,0 +1,31 @@
+/**********************************************************************************************************
+    Name    : events
+    Notes   : Server-Sent Events on top of the regular web server. A GET on the events route hands its
+              connection over to here, and every published event is written to all of them. Clients that
+              can't keep up or have gone away are dropped instead of waited for. The async server build
+              uses its own AsyncEventSource instead.
+ ***********************************************************************************************************/
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <ESP8266WiFi.h>
+#include "http_server.h"
+
+const uint8_t eventsMaxClients = 4;
+const unsigned long eventsKeepAliveIntervall = 15000;
+
+#ifdef LAMPOMATIC_ASYNC_SERVER
+// Serve the event stream on uri.
+void eventsBegin(HttpServer &server, const char *uri);
+#else
+// Take over client as an event stream, returns false when all slots are taken.
+bool eventsAddClient(WiFiClient client);
+#endif
+// True once after a client has connected, so it can be sent the current state.
+bool eventsTakeConnected();
+void eventsPublish(const char *event, const char *data);
+// Drop closed connections and keep idle ones alive, call from loop().
+void eventsService(unsigned long currentMillis);
+uint8_t eventsClientCount();
+
+#endif
@@ -0,0 +1,35 @@
+/**********************************************************************************************************
+    Name    : fade
+    Notes   : Output fades, stepped from a Ticker at a fixed rate so they run alongside loop() and never hold
+              up the web server. Levels are perceptual percent, turned into duty through the channel's
+              table from channel.h, and an output is only written when its duty changes. Every step is
+              flushed to the output driver in one go, by the Ticker for the PWM driver, and from loop()
+              through fadeService() for the bus drivers, whose flushes block.
+ ***********************************************************************************************************/
+#ifndef FADE_H
+#define FADE_H
+
+#include <stdint.h>
+#include "channel.h"
+
+const uint8_t fadeChannels = Outputs::count;
+const uint16_t fadeStepMillis = 20;
+
+// Set up the output pins and PWM range, before anything is faded.
+void fadeBegin();
+// Fade channel to percent over durationMillis, 0 sets it on the next fadeFlush(). Fading to the current target does nothing.
+void fadeTo(uint8_t channel, uint8_t percent, uint32_t durationMillis);
+// Send the outputs set straight away by fadeTo() to the driver, one bus transaction for all channels.
+void fadeFlush();
+// From loop(), sends the latest step to a bus driver.
+void fadeService();
+uint8_t fadeTarget(uint8_t channel);
+bool fadeActive();
+// True while a fade runs or any output sits at a partial duty on a driver that needs the PWM timer.
+bool fadePwmActive();
+// True once after a fade has run to its end.
+bool fadeTakeCompleted();
+// Forget the duty last written, for when an output was written behind the fade engine's back.
+void fadeInvalidate();
+
+#endif
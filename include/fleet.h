@@ -0,0 +1,27 @@
+/**********************************************************************************************************
+    Name    : fleet
+    Notes   : Schedule sharing between lamps with the same fleet key. A changed schedule is sent once to a
+              UDP multicast group as the config record, a generation and an HMAC-SHA256 over both, and every
+              lamp that holds an older generation applies it. Lamps that were off or asleep ask for newer
+              schedules when they join, one lamp that has it answers for all.
+ ***********************************************************************************************************/
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stdint.h>
+#include "config_format.h"
+
+// Called with a verified schedule newer than the lamp's, the generation is to be persisted with it.
+typedef void (*fleetApply_t)(const PersistedConfig &config, uint32_t generation);
+
+// An empty key leaves the fleet off. generation and current are what the lamp runs, 0 if it never shared one.
+void fleetBegin(const char *key, uint32_t generation, const PersistedConfig &current, fleetApply_t apply);
+bool fleetEnabled();
+// From loop(), joins the group once online and handles what was received.
+void fleetService(unsigned long currentMillis, bool online);
+// Send a schedule changed on this lamp to the group. Returns its generation, the UTC time (when known) or just
+// newer than anything seen so far, so the latest change wins across lamps with synced clocks.
+uint32_t fleetShare(const PersistedConfig &config, uint32_t utc);
+uint32_t fleetGeneration();
+
+#endif
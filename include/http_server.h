@@ -0,0 +1,78 @@
+/**********************************************************************************************************
+    Name    : http_server
+    Notes   : The web server the handlers are written against. By default that's ESP8266WebServer as is.
+              Building with LAMPOMATIC_ASYNC_SERVER swaps in a wrapper around ESPAsyncWebServer with the
+              same calls, so the handlers run from the async TCP callbacks, several clients at a time,
+              without waiting for loop().
+ ***********************************************************************************************************/
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#ifdef LAMPOMATIC_ASYNC_SERVER
+
+#include <ESPAsyncWebServer.h>
+
+const uint8_t httpMaxHeaders = 4;
+const uint16_t httpMaxBody = 1536;
+
+// Handlers run one at a time from the async callbacks, the request being handled is kept while they run.
+// Handlers must not block or yield(), they aren't on the loop() stack any more.
+class HttpServer
+{
+public:
+  typedef void (*THandlerFunction)();
+
+  explicit HttpServer(uint16_t port);
+  void begin();
+  void handleClient() {}
+  void collectHeaders(const char *[], size_t) {}
+  void on(const char *uri, WebRequestMethodComposite method, THandlerFunction handler);
+  void onNotFound(THandlerFunction handler);
+
+  bool hasArg(const char *name) const;
+  String arg(const char *name) const;
+  bool hasArg(const String &name) const { return hasArg(name.c_str()); }
+  String arg(const String &name) const { return arg(name.c_str()); }
+  // Arguments by index, for going through all of them once.
+  int args() const;
+  const String &argName(int i) const;
+  const String &arg(int i) const;
+  String header(const char *name) const;
+
+  // Headers are kept until the response goes out.
+  void sendHeader(const char *name, const char *value);
+  void send(int code);
+  void send(int code, const char *contentType, const String &content);
+
+  // Chunked response for the page module. fill is called for every chunk, with room for length bytes, until it
+  // returns 0. done is called when the connection closes, whether the response got out or not.
+  typedef size_t (*TFillFunction)(uint8_t *data, size_t length);
+  void sendChunked(int code, const char *contentType, TFillFunction fill, std::function<void()> done);
+
+  AsyncWebServer &backend() { return server; }
+
+private:
+  void handle(AsyncWebServerRequest *request, THandlerFunction handler);
+  void addHeaders(AsyncWebServerResponse *response);
+
+  AsyncWebServer server;
+  AsyncWebServerRequest *request;
+  const char *headerNames[httpMaxHeaders];
+  String headerValues[httpMaxHeaders];
+  uint8_t headerCount;
+  // Body of PUT/POST requests that aren't forms, read back as arg("plain") like ESP8266WebServer does.
+  AsyncWebServerRequest *bodyRequest;
+  char body[httpMaxBody + 1];
+  size_t bodyLength;
+  bool bodyTruncated;
+};
+
+#else
+
+#include <ESP8266WebServer.h>
+
+typedef ESP8266WebServer HttpServer;
+
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+/**********************************************************************************************************
+    Name    : journal
+    Notes   : Append-only record journal living in the (emulated) EEPROM flash sector and the last
+              sector of the filesystem area, which this sketch doesn't otherwise use.
+              Records are appended into erased space and only when a sector is full is the latest
+              record of each type copied into the other one. This keeps flash erases (and the loop
+              stalls they cause) to a minimum, and the old sector is kept until the copy is complete,
+              so a power cut while compacting loses nothing. A flash layout without a filesystem area
+              compacts the EEPROM sector in place, which a power cut at the wrong moment can wipe.
+ ***********************************************************************************************************/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Record types, one latest value of each is kept through compaction.
+typedef enum : uint8_t
+{
+  recordConfig = 1,
+  recordRuntime = 2,
+  // Generation of the fleet schedule the config came with, see fleet.h.
+  recordFleet = 3,
+} journalRecord_t;
+
+const uint8_t journalRecordTypes = 3;
+const uint16_t journalMaxPayload = 248;
+
+// Pick the newest complete sector and locate the latest record of each type. Returns false if neither holds a journal.
+bool journalBegin();
+// Append a record. Compacts into the other sector first if there's no room left.
+bool journalAppend(journalRecord_t type, const void *payload, uint16_t length);
+// Copy the latest record of type into payload. Returns its length, or -1 if there is none or it's longer than maxLength.
+int16_t journalReadLatest(journalRecord_t type, void *payload, uint16_t maxLength);
+// Raw read from the start of the EEPROM sector, used to pick up data stored by older firmware.
+bool journalReadRaw(uint32_t offset, void *data, uint16_t length);
+
+uint32_t journalEraseCount();
+// Records written and flash bytes they took (headers and padding included) since boot, compaction rewrites count too.
+uint32_t journalWriteCount();
+uint32_t journalBytesWritten();
+
+#endif
@@ -0,0 +1,43 @@
+/**********************************************************************************************************
+    Name    : json_reader
+    Notes   : Pull parser for request bodies. The caller walks the document with the functions below and
+              skips what it doesn't know, nothing is copied or allocated. Any error sticks, so a whole
+              document can be read and checked once at the end with jsonFinished().
+ ***********************************************************************************************************/
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+const uint8_t jsonMaxDepth = 16;
+
+struct JsonReader
+{
+  const char *position;
+  const char *end;
+  bool failed;
+  uint8_t depth;
+  // Bit per level, set while the next key or element is the first one.
+  uint32_t first;
+};
+// Levels are counted from 1, so jsonMaxDepth needs the bit above it.
+static_assert(jsonMaxDepth < sizeof(JsonReader::first) * 8, "jsonMaxDepth doesn't fit in JsonReader::first");
+
+void jsonBegin(JsonReader &reader, const char *text, size_t length);
+bool jsonBeginObject(JsonReader &reader);
+// Read the next key of the current object, false at its end.
+bool jsonNextKey(JsonReader &reader, char *key, size_t size);
+bool jsonBeginArray(JsonReader &reader);
+// Move to the next element of the current array, false at its end.
+bool jsonNextElement(JsonReader &reader);
+bool jsonReadBool(JsonReader &reader, bool &value);
+bool jsonReadUint(JsonReader &reader, uint32_t &value);
+bool jsonReadString(JsonReader &reader, char *value, size_t size);
+// Consumes a null and returns true, leaves anything else alone.
+bool jsonReadNull(JsonReader &reader);
+void jsonSkip(JsonReader &reader);
+// True when the document was read without errors and nothing but whitespace is left.
+bool jsonFinished(JsonReader &reader);
+
+#endif
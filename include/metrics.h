@@ -0,0 +1,38 @@
+/**********************************************************************************************************
+    Name    : metrics
+    Notes   : Timing histograms and Prometheus text output for /metrics. Buckets are fixed powers of two,
+              so recording a sample is a count leading zeros, an increment and an add, cheap enough to
+              leave on in every build. Counters stay with the modules that own them, this only writes them out.
+ ***********************************************************************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Bucket 0 holds samples up to metricsFirstBound us, every next one twice as long, the last one the rest.
+const uint8_t metricsBuckets = 16;
+const uint32_t metricsFirstBound = 16;
+
+struct MetricsHistogram
+{
+  uint32_t buckets[metricsBuckets + 1];
+  uint64_t sumMicros;
+};
+
+inline void metricsRecord(MetricsHistogram &histogram, uint32_t micros)
+{
+  // Bucket b covers (metricsFirstBound << (b - 1), metricsFirstBound << b], 28 being 31 - log2(metricsFirstBound) + 1.
+  uint8_t bucket = micros <= metricsFirstBound ? 0 : 28 - __builtin_clz(micros - 1);
+  histogram.buckets[bucket > metricsBuckets ? metricsBuckets : bucket]++;
+  histogram.sumMicros += micros;
+}
+
+// Output goes through the page module, from a pageSend() producer. labels is the inside of the braces, or nullptr.
+void metricsWriteType(const char *name, const char *type, const char *help);
+void metricsWriteHistogram(const char *name, const char *labels, const MetricsHistogram &histogram);
+void metricsWriteValue(const char *name, const char *labels, uint32_t value);
+void metricsWriteValue(const char *name, const char *labels, int32_t value);
+// Written as seconds, the Prometheus base unit.
+void metricsWriteSeconds(const char *name, const char *labels, uint64_t micros);
+
+#endif
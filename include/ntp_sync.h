@@ -0,0 +1,30 @@
+/**********************************************************************************************************
+    Name    : ntp_sync
+    Notes   : Non-blocking NTP client. Requests are sent and answers polled for across loop() iterations,
+              falling over to the next server on timeouts. The drift of the local clock against NTP is
+              measured and compensated for, and the sync intervall is stretched once it's characterized.
+ ***********************************************************************************************************/
+#ifndef NTP_SYNC_H
+#define NTP_SYNC_H
+
+#include <TimeLib.h>
+
+void ntpBegin();
+// Start from a time known some other way (cached over a reset) until the first answer, no-op once synced.
+void ntpSeed(uint64_t epochMs, int32_t driftPpm);
+// Drive the sync from loop(), returns true when a new answer has been received.
+bool ntpService(unsigned long currentMillis, bool online);
+// True while a lookup or request is in flight and ntpService() should be called often.
+bool ntpBusy();
+// Drift compensated UTC, 0 until the first answer.
+time_t ntpNow();
+uint64_t ntpNowMs();
+
+int32_t ntpDriftPpm();
+unsigned long ntpSyncIntervall();
+// Answers and failed attempts (timeouts, failed lookups) since boot, and the round trip of the latest answer in ms.
+uint32_t ntpAnswerCount();
+uint32_t ntpFailureCount();
+unsigned long ntpLastRoundTrip();
+
+#endif
@@ -0,0 +1,21 @@
+/**********************************************************************************************************
+    Name    : ota
+    Notes   : Firmware updates over the network. Pushed with ArduinoOTA (espota, e.g. pio run -t upload with
+              upload_protocol = espota), or pulled from an HTTP server when built with -DLAMPOMATIC_UPDATE_URL.
+              Either way the image is streamed into the free flash behind the running sketch, never held in
+              RAM, before the bootloader copies it over the old one on the next boot. Images may be gzip
+              compressed, the bootloader unpacks them while copying.
+              The MD5 alongside an image only catches a broken transfer. Pulled images must be signed, built
+              with -DLAMPOMATIC_UPDATE_PUBLIC_KEY (which then applies to pushed ones too), and one without a
+              valid signature is refused.
+ ***********************************************************************************************************/
+#ifndef OTA_H
+#define OTA_H
+
+// password protects pushed updates, pulled ones are trusted by their signature. beforeUpdate (may be null) is called
+// once an update starts, the last chance to save anything before the restart.
+void otaBegin(const char *password, void (*beforeUpdate)());
+// From loop(). A pushed update is received inside this call, and either way the device restarts once it's written.
+void otaService(unsigned long currentMillis, bool online);
+
+#endif
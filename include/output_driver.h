@@ -0,0 +1,241 @@
+/**********************************************************************************************************
+    Name    : output_driver
+    Notes   : Backends behind the channels in channel.h, picked with a build flag. A driver takes duty per
+              output with set<Output>() and pushes everything that changed with flush(), so a fade step or a
+              transition is one bus transaction however many outputs moved. A driver with blockingFlush
+              waits on its bus in flush(), which must then never run from a Ticker (the SDK task WiFi
+              runs in too), only from loop().
+                PWM      (default)                   outputs are pins, written straight away
+                PCA9685  -DLAMPOMATIC_PCA9685=0x40   outputs 0-15 of the chip at that I2C address, 12 bit
+                WS2812   -DLAMPOMATIC_WS2812=<pixels> outputs are colour components (pixelRed...), set on
+                                                     every pixel, sent by I2S DMA on the RX pin (GPIO3)
+ ***********************************************************************************************************/
+#ifndef OUTPUT_DRIVER_H
+#define OUTPUT_DRIVER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <type_traits>
+
+#ifndef LAMPOMATIC_PWM_RANGE
+#define LAMPOMATIC_PWM_RANGE 1023
+#endif
+
+// The ESP8266 core's own PWM. Software generated, so it needs the timer (and no light sleep) while any pin is dimmed.
+struct PwmDriver
+{
+  static constexpr uint16_t maxDuty = LAMPOMATIC_PWM_RANGE;
+  static constexpr bool needsTimer = true;
+  static constexpr bool blockingFlush = false;
+
+  // One range for all pins.
+  static void begin()
+  {
+    analogWriteRange(maxDuty);
+  }
+
+  template <int Output>
+  static void beginOutput()
+  {
+    pinMode(Output, OUTPUT);
+  }
+
+  // Fully on or off is a plain level without a waveform, which keeps running through light sleep.
+  template <int Output>
+  static void set(uint16_t duty)
+  {
+    if (duty >= maxDuty)
+    {
+      digitalWrite(Output, HIGH);
+    }
+    else if (duty > 0)
+    {
+      analogWrite(Output, duty);
+    }
+    else
+    {
+      digitalWrite(Output, LOW);
+    }
+  }
+
+  static void flush()
+  {
+  }
+};
+
+#ifdef LAMPOMATIC_PCA9685
+#include <Wire.h>
+
+#ifndef LAMPOMATIC_PCA9685_HZ
+#define LAMPOMATIC_PCA9685_HZ 1000
+#endif
+
+// 16 channel, 12 bit I2C PWM chip. The chip keeps its outputs running on its own, the ESP can sleep through anything.
+template <uint8_t Address, uint16_t Hz>
+struct Pca9685Driver
+{
+  static constexpr uint16_t maxDuty = 4095;
+  static constexpr bool needsTimer = false;
+  // Bit banged I2C, up to ~6 ms at 100 kHz.
+  static constexpr bool blockingFlush = true;
+  static constexpr uint8_t outputCount = 16;
+
+  static constexpr uint8_t registerMode1 = 0x00;
+  static constexpr uint8_t registerMode2 = 0x01;
+  static constexpr uint8_t registerLed0 = 0x06;
+  static constexpr uint8_t registerPrescale = 0xFE;
+  static constexpr uint8_t mode1AutoIncrement = 0x20;
+  static constexpr uint8_t mode1Sleep = 0x10;
+  static constexpr uint8_t mode2TotemPole = 0x04;
+  // Bit 12 of the on or off count forces the output fully on or off.
+  static constexpr uint16_t fullCount = 0x1000;
+  // 25 MHz oscillator, 4096 counts per period, rounded.
+  static constexpr uint8_t prescale = (25000000UL + 2048UL * Hz) / (4096UL * Hz) - 1;
+  static_assert(prescale >= 3, "PCA9685 runs at 1526 Hz at most");
+
+  static inline uint16_t duties[outputCount] = {};
+  // Every output starts out dirty, so the first flush turns them all off.
+  static inline uint16_t dirty = 0xFFFF;
+
+  static void begin()
+  {
+    Wire.begin();
+    writeRegister(registerMode1, mode1Sleep | mode1AutoIncrement); // The prescaler can only be set while asleep.
+    writeRegister(registerPrescale, prescale);
+    writeRegister(registerMode1, mode1AutoIncrement);
+    delayMicroseconds(500); // Oscillator start up.
+    writeRegister(registerMode2, mode2TotemPole);
+    flush();
+  }
+
+  template <int Output>
+  static void beginOutput()
+  {
+    static_assert(Output < outputCount, "PCA9685 has outputs 0-15");
+  }
+
+  template <int Output>
+  static void set(uint16_t duty)
+  {
+    if (duties[Output] != duty)
+    {
+      duties[Output] = duty;
+      dirty |= 1 << Output;
+    }
+  }
+
+  // First to last changed output in one auto incremented write, 65 bytes at most, within the Wire buffer.
+  static void flush()
+  {
+    if (dirty == 0)
+    {
+      return;
+    }
+    uint8_t first = __builtin_ctz(dirty);
+    uint8_t last = 31 - __builtin_clz(dirty);
+    Wire.beginTransmission(Address);
+    Wire.write(registerLed0 + 4 * first);
+    for (uint8_t output = first; output <= last; output++)
+    {
+      uint16_t duty = duties[output];
+      uint16_t on = duty >= maxDuty ? fullCount : 0;
+      uint16_t off = duty == 0 ? fullCount : (duty >= maxDuty ? 0 : duty);
+      Wire.write(on & 0xFF);
+      Wire.write(on >> 8);
+      Wire.write(off & 0xFF);
+      Wire.write(off >> 8);
+    }
+    Wire.endTransmission();
+    dirty = 0;
+  }
+
+  static void writeRegister(uint8_t reg, uint8_t value)
+  {
+    Wire.beginTransmission(Address);
+    Wire.write(reg);
+    Wire.write(value);
+    Wire.endTransmission();
+  }
+};
+#endif
+
+#ifdef LAMPOMATIC_WS2812
+#include <NeoPixelBus.h>
+
+// Colour components of a pixel, as WS2812 outputs. pixelWhite only on RGBW (SK6812) strips.
+const int pixelRed = 0;
+const int pixelGreen = 1;
+const int pixelBlue = 2;
+const int pixelWhite = 3;
+
+// WS2812/SK6812 strip, every pixel the same colour. The DMA sends the frame in the background and the strip holds it.
+template <uint16_t PixelCount, bool Rgbw>
+struct Ws2812Driver
+{
+  static constexpr uint16_t maxDuty = 255;
+  static constexpr bool needsTimer = false;
+  static constexpr bool blockingFlush = true;
+  typedef NeoPixelBus<typename std::conditional<Rgbw, NeoGrbwFeature, NeoGrbFeature>::type, NeoEsp8266Dma800KbpsMethod> Strip;
+
+  static inline Strip strip{PixelCount};
+  static inline uint8_t levels[4] = {};
+  static inline bool dirty = true;
+
+  static void begin()
+  {
+    strip.Begin();
+    flush();
+  }
+
+  template <int Output>
+  static void beginOutput()
+  {
+    static_assert(Output < (Rgbw ? 4 : 3), "pixelWhite needs an RGBW strip");
+  }
+
+  template <int Output>
+  static void set(uint16_t duty)
+  {
+    if (levels[Output] != duty)
+    {
+      levels[Output] = duty;
+      dirty = true;
+    }
+  }
+
+  // Show() waits for the previous frame to be sent, about 30 us per pixel.
+  static void flush()
+  {
+    if (!dirty)
+    {
+      return;
+    }
+    if constexpr (Rgbw)
+    {
+      strip.ClearTo(RgbwColor(levels[pixelRed], levels[pixelGreen], levels[pixelBlue], levels[pixelWhite]));
+    }
+    else
+    {
+      strip.ClearTo(RgbColor(levels[pixelRed], levels[pixelGreen], levels[pixelBlue]));
+    }
+    strip.Show();
+    dirty = false;
+  }
+};
+#endif
+
+#if defined(LAMPOMATIC_PCA9685) && defined(LAMPOMATIC_WS2812)
+#error "Pick one output driver"
+#elif defined(LAMPOMATIC_PCA9685)
+typedef Pca9685Driver<LAMPOMATIC_PCA9685, LAMPOMATIC_PCA9685_HZ> OutputDriver;
+#elif defined(LAMPOMATIC_WS2812)
+#ifdef LAMPOMATIC_WS2812_RGBW
+typedef Ws2812Driver<LAMPOMATIC_WS2812, true> OutputDriver;
+#else
+typedef Ws2812Driver<LAMPOMATIC_WS2812, false> OutputDriver;
+#endif
+#else
+typedef PwmDriver OutputDriver;
+#endif
+
+#endif
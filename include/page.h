@@ -0,0 +1,38 @@
+/**********************************************************************************************************
+    Name    : page
+    Notes   : Chunked output for the web server. Text is collected in a small static buffer and sent as a
+              chunk whenever it fills up, so a page never needs more than that buffer no matter how long
+              it is. Templates live in PROGMEM, with %NAME% fields filled in by a processor callback.
+              The body comes from a producer function. With ESP8266WebServer it runs once, straight out.
+              The async server asks for the body a chunk at a time from its TCP callbacks, so the producer
+              runs again for every chunk and its output is counted in pieces, one per print call or run of
+              template text, skipping the pieces already sent. A formatted piece that doesn't fit the chunk
+              waits in the buffer for the next one, it's never split between two runs. Values that move
+              between chunks show as they were when their piece went out. One async page streams at a time,
+              another one asked for meanwhile gets a 503.
+ ***********************************************************************************************************/
+#ifndef PAGE_H
+#define PAGE_H
+
+#include "http_server.h"
+
+typedef void (*pageProducer_t)();
+typedef void (*pageProcessor_t)(const char *field);
+
+const uint16_t pageBufferSize = 256;
+const uint8_t pageMaxFieldLength = 24;
+
+// Send a chunked response, producer writes the body through the print functions below. Headers set on the server
+// beforehand go with it.
+void pageSend(HttpServer &server, int code, const char *contentType, pageProducer_t producer);
+// True while the async server is still streaming a page, pageSend() answers 503 until it's done.
+bool pageBusy();
+void pagePrint(const char *text);
+// Raw bytes, for binary bodies.
+void pageWrite(const uint8_t *data, size_t length);
+void pagePrint_P(PGM_P text);
+void pagePrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+// Copy a PROGMEM template, calling processor with the name of every %NAME% field.
+void pageRender_P(PGM_P pageTemplate, pageProcessor_t processor);
+
+#endif
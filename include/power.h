@@ -0,0 +1,29 @@
+/**********************************************************************************************************
+    Name    : power
+    Notes   : Idle time between loop() iterations. Instead of spinning, loop() hands the time until it's
+              next needed to powerIdle(), which sleeps it away in modem sleep (radio off between beacons)
+              or light sleep (CPU clock stopped too). Light sleep stops the PWM timer, so it's only used
+              while every output is fully on or off, otherwise modem sleep is as deep as it goes.
+ ***********************************************************************************************************/
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+
+typedef enum : uint8_t
+{
+  powerAwake,
+  powerModemSleep,
+  powerLightSleep
+} powerMode_t;
+
+// Beacons slept through in light sleep, each is ~100 ms of extra latency for incoming requests.
+const uint8_t powerListenInterval = 3;
+
+// mode is the deepest sleep allowed, powerAwake keeps loop() spinning like it always has.
+void powerBegin(powerMode_t mode);
+// Sleep up to idleMillis. pwmNeeded rules out light sleep for now.
+void powerIdle(unsigned long idleMillis, bool pwmNeeded);
+powerMode_t powerActiveMode();
+
+#endif
@@ -0,0 +1,35 @@
+/**********************************************************************************************************
+    Name    : rtc_cache
+    Notes   : State kept in RTC user memory, which survives resets and crashes (not power cuts) and costs no
+              flash wear. Holds the clock, as UTC against the RTC timer that keeps counting through a reset,
+              so a lamp that resets picks up the time straight away instead of waiting for wifi and NTP, and
+              the output state, so transitions needn't go to flash each time. Everything is behind a CRC,
+              anything that doesn't check out is treated as not there.
+ ***********************************************************************************************************/
+#ifndef RTC_CACHE_H
+#define RTC_CACHE_H
+
+#include <stdint.h>
+
+// How long a cached time is trusted for across a reset, longer gaps mean the RTC timer was reset with the chip.
+const uint32_t rtcClockMaxGapMs = 600000;
+// How often loop() should refresh the cached time, well within rtcClockMaxGapMs.
+const unsigned long rtcClockSaveIntervall = 60000;
+
+// Transitions only update the cached runtime record, flash gets it this long after the last write at most.
+const unsigned long runtimeFlushIntervall = 24 * 3600000UL;
+
+// Read what the last boot left, call before anything else in here.
+void rtcCacheBegin();
+
+// Cache UTC in ms as of now and the drift measured for the millis() clock.
+void rtcClockSave(uint64_t utcMs, int32_t driftPpm);
+// UTC in ms as of now, extrapolated over the reset, false if there's nothing valid or it's too old.
+bool rtcClockRestore(uint64_t &utcMs, int32_t &driftPpm);
+
+// Cache the runtime record (runtimeDayActive...) for the config with CRC configCrc, flushed when it's in flash too.
+void rtcRuntimeSave(uint8_t runtime, uint32_t configCrc, bool flushed);
+// The cached runtime record, false if there is none for the config with CRC configCrc.
+bool rtcRuntimeRestore(uint8_t &runtime, uint32_t configCrc, bool &flushed);
+
+#endif
@@ -0,0 +1,82 @@
+/**********************************************************************************************************
+    Name    : schedule
+    Notes   : Compact schedule representation, start and end as minutes since midnight, or as minutes
+              from sunrise or sunset (see sun.h). Either the day/night schedules with an optional weekend
+              override, or a weekly schedule of slots per weekday.
+ ***********************************************************************************************************/
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+
+const uint16_t minutesPerDay = 24 * 60;
+
+typedef enum : uint8_t
+{
+  channelDay = 0,
+  channelNight = 1
+} channel_t;
+
+const uint8_t channelCount = 2;
+
+const uint8_t daysPerWeek = 7;
+// Slots per weekday in the weekly schedule.
+const uint8_t slotsPerDay = 4;
+
+// Schedule flags
+const uint8_t scheduleEnabled = 0x01;
+// Weekly slots only, the slot drives the night channel instead of the day channel.
+const uint8_t scheduleNight = 0x02;
+// The start (or end) minute is a signed offset from sunrise, or from sunset with the Sunset flag as well.
+const uint8_t scheduleStartSun = 0x04;
+const uint8_t scheduleStartSunset = 0x08;
+const uint8_t scheduleEndSun = 0x10;
+const uint8_t scheduleEndSunset = 0x20;
+
+struct __attribute__((packed)) Schedule
+{
+  uint16_t startMinute;
+  uint16_t endMinute;
+  uint8_t flags;
+};
+
+// Per weekday schedule, slots[0] is sunday like TimeLib's weekday() - 1. A slot ending before it starts runs into the next day.
+struct WeekSchedule
+{
+  Schedule slots[daysPerWeek][slotsPerDay];
+};
+
+struct OutputState
+{
+  bool dayActive;
+  bool nightActive;
+};
+
+inline uint16_t minuteOfDay(int hour, int minute)
+{
+  return hour * 60 + minute;
+}
+
+inline bool scheduleIsEnabled(const Schedule &schedule)
+{
+  return schedule.flags & scheduleEnabled;
+}
+
+inline Schedule makeSchedule(uint16_t startMinute, uint16_t endMinute)
+{
+  Schedule schedule = {startMinute, endMinute, scheduleEnabled};
+  return schedule;
+}
+
+inline channel_t scheduleChannel(const Schedule &schedule)
+{
+  return schedule.flags & scheduleNight ? channelNight : channelDay;
+}
+
+inline Schedule disabledSchedule()
+{
+  Schedule schedule = {0, 0, 0};
+  return schedule;
+}
+
+#endif
@@ -0,0 +1,45 @@
+/**********************************************************************************************************
+    Name    : schedule_form
+    Notes   : Reads the POST /time form in one pass over its fields, straight into a PersistedConfig.
+              The caller feeds every name/value pair to formField() in whatever order they came, then
+              formFinish() checks what has to be there. Nothing is allocated, the first bad field is kept
+              so the reply can name it.
+ ***********************************************************************************************************/
+#ifndef SCHEDULE_FORM_H
+#define SCHEDULE_FORM_H
+
+#include <stdint.h>
+#include "config_format.h"
+
+const uint8_t formFieldNameLength = 20;
+
+struct ScheduleForm
+{
+  // The current config going in, fields in the form overwrite it. Only valid once formFinish() returns true.
+  PersistedConfig config;
+  // Day, night, weekend day, weekend night and the weekly slots, moved into config by formFinish() for the chosen mode.
+  Schedule schedules[4];
+  WeekSchedule week;
+  bool weekly;
+  // Bit per known field, set once it had a value.
+  uint32_t present;
+  // Bit per weekly slot (weekday * slotsPerDay + slot) that had a start or an end.
+  uint32_t slotStarts;
+  uint32_t slotEnds;
+  // Compared while the field is in scope, nothing of the request is kept.
+  const char *password;
+  bool gatekeeperSent;
+  bool gatekeeperOk;
+  // First field that was missing or invalid, empty while the form is fine.
+  char invalidField[formFieldNameLength];
+  const char *expected;
+};
+
+// password is what the gatekeeper field has to match, it must outlive the form.
+void formBegin(ScheduleForm &form, const PersistedConfig &current, const char *password);
+// Unknown fields are ignored. An empty value counts as the field not being there.
+void formField(ScheduleForm &form, const char *name, const char *value);
+// False, with invalidField and expected set, unless a complete schedule was posted.
+bool formFinish(ScheduleForm &form);
+
+#endif
@@ -0,0 +1,47 @@
+/**********************************************************************************************************
+    Name    : scheduler
+    Notes   : Derives the output state directly from the time of week, and the time until the next
+              transition. The schedules are compiled into a sorted table of transitions that's binary
+              searched, so nothing needs to run between transitions and a missed transition corrects
+              itself on the next evaluation. A new table is built next to the running one and swapped in
+              whole, so a half built table is never looked at. Endpoints relative to the sun are resolved
+              to minutes while compiling, from the sunrise and sunset set for each weekday.
+ ***********************************************************************************************************/
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "schedule.h"
+
+const uint16_t minutesPerWeek = 7 * minutesPerDay;
+const uint8_t schedulerMaxTransitions = 2 * daysPerWeek * slotsPerDay;
+
+// Local minutes from midnight of the weekday. Below 0 or from minutesPerDay on when that day's sunrise or sunset
+// falls on the day before or after.
+struct SunDay
+{
+  int16_t sunrise;
+  int16_t sunset;
+};
+
+// Sunrise and sunset per weekday, sunday first, for the next compile. Until set it's 06:00 and 18:00 every day.
+void schedulerSetSun(const SunDay days[daysPerWeek]);
+
+// Compile the schedules into the weekly windows. The weekend schedules, when enabled, override
+// friday evening through sunday morning. Returns false, keeping the running table, if it came out the same.
+bool schedulerCompile(const Schedule &day, const Schedule &night, const Schedule &weekendDay, const Schedule &weekendNight);
+// Compile a weekly schedule, every enabled slot is a window on its weekday. Returns like schedulerCompile().
+bool schedulerCompileWeek(const WeekSchedule &week);
+OutputState schedulerStateAt(uint16_t minuteOfWeek);
+// Minutes from minuteOfWeek until the next transition, 0 if the state never changes.
+uint16_t schedulerMinutesToNextTransition(uint16_t minuteOfWeek);
+uint8_t schedulerTransitionCount();
+
+// Minute of the week for a local epoch time, 0 is sunday 00:00 like TimeLib's weekday() - 1.
+inline uint16_t minuteOfWeek(uint32_t localTime)
+{
+  // 1970-01-01 was a thursday.
+  return (localTime / 60 + 4 * minutesPerDay) % minutesPerWeek;
+}
+
+#endif
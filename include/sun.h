@@ -0,0 +1,32 @@
+/**********************************************************************************************************
+    Name    : sun
+    Notes   : Civil sunrise and sunset (the sun 6 degrees below the horizon, when it gets light and dark
+              outside) for a latitude and longitude, and schedule endpoints relative to them, written as
+              "sunset", "sunset-30" or "sunrise+15". The times are worked out once a local day for the
+              week ahead and handed to the scheduler, which resolves the endpoints while compiling, so
+              looking up the state costs the same as with fixed times.
+ ***********************************************************************************************************/
+#ifndef SUN_H
+#define SUN_H
+
+#include <stdint.h>
+#include "schedule.h"
+
+// Offsets from sunrise or sunset go up to this many minutes either way.
+const int16_t sunMaxOffset = 240;
+// Buffer size including the terminator, "sunrise-240".
+const uint8_t endpointTextLength = 12;
+
+// Sunrise and sunset of a UTC day (days since 1970-01-01) in minutes from its midnight UTC, which may fall on the
+// day before or after. Latitude north and longitude east in degrees. False when the sun doesn't cross the line that
+// day: in polar night both are solar noon, in a night that never gets dark sunrise is 12 hours and a minute before
+// noon and sunset as much after, overlapping the days before and after. The scheduler makes those always night and
+// always day.
+bool sunTimes(int32_t utcDay, double latitude, double longitude, int16_t &sunrise, int16_t &sunset);
+
+// Start or end of schedule as "HH:MM" or relative to the sun, returns text.
+char *formatScheduleEndpoint(const Schedule &schedule, bool start, char text[endpointTextLength]);
+// Either form, schedule is left alone unless text is one.
+bool parseScheduleEndpoint(const char *text, Schedule &schedule, bool start);
+
+#endif
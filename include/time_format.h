@@ -0,0 +1,23 @@
+/**********************************************************************************************************
+    Name    : time_format
+    Notes   : HH:MM and HH:MM:SS formatting into caller provided buffers, digits come from a lookup table
+              so nothing is allocated. Shared by the pages, the JSON API and the serial debug output.
+              Parsing is the strict HH:MM a time input sends.
+ ***********************************************************************************************************/
+#ifndef TIME_FORMAT_H
+#define TIME_FORMAT_H
+
+#include <stdint.h>
+
+// Buffer sizes including the terminator.
+const uint8_t minuteTextLength = 6;
+const uint8_t timeTextLength = 9;
+
+// Minute of day as "HH:MM", returns text.
+char *formatMinuteOfDay(uint16_t minute, char text[minuteTextLength]);
+// "HH:MM:SS", returns text.
+char *formatTimeOfDay(uint8_t hour, uint8_t minute, uint8_t second, char text[timeTextLength]);
+// Exactly "HH:MM" within a day, minute is left alone unless it is.
+bool parseMinuteOfDay(const char *text, uint16_t &minute);
+
+#endif
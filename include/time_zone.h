@@ -0,0 +1,26 @@
+/**********************************************************************************************************
+    Name    : time_zone
+    Notes   : POSIX TZ rules, e.g. "CET-1CEST,M3.5.0,M10.5.0/3", for turning UTC into local time with DST
+              applied automatically. The offset is worked out once per period between two clock changes
+              and cached together with the period's bounds, so a conversion is a compare and an add.
+ ***********************************************************************************************************/
+#ifndef TIME_ZONE_H
+#define TIME_ZONE_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Parse a TZ string, false (keeping the zone that was set before) if it isn't one. UTC until this is called.
+bool tzBegin(const char *rules);
+// True when the zone changes its clocks.
+bool tzHasDst();
+time_t tzLocal(time_t utc);
+// Offset from UTC in seconds at utc. Unlike tzLocal() it leaves the cache alone, for looking ahead without changing
+// what tzNextChange() and tzDstActive() describe.
+int32_t tzOffsetAt(time_t utc);
+// UTC of the clock change after the last converted time, the cached offset doesn't hold from there on.
+time_t tzNextChange();
+// Whether DST is in effect as of the last converted time.
+bool tzDstActive();
+
+#endif
@@ -0,0 +1,50 @@
+#include <Arduino.h>
+#include "boot_guard.h"
+
+// The first 128 bytes (32 blocks) of RTC user memory hold the bootloader's command for applying an update.
+static const uint32_t bootGuardBlock = 32;
+static const uint32_t bootGuardMagic = 0x4C4D4247; // "LMBG"
+
+struct BootGuardRecord
+{
+  uint32_t magic;
+  uint32_t failures;
+  // Inverted failures, so random power on contents don't pass for a record.
+  uint32_t check;
+};
+
+static uint8_t failuresAtBoot = 0;
+
+static void writeRecord(uint32_t failures)
+{
+  BootGuardRecord record = {bootGuardMagic, failures, ~failures};
+  ESP.rtcUserMemoryWrite(bootGuardBlock, reinterpret_cast<uint32_t *>(&record), sizeof(record));
+}
+
+bool bootGuardBegin()
+{
+  BootGuardRecord record;
+  uint32_t failures = 0;
+  if (ESP.rtcUserMemoryRead(bootGuardBlock, reinterpret_cast<uint32_t *>(&record), sizeof(record)) &&
+      record.magic == bootGuardMagic && record.check == ~record.failures)
+  {
+    failures = record.failures;
+  }
+  failuresAtBoot = failures > 255 ? 255 : failures;
+  writeRecord(failures + 1);
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("Failed boots before this one: ");
+  Serial.println(failures);
+#endif
+  return failures >= bootGuardMaxFailures;
+}
+
+void bootGuardHealthy()
+{
+  writeRecord(0);
+}
+
+uint8_t bootGuardFailures()
+{
+  return failuresAtBoot;
+}
@@ -0,0 +1,210 @@
+#include <string.h>
+#include "config_format.h"
+#include "sun.h"
+
+// Frozen layout of the only older format. Never change it, a new version gets its own frozen copy of the layout
+// it replaces.
+
+// Version 0, the whole StateContainer as firmware 1.2.1 wrote it with EEPROM.put.
+struct LegacySchedule
+{
+  int32_t timerIds[6];
+  int32_t startHour;
+  int32_t startMinute;
+  int32_t endHour;
+  int32_t endMinute;
+};
+
+struct LegacyStateContainer
+{
+  bool persistedInEEPROM;
+  bool initialized;
+  bool dstActive;
+  LegacySchedule day;
+  LegacySchedule night;
+  LegacySchedule weekendDay;
+  LegacySchedule weekendNight;
+  int32_t dayIntensity;
+  int32_t nightIntensity;
+  bool dayActive;
+  bool nightActive;
+};
+
+static_assert(sizeof(LegacySchedule) == 40, "LegacySchedule must match what firmware 1.2.1 wrote");
+static_assert(sizeof(LegacyStateContainer) == 176, "LegacyStateContainer must match what firmware 1.2.1 wrote");
+
+uint32_t crc32(const void *data, size_t length, uint32_t crc)
+{
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= bytes[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// A minute of the day, or an offset from sunrise or sunset within sunMaxOffset.
+static bool validEndpoint(uint16_t minute, bool sun)
+{
+  return sun ? (int16_t)minute >= -sunMaxOffset && (int16_t)minute <= sunMaxOffset : minute < minutesPerDay;
+}
+
+static bool validTimes(const Schedule &schedule)
+{
+  return validEndpoint(schedule.startMinute, schedule.flags & scheduleStartSun) && validEndpoint(schedule.endMinute, schedule.flags & scheduleEndSun);
+}
+
+static const uint8_t sunFlags = scheduleStartSun | scheduleStartSunset | scheduleEndSun | scheduleEndSunset;
+
+static bool validSchedule(Schedule &schedule)
+{
+  if (!scheduleIsEnabled(schedule))
+  {
+    // Disabled (weekend) schedule, the times are unused.
+    schedule = disabledSchedule();
+    return true;
+  }
+  return validTimes(schedule) && (schedule.flags & ~sunFlags) == scheduleEnabled;
+}
+
+static bool validSlot(Schedule &slot)
+{
+  if (!scheduleIsEnabled(slot))
+  {
+    slot = disabledSchedule();
+    return true;
+  }
+  return validTimes(slot) && (slot.flags & ~(scheduleEnabled | scheduleNight | sunFlags)) == 0;
+}
+
+static bool validConfig(PersistedConfig &config)
+{
+  if (config.dayIntensity > 100 || config.nightIntensity > 100 || config.dstActive > 1 || config.weeklyActive > 1 ||
+      !validSchedule(config.day) || !validSchedule(config.night) || !validSchedule(config.weekendDay) || !validSchedule(config.weekendNight))
+  {
+    return false;
+  }
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    if (config.fadeInSeconds[channel] > maxFadeSeconds || config.fadeOutSeconds[channel] > maxFadeSeconds)
+    {
+      return false;
+    }
+  }
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      if (!validSlot(config.week.slots[weekday][slot]))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// startHour -1 was the disabled marker, anything else out of range is treated the same.
+static Schedule migrateLegacySchedule(const LegacySchedule &legacy)
+{
+  if (legacy.startHour < 0 || legacy.startHour > 23 || legacy.startMinute < 0 || legacy.startMinute > 59 ||
+      legacy.endHour < 0 || legacy.endHour > 23 || legacy.endMinute < 0 || legacy.endMinute > 59)
+  {
+    return disabledSchedule();
+  }
+  return makeSchedule(minuteOfDay(legacy.startHour, legacy.startMinute), minuteOfDay(legacy.endHour, legacy.endMinute));
+}
+
+static bool migrateLegacy(const LegacyStateContainer &legacy, PersistedConfig &config)
+{
+  if (legacy.persistedInEEPROM != true || legacy.dayIntensity < 0 || legacy.dayIntensity > 100 || legacy.nightIntensity < 0 || legacy.nightIntensity > 100)
+  {
+    return false;
+  }
+  memset(&config, 0, sizeof(config));
+  config.dstActive = legacy.dstActive;
+  config.dayIntensity = legacy.dayIntensity;
+  config.nightIntensity = legacy.nightIntensity;
+  config.day = migrateLegacySchedule(legacy.day);
+  config.night = migrateLegacySchedule(legacy.night);
+  config.weekendDay = migrateLegacySchedule(legacy.weekendDay);
+  config.weekendNight = migrateLegacySchedule(legacy.weekendNight);
+  config.weeklyActive = false;
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      config.week.slots[weekday][slot] = disabledSchedule();
+    }
+  }
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    config.fadeInSeconds[channel] = defaultFadeSeconds;
+    config.fadeOutSeconds[channel] = defaultFadeSeconds;
+  }
+  return true;
+}
+
+uint16_t encodeConfig(const PersistedConfig &config, uint8_t *buffer, uint16_t size)
+{
+  if (size < configMaxEncodedLength)
+  {
+    return 0;
+  }
+  ConfigHeader header;
+  header.magic = configMagic;
+  header.version = configFormatVersion;
+  header.length = sizeof(config);
+  header.crc = crc32(&config, sizeof(config));
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), &config, sizeof(config));
+  return sizeof(header) + sizeof(config);
+}
+
+bool decodeConfig(const uint8_t *buffer, uint16_t length, PersistedConfig &config)
+{
+  ConfigHeader header;
+  if (length < sizeof(header))
+  {
+    return false;
+  }
+  memcpy(&header, buffer, sizeof(header));
+  const uint8_t *body = buffer + sizeof(header);
+  if (header.magic != configMagic || length != sizeof(header) + header.length || crc32(body, header.length) != header.crc)
+  {
+    return false;
+  }
+  // Anything else was written by newer firmware, don't guess.
+  if (header.version != configFormatVersion || header.length != sizeof(config))
+  {
+    return false;
+  }
+  memcpy(&config, body, sizeof(config));
+  return validConfig(config);
+}
+
+bool decodeLegacyConfig(const uint8_t *buffer, uint16_t length, PersistedConfig &config, uint8_t &runtime)
+{
+  LegacyStateContainer legacy;
+  if (length != sizeof(legacy))
+  {
+    return false;
+  }
+  memcpy(&legacy, buffer, sizeof(legacy));
+  if (!migrateLegacy(legacy, config))
+  {
+    return false;
+  }
+  runtime = (legacy.dayActive ? runtimeDayActive : 0) | (legacy.nightActive ? runtimeNightActive : 0);
+  return validConfig(config);
+}
+
+uint16_t legacyConfigLength()
+{
+  return sizeof(LegacyStateContainer);
+}
@@ -0,0 +1,204 @@
+#include <Arduino.h>
+#include "encoder.h"
+#include "page.h"
+
+static encoding_t encoding = encodingJson;
+// JSON only, whether the next value at each level needs a comma in front of it.
+static bool needsComma[encoderMaxDepth + 1];
+static char closing[encoderMaxDepth + 1];
+static uint8_t depth = 0;
+static bool afterKey = false;
+
+static void writeByte(uint8_t value)
+{
+  pageWrite(&value, 1);
+}
+
+static void writeBigEndian(uint32_t value, uint8_t bytes)
+{
+  for (int8_t i = bytes - 1; i >= 0; i--)
+  {
+    writeByte(value >> (i * 8));
+  }
+}
+
+// Separator before a value or key in JSON.
+static void beginValue()
+{
+  if (encoding != encodingJson)
+  {
+    return;
+  }
+  if (afterKey)
+  {
+    afterKey = false;
+    return;
+  }
+  if (needsComma[depth])
+  {
+    pagePrint(",");
+  }
+  needsComma[depth] = true;
+}
+
+static void writeJsonString(const char *value)
+{
+  pagePrint("\"");
+  for (; *value != '\0'; value++)
+  {
+    if (*value == '"' || *value == '\\')
+    {
+      pagePrint("\\");
+    }
+    pageWrite(reinterpret_cast<const uint8_t *>(value), 1);
+  }
+  pagePrint("\"");
+}
+
+static void writeMsgpackString(const char *value)
+{
+  size_t length = strlen(value);
+  if (length < 32)
+  {
+    writeByte(0xa0 | length);
+  }
+  else
+  {
+    writeByte(0xd9);
+    writeByte(length > 255 ? 255 : length);
+    length = length > 255 ? 255 : length;
+  }
+  pageWrite(reinterpret_cast<const uint8_t *>(value), length);
+}
+
+static void openContainer(uint8_t size, char jsonOpen, char jsonClose, uint8_t fixType, uint8_t type16)
+{
+  beginValue();
+  if (encoding == encodingJson)
+  {
+    char open[2] = {jsonOpen, '\0'};
+    pagePrint(open);
+  }
+  else if (size < 16)
+  {
+    writeByte(fixType | size);
+  }
+  else
+  {
+    writeByte(type16);
+    writeBigEndian(size, 2);
+  }
+  if (depth < encoderMaxDepth)
+  {
+    depth++;
+  }
+  needsComma[depth] = false;
+  closing[depth] = jsonClose;
+}
+
+void encodeBegin(encoding_t newEncoding)
+{
+  encoding = newEncoding;
+  depth = 0;
+  needsComma[0] = false;
+  afterKey = false;
+}
+
+void encodeMap(uint8_t size)
+{
+  openContainer(size, '{', '}', 0x80, 0xde);
+}
+
+void encodeArray(uint8_t size)
+{
+  openContainer(size, '[', ']', 0x90, 0xdc);
+}
+
+void encodeEnd()
+{
+  if (depth == 0)
+  {
+    return;
+  }
+  if (encoding == encodingJson)
+  {
+    char close[2] = {closing[depth], '\0'};
+    pagePrint(close);
+  }
+  depth--;
+}
+
+void encodeKey(const char *key)
+{
+  beginValue();
+  if (encoding == encodingJson)
+  {
+    writeJsonString(key);
+    pagePrint(":");
+  }
+  else
+  {
+    writeMsgpackString(key);
+  }
+  afterKey = true;
+}
+
+void encodeUint(uint32_t value)
+{
+  beginValue();
+  if (encoding == encodingJson)
+  {
+    pagePrintf("%u", value);
+  }
+  else if (value < 128)
+  {
+    writeByte(value);
+  }
+  else if (value <= 0xff)
+  {
+    writeByte(0xcc);
+    writeByte(value);
+  }
+  else if (value <= 0xffff)
+  {
+    writeByte(0xcd);
+    writeBigEndian(value, 2);
+  }
+  else
+  {
+    writeByte(0xce);
+    writeBigEndian(value, 4);
+  }
+}
+
+void encodeBool(bool value)
+{
+  beginValue();
+  if (encoding == encodingJson)
+  {
+    pagePrint(value ? "true" : "false");
+  }
+  else
+  {
+    writeByte(value ? 0xc3 : 0xc2);
+  }
+}
+
+void encodeString(const char *value)
+{
+  beginValue();
+  encoding == encodingJson ? writeJsonString(value) : writeMsgpackString(value);
+}
+
+void encodeNull()
+{
+  beginValue();
+  if (encoding == encodingJson)
+  {
+    pagePrint("null");
+  }
+  else
+  {
+    writeByte(0xc0);
+  }
+}
@@ -0,0 +1,310 @@
+#include <Arduino.h>
+#include <TimeLib.h>
+#include "event_log.h"
+#include "config_format.h"
+#include "ntp_sync.h"
+#include "page.h"
+#include "schedule.h"
+#include "time_format.h"
+#ifdef LAMPOMATIC_EVENT_LOG_FLASH
+#include <spi_flash.h>
+#endif
+
+EventRecord eventLogRing[eventLogCapacity];
+uint32_t eventLogWritten = 0;
+
+static const char *const weekdayNames[daysPerWeek] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *const sourceNames[] = {"page", "api", "fleet"};
+
+// The time it happened, if the clock is known by now.
+static EventRecord dated(const EventRecord &record, uint64_t nowMs, unsigned long nowMillis)
+{
+  EventRecord copy = record;
+  if (nowMs != 0 && !(record.flags & eventTimeUtc))
+  {
+    copy.time = (nowMs - (unsigned long)(nowMillis - record.time)) / 1000;
+    copy.flags |= eventTimeUtc;
+  }
+  return copy;
+}
+
+static const char *resetReason(uint8_t reason)
+{
+  switch (reason)
+  {
+  case REASON_DEFAULT_RST:
+    return "power on";
+  case REASON_WDT_RST:
+    return "hardware watchdog";
+  case REASON_EXCEPTION_RST:
+    return "exception";
+  case REASON_SOFT_WDT_RST:
+    return "software watchdog";
+  case REASON_SOFT_RESTART:
+    return "restart";
+  case REASON_DEEP_SLEEP_AWAKE:
+    return "deep sleep wake";
+  case REASON_EXT_SYS_RST:
+    return "reset pin";
+  default:
+    return "unknown";
+  }
+}
+
+// Decoding only happens here, for /log.
+static void writeRecord(const EventRecord &record)
+{
+  if (record.flags & eventTimeUtc)
+  {
+    tmElements_t tm;
+    breakTime(record.time, tm);
+    pagePrintf("%04u-%02u-%02uT%02u:%02u:%02uZ", tmYearToCalendar(tm.Year), tm.Month, tm.Day, tm.Hour, tm.Minute, tm.Second);
+  }
+  else
+  {
+    // The clock wasn't known yet, time since the boot started by the reset before it.
+    pagePrintf("boot+%u.%03us", (unsigned)(record.time / 1000), (unsigned)(record.time % 1000));
+  }
+
+  char text[minuteTextLength];
+  switch (record.type)
+  {
+  case eventReset:
+    pagePrintf(" reset %s", resetReason(record.detail));
+    if (record.detail == REASON_EXCEPTION_RST)
+    {
+      pagePrintf(" (cause %d)", record.value);
+    }
+    break;
+  case eventTransition:
+    pagePrintf(" transition day %s night %s at %s %s", record.detail & runtimeDayActive ? "on" : "off", record.detail & runtimeNightActive ? "on" : "off",
+               weekdayNames[(record.value / minutesPerDay) % daysPerWeek], formatMinuteOfDay(record.value % minutesPerDay, text));
+    break;
+  case eventSchedule:
+    pagePrintf(" schedule from %s, config %08x", record.detail <= eventSourceFleet ? sourceNames[record.detail] : "?", (unsigned)record.value);
+    break;
+  case eventNtpAnswer:
+    pagePrintf(" ntp answer from server %u, clock corrected by %d ms", record.detail, record.value);
+    break;
+  case eventNtpFailure:
+    pagePrintf(" ntp failure on server %u, %d in a row", record.detail, record.value);
+    break;
+  case eventWifiUp:
+    pagePrintf(" wifi connected, rssi %d dBm", record.value);
+    break;
+  case eventWifiDown:
+    pagePrintf(" wifi lost, status %d", record.value);
+    break;
+  case eventUpdate:
+    pagePrint(" update started");
+    break;
+  default:
+    pagePrintf(" event %u, detail %u, value %d", record.type, record.detail, record.value);
+    break;
+  }
+  pagePrint("\n");
+}
+
+#ifdef LAMPOMATIC_EVENT_LOG_FLASH
+extern "C" uint32_t _FS_start;
+extern "C" uint32_t _FS_end;
+
+static const uint32_t eventLogMagic = 0x4C4D454C; // "LMEL"
+
+struct EventSectorHeader
+{
+  uint32_t magic;
+  // Bumped for every sector started, the higher one of the two is being written.
+  uint32_t sequence;
+};
+
+// Records go into erased space one after the other, the first slot reading as 0xFF is where the next one goes.
+// When a sector fills up the other one is erased and carries on, so there's always one full sector of history.
+static const uint8_t flashSectors = 2;
+static const uint16_t flashSlots = (SPI_FLASH_SEC_SIZE - sizeof(EventSectorHeader)) / sizeof(EventRecord);
+// Records mirrored per flash write. Waiting for a full batch keeps the writes (and the erases) few.
+static const uint16_t flashBatch = 32;
+
+static_assert(sizeof(EventRecord) % 4 == 0, "Flash is written in 4 byte words");
+
+static bool flashUsable = false;
+static uint8_t currentSector = 0;
+static uint32_t currentSequence = 0;
+// flashSlots when the current sector is full, or there is none yet.
+static uint16_t nextSlot = flashSlots;
+// Ring records mirrored so far, counted like eventLogWritten.
+static uint32_t mirrored = 0;
+static EventRecord batch[flashBatch];
+
+static uint32_t sectorAddress(uint8_t sector)
+{
+  return (uint32_t)(uintptr_t)&_FS_start - 0x40200000 + sector * SPI_FLASH_SEC_SIZE;
+}
+
+static uint32_t slotAddress(uint8_t sector, uint16_t slot)
+{
+  return sectorAddress(sector) + sizeof(EventSectorHeader) + slot * sizeof(EventRecord);
+}
+
+static bool readHeader(uint8_t sector, EventSectorHeader &header)
+{
+  return ESP.flashRead(sectorAddress(sector), reinterpret_cast<uint32_t *>(&header), sizeof(header)) && header.magic == eventLogMagic;
+}
+
+static bool readSlot(uint8_t sector, uint16_t slot, EventRecord &record)
+{
+  return ESP.flashRead(slotAddress(sector, slot), reinterpret_cast<uint32_t *>(&record), sizeof(record)) && record.type != 0xFF;
+}
+
+// Slots are filled in order, so the first empty one can be found by bisecting.
+static uint16_t findNextSlot(uint8_t sector)
+{
+  uint16_t low = 0;
+  uint16_t high = flashSlots;
+  EventRecord record;
+  while (low < high)
+  {
+    uint16_t middle = (low + high) / 2;
+    if (readSlot(sector, middle, record))
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static bool startSector()
+{
+  uint8_t sector = (currentSector + 1) % flashSectors;
+  EventSectorHeader header = {eventLogMagic, currentSequence + 1};
+  if (!ESP.flashEraseSector(sectorAddress(sector) / SPI_FLASH_SEC_SIZE) ||
+      !ESP.flashWrite(sectorAddress(sector), reinterpret_cast<uint32_t *>(&header), sizeof(header)))
+  {
+    return false;
+  }
+  currentSector = sector;
+  currentSequence = header.sequence;
+  nextSlot = 0;
+  return true;
+}
+
+static void writeFlashRecords(uint8_t sector, uint16_t slots)
+{
+  EventRecord record;
+  for (uint16_t slot = 0; slot < slots && readSlot(sector, slot, record); slot++)
+  {
+    writeRecord(record);
+  }
+}
+#endif
+
+void eventLogBegin()
+{
+#ifdef LAMPOMATIC_EVENT_LOG_FLASH
+  // The last sector of the area is the journal's spare.
+  flashUsable = (uint32_t)(uintptr_t)&_FS_end - (uint32_t)(uintptr_t)&_FS_start >= (flashSectors + 1) * SPI_FLASH_SEC_SIZE;
+  EventSectorHeader header;
+  bool found = false;
+  for (uint8_t sector = 0; flashUsable && sector < flashSectors; sector++)
+  {
+    if (readHeader(sector, header) && (!found || header.sequence > currentSequence))
+    {
+      found = true;
+      currentSector = sector;
+      currentSequence = header.sequence;
+    }
+  }
+  if (found)
+  {
+    nextSlot = findNextSlot(currentSector);
+  }
+  else
+  {
+    // Start on sector 0.
+    currentSector = flashSectors - 1;
+  }
+#endif
+  const rst_info *info = ESP.getResetInfoPtr();
+  eventLog(eventReset, info->reason, info->reason == REASON_EXCEPTION_RST ? info->exccause : 0);
+}
+
+void eventLogService()
+{
+#ifdef LAMPOMATIC_EVENT_LOG_FLASH
+  // Waiting for the clock gets the records mirrored with dates, but not at the cost of losing them.
+  uint32_t pending = eventLogWritten - mirrored;
+  if (pending >= flashBatch && (ntpNow() != 0 || pending >= eventLogCapacity - flashBatch))
+  {
+    eventLogFlush();
+  }
+#endif
+}
+
+void eventLogFlush()
+{
+#ifdef LAMPOMATIC_EVENT_LOG_FLASH
+  if (!flashUsable)
+  {
+    return;
+  }
+  if (eventLogWritten - mirrored > eventLogCapacity)
+  {
+    mirrored = eventLogWritten - eventLogCapacity; // Overwritten in the ring before they were mirrored.
+  }
+  uint64_t nowMs = ntpNowMs();
+  unsigned long nowMillis = millis();
+  while (mirrored != eventLogWritten)
+  {
+    if (nextSlot >= flashSlots && !startSector())
+    {
+      return;
+    }
+    uint16_t count = eventLogWritten - mirrored;
+    count = count > flashBatch ? flashBatch : count;
+    count = count > flashSlots - nextSlot ? flashSlots - nextSlot : count;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      batch[i] = dated(eventLogRing[(mirrored + i) & (eventLogCapacity - 1)], nowMs, nowMillis);
+    }
+    if (!ESP.flashWrite(slotAddress(currentSector, nextSlot), reinterpret_cast<uint32_t *>(batch), count * sizeof(EventRecord)))
+    {
+      nextSlot = flashSlots; // Don't write over whatever made it, carry on in the other sector.
+      return;
+    }
+    nextSlot += count;
+    mirrored += count;
+  }
+#endif
+}
+
+void eventLogWrite()
+{
+  uint32_t first = eventLogWritten > eventLogCapacity ? eventLogWritten - eventLogCapacity : 0;
+#ifdef LAMPOMATIC_EVENT_LOG_FLASH
+  if (flashUsable)
+  {
+    // The older sector, if it's the one before the current one, then the current one and whatever is only in the ring.
+    uint8_t older = (currentSector + 1) % flashSectors;
+    EventSectorHeader header;
+    if (readHeader(older, header) && header.sequence + 1 == currentSequence)
+    {
+      writeFlashRecords(older, flashSlots);
+    }
+    if (readHeader(currentSector, header) && header.sequence == currentSequence)
+    {
+      writeFlashRecords(currentSector, nextSlot);
+    }
+    first = mirrored > first ? mirrored : first;
+  }
+#endif
+  uint64_t nowMs = ntpNowMs();
+  unsigned long nowMillis = millis();
+  for (uint32_t index = first; index != eventLogWritten; index++)
+  {
+    writeRecord(dated(eventLogRing[index & (eventLogCapacity - 1)], nowMs, nowMillis));
+  }
+}
@@ -0,0 +1,121 @@
+#include <Arduino.h>
+#include "events.h"
+
+static volatile bool connected = false;
+
+bool eventsTakeConnected()
+{
+  bool wasConnected = connected;
+  connected = false;
+  return wasConnected;
+}
+
+#ifdef LAMPOMATIC_ASYNC_SERVER
+
+static AsyncEventSource *source = nullptr;
+
+void eventsBegin(HttpServer &server, const char *uri)
+{
+  source = new AsyncEventSource(uri);
+  source->onConnect([](AsyncEventSourceClient *) { connected = true; });
+  server.backend().addHandler(source);
+}
+
+void eventsPublish(const char *event, const char *data)
+{
+  if (source != nullptr)
+  {
+    source->send(data, event);
+  }
+}
+
+// AsyncEventSource drops closed clients itself.
+void eventsService(unsigned long)
+{
+}
+
+uint8_t eventsClientCount()
+{
+  return source != nullptr ? source->count() : 0;
+}
+
+#else
+
+static WiFiClient clients[eventsMaxClients];
+static unsigned long lastWriteMillis = 0;
+
+static const char eventsHeader[] PROGMEM = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\n";
+
+// Writes all of text or drops the client, a message is never left half sent.
+static void writeAll(WiFiClient &client, const char *text, size_t length)
+{
+  if (!client)
+  {
+    return;
+  }
+  if (!client.connected() || client.availableForWrite() < length)
+  {
+    client.stop();
+    client = WiFiClient();
+    return;
+  }
+  client.write(reinterpret_cast<const uint8_t *>(text), length);
+}
+
+bool eventsAddClient(WiFiClient client)
+{
+  for (uint8_t i = 0; i < eventsMaxClients; i++)
+  {
+    if (!clients[i] || !clients[i].connected())
+    {
+      clients[i] = client;
+      clients[i].setNoDelay(true);
+      clients[i].write_P(eventsHeader, strlen_P(eventsHeader));
+      connected = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+void eventsPublish(const char *event, const char *data)
+{
+  char message[160];
+  int length = snprintf(message, sizeof(message), "event: %s\ndata: %s\n\n", event, data);
+  if (length <= 0 || length >= (int)sizeof(message))
+  {
+    return;
+  }
+  for (uint8_t i = 0; i < eventsMaxClients; i++)
+  {
+    writeAll(clients[i], message, length);
+  }
+  lastWriteMillis = millis();
+}
+
+void eventsService(unsigned long currentMillis)
+{
+  if (currentMillis - lastWriteMillis < eventsKeepAliveIntervall)
+  {
+    return;
+  }
+  // Comments are ignored by EventSource, but keep proxies from timing out and find dead connections.
+  static const char keepAlive[] = ":\n\n";
+  for (uint8_t i = 0; i < eventsMaxClients; i++)
+  {
+    writeAll(clients[i], keepAlive, sizeof(keepAlive) - 1);
+  }
+  lastWriteMillis = currentMillis;
+}
+
+uint8_t eventsClientCount()
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < eventsMaxClients; i++)
+  {
+    count += clients[i] && clients[i].connected() ? 1 : 0;
+  }
+  return count;
+}
+
+#endif
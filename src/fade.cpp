@@ -0,0 +1,156 @@
+#include <Arduino.h>
+#include <Ticker.h>
+#include "fade.h"
+
+// Levels are percent in 16.16 fixed point, so hour long fades still move every step.
+struct Fade
+{
+  uint8_t target = 0;
+  int32_t level = 0;
+  int32_t step = 0;
+  uint32_t stepsLeft = 0;
+  int32_t appliedDuty = -1;
+};
+
+static Fade fades[fadeChannels];
+static Ticker fadeTicker;
+static bool tickerRunning = false;
+static volatile bool completed = false;
+// A step for a bus driver waiting for fadeService() to send it.
+static volatile bool flushPending = false;
+
+// Every analogWrite reprograms the PWM waveform, which can flicker, so unchanged duty is never written.
+template <typename Output>
+static void writeLevel(Fade &fade)
+{
+  int32_t duty = Output::levelDuty(fade.level);
+  if (duty == fade.appliedDuty)
+  {
+    return;
+  }
+  Output::write(duty);
+  fade.appliedDuty = duty;
+}
+
+// Ticker callbacks run from the SDK timer task between loop() iterations, not in an interrupt, so loop() never sees a half done step.
+static void fadeStep()
+{
+  bool active = false;
+  Outputs::forEach([&active](auto output, uint8_t channel) {
+    Fade &fade = fades[channel];
+    if (fade.stepsLeft == 0)
+    {
+      return;
+    }
+    fade.stepsLeft--;
+    fade.level = fade.stepsLeft == 0 ? (int32_t)fade.target << 16 : fade.level + fade.step;
+    writeLevel<decltype(output)>(fade);
+    active = active || fade.stepsLeft > 0;
+    completed = completed || fade.stepsLeft == 0;
+  });
+  if (Outputs::blockingFlush)
+  {
+    flushPending = true;
+  }
+  else
+  {
+    Outputs::flush();
+  }
+  if (!active)
+  {
+    fadeTicker.detach();
+    tickerRunning = false;
+  }
+}
+
+void fadeBegin()
+{
+  Outputs::begin();
+}
+
+void fadeFlush()
+{
+  flushPending = false;
+  Outputs::flush();
+}
+
+void fadeService()
+{
+  if (flushPending)
+  {
+    fadeFlush();
+  }
+}
+
+void fadeTo(uint8_t channel, uint8_t percent, uint32_t durationMillis)
+{
+  if (channel >= fadeChannels)
+  {
+    return;
+  }
+  Fade &fade = fades[channel];
+  percent = percent > 100 ? 100 : percent;
+  if (percent == fade.target && (fade.stepsLeft > 0 || fade.appliedDuty >= 0))
+  {
+    return;
+  }
+  fade.target = percent;
+  uint32_t steps = durationMillis / fadeStepMillis;
+  if (steps == 0)
+  {
+    fade.stepsLeft = 0;
+    fade.level = (int32_t)percent << 16;
+    Outputs::with(channel, [&fade](auto output) { writeLevel<decltype(output)>(fade); });
+    return;
+  }
+  // Worked out once per fade, the steps themselves are an add and a table lookup.
+  fade.step = (((int32_t)percent << 16) - fade.level) / (int32_t)steps;
+  fade.stepsLeft = steps;
+  if (!tickerRunning)
+  {
+    fadeTicker.attach_ms(fadeStepMillis, fadeStep);
+    tickerRunning = true;
+  }
+}
+
+uint8_t fadeTarget(uint8_t channel)
+{
+  return channel < fadeChannels ? fades[channel].target : 0;
+}
+
+bool fadeActive()
+{
+  return tickerRunning;
+}
+
+bool fadePwmActive()
+{
+  if (tickerRunning)
+  {
+    return true;
+  }
+  if (!Outputs::needsTimer)
+  {
+    return false;
+  }
+  bool partial = false;
+  Outputs::forEach([&partial](auto output, uint8_t channel) {
+    partial = partial || (fades[channel].appliedDuty > 0 && fades[channel].appliedDuty < decltype(output)::maxDuty);
+  });
+  return partial;
+}
+
+bool fadeTakeCompleted()
+{
+  bool wasCompleted = completed;
+  completed = false;
+  return wasCompleted;
+}
+
+void fadeInvalidate()
+{
+  for (uint8_t channel = 0; channel < fadeChannels; channel++)
+  {
+    fades[channel].appliedDuty = -1;
+  }
+}
@@ -0,0 +1,223 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <bearssl/bearssl_hmac.h>
+#include <string.h>
+#include "fleet.h"
+
+static const IPAddress fleetGroup(239, 255, 76, 77);
+static const uint16_t fleetPort = 7632;
+static const uint32_t fleetMagic = 0x4C4D464C; // "LMFL"
+static const uint8_t fleetMacLength = 32;
+// Multicast is only delivered after DTIM beacons, which a sleeping lamp can miss, so a schedule goes out a few times.
+static const uint8_t fleetRepeats = 3;
+static const unsigned long fleetRepeatIntervall = 700;
+// Answers to an ask wait a random part of this, and are dropped when another lamp answers first.
+static const unsigned long fleetAnswerWindow = 2000;
+
+typedef enum : uint8_t
+{
+  fleetSchedule = 1,
+  // Header only: a lamp that joined telling its generation, anyone with a newer one answers with that.
+  fleetAsk = 2
+} fleetPacket_t;
+
+struct __attribute__((packed)) FleetHeader
+{
+  uint32_t magic;
+  uint8_t type;
+  uint32_t generation;
+};
+
+// Header, encoded config record, MAC over both.
+static const uint16_t fleetMaxPacket = sizeof(FleetHeader) + configMaxEncodedLength + fleetMacLength;
+
+static WiFiUDP udp;
+static br_hmac_key_context keyContext;
+static bool enabled = false;
+static bool joined = false;
+static fleetApply_t applyCallback = nullptr;
+static uint32_t generation = 0;
+static PersistedConfig currentConfig;
+static uint8_t repeatsLeft = 0;
+static unsigned long nextSendMillis = 0;
+static bool answerPending = false;
+
+static void mac(const uint8_t *data, uint16_t length, uint8_t out[fleetMacLength])
+{
+  br_hmac_context context;
+  br_hmac_init(&context, &keyContext, 0);
+  br_hmac_update(&context, data, length);
+  br_hmac_out(&context, out);
+}
+
+// Constant time, so a forged MAC can't be found byte by byte.
+static bool macEqual(const uint8_t *a, const uint8_t *b)
+{
+  uint8_t difference = 0;
+  for (uint8_t i = 0; i < fleetMacLength; i++)
+  {
+    difference |= a[i] ^ b[i];
+  }
+  return difference == 0;
+}
+
+static void sendPacket(fleetPacket_t type)
+{
+  uint8_t packet[fleetMaxPacket];
+  FleetHeader header = {fleetMagic, type, generation};
+  memcpy(packet, &header, sizeof(header));
+  uint16_t length = sizeof(header);
+  if (type == fleetSchedule)
+  {
+    uint16_t encoded = encodeConfig(currentConfig, packet + length, configMaxEncodedLength);
+    if (encoded == 0)
+    {
+      return;
+    }
+    length += encoded;
+    mac(packet, length, packet + length);
+    length += fleetMacLength;
+  }
+  udp.beginPacketMulticast(fleetGroup, fleetPort, WiFi.localIP());
+  udp.write(packet, length);
+  udp.endPacket();
+}
+
+// Queue the schedule for sending, after delayMillis.
+static void sendSchedule(unsigned long currentMillis, unsigned long delayMillis)
+{
+  repeatsLeft = fleetRepeats;
+  nextSendMillis = currentMillis + delayMillis;
+}
+
+static void receive(unsigned long currentMillis)
+{
+  uint8_t packet[fleetMaxPacket];
+  int length = udp.read(packet, sizeof(packet));
+  FleetHeader header;
+  if (length < (int)sizeof(header))
+  {
+    return;
+  }
+  memcpy(&header, packet, sizeof(header));
+  if (header.magic != fleetMagic)
+  {
+    return;
+  }
+  if (header.type == fleetAsk)
+  {
+    if (generation > header.generation && repeatsLeft == 0)
+    {
+      sendSchedule(currentMillis, ESP.random() % fleetAnswerWindow);
+      answerPending = true;
+    }
+    return;
+  }
+  // Cheapest checks first, the MAC is only worked out for a schedule that would be applied.
+  if (header.type != fleetSchedule || length < (int)(sizeof(header) + sizeof(ConfigHeader) + fleetMacLength))
+  {
+    return;
+  }
+  // An answer at our own generation is still worth verifying while ours is pending, it cancels it.
+  if (header.generation < generation || (header.generation == generation && !answerPending))
+  {
+    return;
+  }
+  uint16_t signedLength = length - fleetMacLength;
+  uint8_t expected[fleetMacLength];
+  mac(packet, signedLength, expected);
+  PersistedConfig config;
+  if (!macEqual(expected, packet + signedLength) || !decodeConfig(packet + sizeof(header), signedLength - sizeof(header), config))
+  {
+#ifdef DEBUG_LAMPOMATIC
+    Serial.println("Fleet: dropped a schedule that didn't verify");
+#endif
+    return;
+  }
+  if (answerPending)
+  {
+    repeatsLeft = 0; // Someone else answered.
+    answerPending = false;
+  }
+  if (header.generation == generation)
+  {
+    return;
+  }
+  generation = header.generation;
+  currentConfig = config;
+  applyCallback(config, generation);
+}
+
+void fleetBegin(const char *key, uint32_t storedGeneration, const PersistedConfig &current, fleetApply_t apply)
+{
+  enabled = key != nullptr && key[0] != '\0';
+  if (!enabled)
+  {
+    return;
+  }
+  br_hmac_key_init(&keyContext, &br_sha256_vtable, key, strlen(key));
+  generation = storedGeneration;
+  currentConfig = current;
+  applyCallback = apply;
+}
+
+bool fleetEnabled()
+{
+  return enabled;
+}
+
+void fleetService(unsigned long currentMillis, bool online)
+{
+  if (!enabled)
+  {
+    return;
+  }
+  if (!online)
+  {
+    // The address can change with the next connection, so the group is joined again then.
+    if (joined)
+    {
+      udp.stop();
+      joined = false;
+    }
+    return;
+  }
+  if (!joined)
+  {
+    joined = udp.beginMulticast(WiFi.localIP(), fleetGroup, fleetPort);
+    if (joined)
+    {
+      sendPacket(fleetAsk);
+    }
+    return;
+  }
+  while (udp.parsePacket() > 0)
+  {
+    receive(currentMillis);
+  }
+  if (repeatsLeft > 0 && (long)(currentMillis - nextSendMillis) >= 0)
+  {
+    sendPacket(fleetSchedule);
+    repeatsLeft--;
+    nextSendMillis = currentMillis + fleetRepeatIntervall;
+    answerPending = false;
+  }
+}
+
+uint32_t fleetShare(const PersistedConfig &config, uint32_t utc)
+{
+  if (!enabled)
+  {
+    return generation;
+  }
+  generation = utc > generation ? utc : generation + 1;
+  currentConfig = config;
+  sendSchedule(millis(), 0);
+  return generation;
+}
+
+uint32_t fleetGeneration()
+{
+  return generation;
+}
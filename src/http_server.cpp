@@ -0,0 +1,154 @@
+#ifdef LAMPOMATIC_ASYNC_SERVER
+
+#include <Arduino.h>
+#include "http_server.h"
+
+HttpServer::HttpServer(uint16_t port)
+    : server(port), request(nullptr), headerCount(0), bodyRequest(nullptr), bodyLength(0), bodyTruncated(false)
+{
+}
+
+void HttpServer::begin()
+{
+  server.begin();
+}
+
+void HttpServer::handle(AsyncWebServerRequest *current, THandlerFunction handler)
+{
+  request = current;
+  headerCount = 0;
+  handler();
+  request = nullptr;
+  if (bodyRequest == current)
+  {
+    bodyRequest = nullptr;
+    bodyLength = 0;
+  }
+}
+
+void HttpServer::on(const char *uri, WebRequestMethodComposite method, THandlerFunction handler)
+{
+  server.on(
+      uri, method, [this, handler](AsyncWebServerRequest *current) { handle(current, handler); }, nullptr,
+      [this](AsyncWebServerRequest *current, uint8_t *data, size_t length, size_t index, size_t total) {
+        if (index == 0)
+        {
+          bodyRequest = current;
+          bodyLength = 0;
+          bodyTruncated = total > httpMaxBody;
+          // A request aborted before its handler ran would leave the body to whatever is allocated there next.
+          current->onDisconnect([this, current]() {
+            if (bodyRequest == current)
+            {
+              bodyRequest = nullptr;
+              bodyLength = 0;
+            }
+          });
+        }
+        // Another request's body arriving at the same time, it's answered without one.
+        if (bodyRequest != current || bodyTruncated)
+        {
+          return;
+        }
+        size_t copy = length > httpMaxBody - bodyLength ? httpMaxBody - bodyLength : length;
+        memcpy(body + bodyLength, data, copy);
+        bodyLength += copy;
+        body[bodyLength] = '\0';
+      });
+}
+
+void HttpServer::onNotFound(THandlerFunction handler)
+{
+  server.onNotFound([this, handler](AsyncWebServerRequest *current) { handle(current, handler); });
+}
+
+bool HttpServer::hasArg(const char *name) const
+{
+  if (strcmp(name, "plain") == 0)
+  {
+    return bodyRequest == request && bodyLength > 0;
+  }
+  return request != nullptr && request->hasArg(name);
+}
+
+String HttpServer::arg(const char *name) const
+{
+  if (strcmp(name, "plain") == 0)
+  {
+    return bodyRequest == request && bodyLength > 0 ? String(body) : String();
+  }
+  return request != nullptr && request->hasArg(name) ? request->arg(name) : String();
+}
+
+// The body isn't among these, like with ESP8266WebServer it's only there as arg("plain").
+int HttpServer::args() const
+{
+  return request != nullptr ? request->args() : 0;
+}
+
+const String &HttpServer::argName(int i) const
+{
+  return request->argName(i);
+}
+
+const String &HttpServer::arg(int i) const
+{
+  return request->arg(i);
+}
+
+String HttpServer::header(const char *name) const
+{
+  return request != nullptr && request->hasHeader(name) ? request->header(name) : String();
+}
+
+void HttpServer::sendHeader(const char *name, const char *value)
+{
+  if (headerCount < httpMaxHeaders)
+  {
+    headerNames[headerCount] = name;
+    headerValues[headerCount] = value;
+    headerCount++;
+  }
+}
+
+void HttpServer::addHeaders(AsyncWebServerResponse *response)
+{
+  for (uint8_t i = 0; i < headerCount; i++)
+  {
+    response->addHeader(headerNames[i], headerValues[i]);
+  }
+  headerCount = 0;
+}
+
+void HttpServer::send(int code)
+{
+  send(code, "text/plain", String());
+}
+
+void HttpServer::send(int code, const char *contentType, const String &content)
+{
+  if (request == nullptr)
+  {
+    return;
+  }
+  AsyncWebServerResponse *response = request->beginResponse(code, contentType, content);
+  addHeaders(response);
+  request->send(response);
+}
+
+void HttpServer::sendChunked(int code, const char *contentType, TFillFunction fill, std::function<void()> done)
+{
+  if (request == nullptr)
+  {
+    done();
+    return;
+  }
+  AsyncWebServerResponse *response = request->beginChunkedResponse(contentType, [fill](uint8_t *data, size_t length, size_t) { return fill(data, length); });
+  response->setCode(code);
+  addHeaders(response);
+  // Replaces the body's, which handle() is done with by the time the handler returns.
+  request->onDisconnect(done);
+  request->send(response);
+}
+
+#endif
@@ -0,0 +1,302 @@
+#include <Arduino.h>
+#include <spi_flash.h>
+#include "journal.h"
+
+extern "C" uint32_t _EEPROM_start;
+extern "C" uint32_t _FS_start;
+extern "C" uint32_t _FS_end;
+
+// Sector layout: a JournalSectorHeader followed by records, each a JournalRecordHeader and its payload padded to 4 bytes.
+// Erased flash reads as 0xFF, so the first header with type 0xFF marks where the next record goes.
+// Compaction copies into the other sector and writes its header last, so until the copy is complete the old sector
+// is still the one with the highest eraseCount, and a power cut halfway through loses nothing.
+struct JournalSectorHeader
+{
+  uint32_t magic;
+  uint32_t eraseCount;
+};
+
+struct JournalRecordHeader
+{
+  uint8_t type;
+  uint8_t length;
+  uint16_t check;
+};
+
+static const uint32_t journalMagic = 0x314a4c4e; // "NLJ1"
+static const uint16_t sectorSize = SPI_FLASH_SEC_SIZE;
+static const uint16_t maxRecordWords = (sizeof(JournalRecordHeader) + journalMaxPayload) / 4;
+// The EEPROM sector, and the last sector of the filesystem area, which this sketch doesn't otherwise use.
+static const uint8_t journalSectors = 2;
+
+static bool formatted = false;
+// Sector the records are read from and appended to.
+static uint8_t currentSector = 0;
+static uint32_t eraseCount = 0;
+// Since boot, for the metrics.
+static uint32_t writeCount = 0;
+static uint32_t bytesWritten = 0;
+static uint16_t writeOffset = sectorSize;
+static uint16_t latestOffset[journalRecordTypes + 1];
+
+static uint32_t sectorAddress(uint8_t sector)
+{
+  if (sector == 0)
+  {
+    return (((uint32_t)(uintptr_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE) * SPI_FLASH_SEC_SIZE;
+  }
+  return (((uint32_t)(uintptr_t)&_FS_end - 0x40200000) / SPI_FLASH_SEC_SIZE - 1) * SPI_FLASH_SEC_SIZE;
+}
+
+static uint32_t sectorAddress()
+{
+  return sectorAddress(currentSector);
+}
+
+// A layout without a filesystem area leaves nowhere to compact to, then the EEPROM sector is erased in place.
+static bool spareUsable()
+{
+  return (uint32_t)(uintptr_t)&_FS_end - (uint32_t)(uintptr_t)&_FS_start >= SPI_FLASH_SEC_SIZE;
+}
+
+static bool readSectorHeader(uint8_t sector, JournalSectorHeader &header)
+{
+  return ESP.flashRead(sectorAddress(sector), reinterpret_cast<uint32_t *>(&header), sizeof(header)) && header.magic == journalMagic;
+}
+
+static uint16_t paddedLength(uint16_t length)
+{
+  return (length + 3) & ~3;
+}
+
+static uint16_t fletcher16(const uint8_t *data, uint16_t length)
+{
+  uint16_t sum1 = 0;
+  uint16_t sum2 = 0;
+  for (uint16_t i = 0; i < length; i++)
+  {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+// Read a full record at offset into buffer, returns false if it's torn or not a record.
+static bool readRecord(uint16_t offset, uint32_t *buffer)
+{
+  JournalRecordHeader header;
+  if (!ESP.flashRead(sectorAddress() + offset, buffer, sizeof(header)))
+  {
+    return false;
+  }
+  memcpy(&header, buffer, sizeof(header));
+  if (header.type == 0 || header.type > journalRecordTypes || header.length > journalMaxPayload)
+  {
+    return false;
+  }
+  uint16_t total = sizeof(header) + paddedLength(header.length);
+  if (offset + total > sectorSize || !ESP.flashRead(sectorAddress() + offset, buffer, total))
+  {
+    return false;
+  }
+  return fletcher16(reinterpret_cast<uint8_t *>(buffer) + sizeof(header), header.length) == header.check;
+}
+
+bool journalBegin()
+{
+  JournalSectorHeader sectorHeader;
+  uint32_t buffer[maxRecordWords];
+
+  memset(latestOffset, 0, sizeof(latestOffset));
+  formatted = false;
+  writeOffset = sectorSize;
+  currentSector = 0;
+
+  // The newest complete sector, the other one is either older or a compaction that didn't finish.
+  for (uint8_t sector = 0; sector < (spareUsable() ? journalSectors : 1); sector++)
+  {
+    if (readSectorHeader(sector, sectorHeader) && (!formatted || (int32_t)(sectorHeader.eraseCount - eraseCount) > 0))
+    {
+      formatted = true;
+      currentSector = sector;
+      eraseCount = sectorHeader.eraseCount;
+    }
+  }
+  if (!formatted)
+  {
+    return false;
+  }
+
+  uint16_t offset = sizeof(sectorHeader);
+  while (offset + sizeof(JournalRecordHeader) <= sectorSize)
+  {
+    ESP.flashRead(sectorAddress() + offset, buffer, sizeof(JournalRecordHeader));
+    if (buffer[0] == 0xFFFFFFFF)
+    {
+      writeOffset = offset;
+      break;
+    }
+    if (!readRecord(offset, buffer))
+    {
+      // A torn write, nothing after it can be trusted. Leave writeOffset at the end so the next append compacts.
+      break;
+    }
+    JournalRecordHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    latestOffset[header.type] = offset;
+    offset += sizeof(header) + paddedLength(header.length);
+  }
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("Journal sector: ");
+  Serial.print(currentSector);
+  Serial.print(", erase count: ");
+  Serial.print(eraseCount);
+  Serial.print(", write offset: ");
+  Serial.println(writeOffset);
+#endif
+  return true;
+}
+
+static bool writeRecord(journalRecord_t type, const void *payload, uint16_t length)
+{
+  uint32_t buffer[maxRecordWords];
+  JournalRecordHeader header;
+  header.type = type;
+  header.length = length;
+  header.check = fletcher16(static_cast<const uint8_t *>(payload), length);
+
+  uint16_t total = sizeof(header) + paddedLength(length);
+  memset(buffer, 0xFF, total);
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(reinterpret_cast<uint8_t *>(buffer) + sizeof(header), payload, length);
+
+  if (!ESP.flashWrite(sectorAddress() + writeOffset, buffer, total))
+  {
+    writeOffset = sectorSize;
+    return false;
+  }
+  latestOffset[type] = writeOffset;
+  writeOffset += total;
+  writeCount++;
+  bytesWritten += total;
+  return true;
+}
+
+// Write the latest record of every type into a freshly erased sector. That includes the type about to be appended,
+// a power cut between the sector header and the new record would lose it otherwise.
+static bool compact()
+{
+  uint32_t kept[journalRecordTypes][maxRecordWords];
+  bool keep[journalRecordTypes + 1] = {false};
+
+  for (uint8_t type = 1; type <= journalRecordTypes; type++)
+  {
+    if (formatted && latestOffset[type] != 0)
+    {
+      keep[type] = readRecord(latestOffset[type], kept[type - 1]);
+    }
+  }
+
+#ifdef DEBUG_LAMPOMATIC
+  Serial.println("Compacting journal");
+#endif
+  // Unformatted, the first copy still goes to the spare, which keeps whatever older firmware left in the EEPROM sector.
+  uint8_t target = spareUsable() ? (formatted ? (currentSector + 1) % journalSectors : 1) : 0;
+  memset(latestOffset, 0, sizeof(latestOffset));
+  writeOffset = sectorSize;
+  if (!ESP.flashEraseSector(sectorAddress(target) / SPI_FLASH_SEC_SIZE))
+  {
+    journalBegin(); // Back to the sector that was complete.
+    return false;
+  }
+  eraseCount++;
+  currentSector = target;
+  formatted = false;
+  writeOffset = sizeof(JournalSectorHeader);
+
+  for (uint8_t type = 1; type <= journalRecordTypes; type++)
+  {
+    if (keep[type])
+    {
+      JournalRecordHeader header;
+      memcpy(&header, kept[type - 1], sizeof(header));
+      if (!writeRecord(static_cast<journalRecord_t>(type), reinterpret_cast<uint8_t *>(kept[type - 1]) + sizeof(header), header.length))
+      {
+        journalBegin();
+        return false;
+      }
+    }
+  }
+  JournalSectorHeader sectorHeader = {journalMagic, eraseCount};
+  if (!ESP.flashWrite(sectorAddress(), reinterpret_cast<uint32_t *>(&sectorHeader), sizeof(sectorHeader)))
+  {
+    journalBegin();
+    return false;
+  }
+  formatted = true;
+  return true;
+}
+
+bool journalAppend(journalRecord_t type, const void *payload, uint16_t length)
+{
+  if (type == 0 || type > journalRecordTypes || length > journalMaxPayload)
+  {
+    return false;
+  }
+  uint16_t total = sizeof(JournalRecordHeader) + paddedLength(length);
+  if (!formatted || writeOffset + total > sectorSize)
+  {
+    if (!compact())
+    {
+      return false;
+    }
+  }
+  return writeRecord(type, payload, length);
+}
+
+int16_t journalReadLatest(journalRecord_t type, void *payload, uint16_t maxLength)
+{
+  uint32_t buffer[maxRecordWords];
+  if (type == 0 || type > journalRecordTypes || latestOffset[type] == 0 || !readRecord(latestOffset[type], buffer))
+  {
+    return -1;
+  }
+  JournalRecordHeader header;
+  memcpy(&header, buffer, sizeof(header));
+  if (header.length > maxLength)
+  {
+    return -1;
+  }
+  memcpy(payload, reinterpret_cast<uint8_t *>(buffer) + sizeof(header), header.length);
+  return header.length;
+}
+
+bool journalReadRaw(uint32_t offset, void *data, uint16_t length)
+{
+  uint32_t buffer[maxRecordWords];
+  if (length > sizeof(buffer) || offset % 4 != 0)
+  {
+    return false;
+  }
+  if (!ESP.flashRead(sectorAddress(0) + offset, buffer, paddedLength(length)))
+  {
+    return false;
+  }
+  memcpy(data, buffer, length);
+  return true;
+}
+
+uint32_t journalEraseCount()
+{
+  return eraseCount;
+}
+
+uint32_t journalWriteCount()
+{
+  return writeCount;
+}
+
+uint32_t journalBytesWritten()
+{
+  return bytesWritten;
+}
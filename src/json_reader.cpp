@@ -0,0 +1,253 @@
+#include <string.h>
+#include "json_reader.h"
+
+static void skipWhitespace(JsonReader &reader)
+{
+  while (reader.position < reader.end && (*reader.position == ' ' || *reader.position == '\t' || *reader.position == '\n' || *reader.position == '\r'))
+  {
+    reader.position++;
+  }
+}
+
+static char peek(JsonReader &reader)
+{
+  skipWhitespace(reader);
+  return reader.failed || reader.position >= reader.end ? '\0' : *reader.position;
+}
+
+static bool fail(JsonReader &reader)
+{
+  reader.failed = true;
+  return false;
+}
+
+static bool expect(JsonReader &reader, char c)
+{
+  if (peek(reader) != c)
+  {
+    return fail(reader);
+  }
+  reader.position++;
+  return true;
+}
+
+static bool matchLiteral(JsonReader &reader, const char *literal)
+{
+  size_t length = strlen(literal);
+  skipWhitespace(reader);
+  if (reader.failed || (size_t)(reader.end - reader.position) < length || strncmp(reader.position, literal, length) != 0)
+  {
+    return false;
+  }
+  reader.position += length;
+  return true;
+}
+
+static bool open(JsonReader &reader, char c)
+{
+  if (reader.depth >= jsonMaxDepth || !expect(reader, c))
+  {
+    return fail(reader);
+  }
+  reader.depth++;
+  reader.first |= 1UL << reader.depth;
+  return true;
+}
+
+// Shared by keys and elements, handles the separator and the closing bracket.
+static bool next(JsonReader &reader, char close)
+{
+  if (reader.failed || reader.depth == 0)
+  {
+    return false;
+  }
+  uint32_t mask = 1UL << reader.depth;
+  char c = peek(reader);
+  if (c == close)
+  {
+    reader.position++;
+    reader.first &= ~mask;
+    reader.depth--;
+    return false;
+  }
+  if (!(reader.first & mask) && !expect(reader, ','))
+  {
+    return false;
+  }
+  reader.first &= ~mask;
+  return true;
+}
+
+void jsonBegin(JsonReader &reader, const char *text, size_t length)
+{
+  reader.position = text;
+  reader.end = text + length;
+  reader.failed = false;
+  reader.depth = 0;
+  reader.first = 0;
+}
+
+bool jsonBeginObject(JsonReader &reader)
+{
+  return open(reader, '{');
+}
+
+bool jsonNextKey(JsonReader &reader, char *key, size_t size)
+{
+  return next(reader, '}') && jsonReadString(reader, key, size) && expect(reader, ':');
+}
+
+bool jsonBeginArray(JsonReader &reader)
+{
+  return open(reader, '[');
+}
+
+bool jsonNextElement(JsonReader &reader)
+{
+  return next(reader, ']');
+}
+
+bool jsonReadBool(JsonReader &reader, bool &value)
+{
+  if (matchLiteral(reader, "true"))
+  {
+    value = true;
+    return true;
+  }
+  if (matchLiteral(reader, "false"))
+  {
+    value = false;
+    return true;
+  }
+  return fail(reader);
+}
+
+bool jsonReadUint(JsonReader &reader, uint32_t &value)
+{
+  char c = peek(reader);
+  if (c < '0' || c > '9')
+  {
+    return fail(reader);
+  }
+  uint32_t result = 0;
+  while (reader.position < reader.end && *reader.position >= '0' && *reader.position <= '9')
+  {
+    uint32_t digit = *reader.position++ - '0';
+    if (result > (UINT32_MAX - digit) / 10)
+    {
+      return fail(reader);
+    }
+    result = result * 10 + digit;
+  }
+  // Fractions and exponents aren't used by anything we read.
+  if (reader.position < reader.end && (*reader.position == '.' || *reader.position == 'e' || *reader.position == 'E'))
+  {
+    return fail(reader);
+  }
+  value = result;
+  return true;
+}
+
+bool jsonReadString(JsonReader &reader, char *value, size_t size)
+{
+  if (!expect(reader, '"'))
+  {
+    return false;
+  }
+  size_t length = 0;
+  while (reader.position < reader.end && *reader.position != '"')
+  {
+    char c = *reader.position++;
+    if (c == '\\')
+    {
+      // Only the simple escapes, \u isn't needed for any of our values.
+      if (reader.position >= reader.end || *reader.position == '\0' || strchr("\"\\/", *reader.position) == nullptr)
+      {
+        return fail(reader);
+      }
+      c = *reader.position++;
+    }
+    if (length + 1 >= size)
+    {
+      return fail(reader);
+    }
+    value[length++] = c;
+  }
+  if (reader.position >= reader.end)
+  {
+    return fail(reader);
+  }
+  reader.position++;
+  value[length] = '\0';
+  return true;
+}
+
+bool jsonReadNull(JsonReader &reader)
+{
+  return matchLiteral(reader, "null");
+}
+
+static void skipString(JsonReader &reader)
+{
+  if (!expect(reader, '"'))
+  {
+    return;
+  }
+  while (reader.position < reader.end && *reader.position != '"')
+  {
+    reader.position += *reader.position == '\\' ? 2 : 1;
+  }
+  if (reader.position >= reader.end)
+  {
+    fail(reader);
+    return;
+  }
+  reader.position++;
+}
+
+void jsonSkip(JsonReader &reader)
+{
+  char c = peek(reader);
+  if (c == '{')
+  {
+    open(reader, '{');
+    while (next(reader, '}'))
+    {
+      skipString(reader);
+      if (!expect(reader, ':'))
+      {
+        return;
+      }
+      jsonSkip(reader);
+    }
+  }
+  else if (c == '[')
+  {
+    open(reader, '[');
+    while (next(reader, ']'))
+    {
+      jsonSkip(reader);
+    }
+  }
+  else if (c == '"')
+  {
+    skipString(reader);
+  }
+  else if (c == '-' || (c >= '0' && c <= '9'))
+  {
+    reader.position++;
+    while (reader.position < reader.end && *reader.position != '\0' && strchr("0123456789.eE+-", *reader.position) != nullptr)
+    {
+      reader.position++;
+    }
+  }
+  else if (!matchLiteral(reader, "true") && !matchLiteral(reader, "false") && !matchLiteral(reader, "null"))
+  {
+    fail(reader);
+  }
+}
+
+bool jsonFinished(JsonReader &reader)
+{
+  return !reader.failed && reader.depth == 0 && peek(reader) == '\0';
+}
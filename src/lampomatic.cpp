@@ -21,31 +21,33 @@
  ***********************************************************************************************************/
 
 // Includes
-#include <NTPClient.h>
-#include <WiFiUdp.h>
-#include <ESP8266WebServer.h>
-#include <TimeAlarms.h>
-#include <EEPROM.h>
+#include "http_server.h"
+#include <TimeLib.h>
+#include "journal.h"
+#include "config_format.h"
+#include "schedule.h"
+#include "ntp_sync.h"
+#include "scheduler.h"
+#include "fade.h"
+#include "page.h"
+#include "time_format.h"
+#include "encoder.h"
+#include "json_reader.h"
+#include "events.h"
+#include "schedule_form.h"
+#include "metrics.h"
+#include "power.h"
+#include "time_zone.h"
+#include "boot_guard.h"
+#include "ota.h"
+#include "fleet.h"
+#include "rtc_cache.h"
+#include "event_log.h"
+#include "sun.h"
 
 // Debug stuff
 //#define DEBUG_LAMPOMATIC
 
-// Schedule
-struct Schedule
-{
-  int timerIds[6];
-  int startHour;
-  int startMinute;
-  int endHour;
-  int endMinute;
-};
-
-struct OutputState
-{
-  bool dayActive;
-  bool nightActive;
-};
-
 struct StateContainer
 {
   bool persistedInEEPROM;
@@ -55,6 +57,11 @@ struct StateContainer
   Schedule night;
   Schedule weekendDay;
   Schedule weekendNight;
+  // Weekly mode, when set the per weekday slots in week are used instead of the schedules above.
+  bool weeklyActive;
+  WeekSchedule week;
+  uint16_t fadeInSeconds[channelCount];
+  uint16_t fadeOutSeconds[channelCount];
   int dayIntensity;
   int nightIntensity;
   OutputState currentState;
@@ -72,36 +79,119 @@ typedef enum
   weekendNightEnd
 } scheduleType_t;
 
-// Wifi settings
-const char *ssid = "";
-const char *password = "";
+// Wifi settings, or -DLAMPOMATIC_WIFI_SSID='"..."' and -DLAMPOMATIC_WIFI_PASSWORD='"..."' in platformio.ini.
+#ifndef LAMPOMATIC_WIFI_SSID
+#define LAMPOMATIC_WIFI_SSID ""
+#endif
+#ifndef LAMPOMATIC_WIFI_PASSWORD
+#define LAMPOMATIC_WIFI_PASSWORD ""
+#endif
+const char ssid[] = LAMPOMATIC_WIFI_SSID;
+const char password[] = LAMPOMATIC_WIFI_PASSWORD;
 
-// Time settings
-const long utcOffsetInSeconds = 3600;
+// Time settings, a POSIX TZ string. Zones with DST rules change their clocks by themselves, for a zone given
+// without rules (e.g. "CET-1") the DST checkbox adds an hour instead. -DLAMPOMATIC_TIME_ZONE='"..."' sets it from platformio.ini.
+#ifndef LAMPOMATIC_TIME_ZONE
+#define LAMPOMATIC_TIME_ZONE "CET-1CEST,M3.5.0,M10.5.0/3"
+#endif
+const char timeZone[] = LAMPOMATIC_TIME_ZONE;
 long dstOffsetInSeconds = 0;
+// Where the lamp is, in degrees north and east, for schedules relative to sunrise and sunset. Defaults to Stockholm.
+#ifndef LAMPOMATIC_LATITUDE
+#define LAMPOMATIC_LATITUDE 59.33
+#endif
+#ifndef LAMPOMATIC_LONGITUDE
+#define LAMPOMATIC_LONGITUDE 18.07
+#endif
+const double latitude = LAMPOMATIC_LATITUDE;
+const double longitude = LAMPOMATIC_LONGITUDE;
+// Local day (days since 1970) the scheduler's sunrise and sunset were worked out on, -1 forces it on the next loop.
+int32_t sunDay = -1;
 // Weekdays, change according to language (Söndag = Sunday, Måndag = Monday etc etc.).
 const char daysOfTheWeek[7][12] = {"Söndag", "Måndag", "Tisdag", "Onsdag", "Torsdag", "Fredag", "Lördag"};
 
-unsigned long previousNtpUpdateMillis = 0;
-const long updateNtpIntervall = 60000;
-unsigned long previousServiceAlarmsMillis = 0;
-const long serviceAlarmsIntervall = 5000;
+// How often TimeLib reads the drift compensated clock, this doesn't touch the network.
+const long clockSyncIntervall = 60;
+// When the clock was last cached in RTC memory.
+unsigned long clockSavedMillis = 0;
+// Transitions go to RTC memory, the runtime record is flushed to the journal at most once per runtimeFlushIntervall.
+bool runtimeFlushed = true;
+unsigned long runtimeFlushedMillis = 0;
+// Local time of the next scheduled transition, 0 forces the state to be evaluated on the next loop.
+time_t nextTransitionTime = 0;
 
 bool firstRun = true;
 
-// Define NTP Client to get time
-WiFiUDP ntpUDP;
-NTPClient timeClient(ntpUDP, "pool.ntp.org", utcOffsetInSeconds);
+// Wifi connection state, driven from loop() so nothing waits for the network.
+typedef enum
+{
+  wifiConnecting,
+  wifiConnected,
+  wifiBackoff
+} wifiState_t;
+
+wifiState_t wifiState = wifiConnecting;
+unsigned long wifiStateMillis = 0;
+const unsigned long wifiConnectTimeout = 15000;
+const unsigned long wifiMinBackoff = 1000;
+const unsigned long wifiMaxBackoff = 300000;
+unsigned long wifiBackoffIntervall = wifiMinBackoff;
 
 // HTTP Server settings
 const char *superSecretPassword = "zuul";
-ESP8266WebServer server(80);
+HttpServer server(80);
+
+// OTA updates are protected by the gatekeeper password unless -DLAMPOMATIC_OTA_PASSWORD='"..."' sets another one.
+#ifdef LAMPOMATIC_OTA_PASSWORD
+const char *otaPassword = LAMPOMATIC_OTA_PASSWORD;
+#else
+const char *otaPassword = superSecretPassword;
+#endif
+// Lamps built with the same -DLAMPOMATIC_FLEET_KEY='"..."' share schedules, a change on one is sent to all of them.
+#ifndef LAMPOMATIC_FLEET_KEY
+#define LAMPOMATIC_FLEET_KEY ""
+#endif
+const char fleetKey[] = LAMPOMATIC_FLEET_KEY;
+
+// Set after too many failed boots in a row, only wifi and OTA are brought up.
+bool safeMode = false;
+bool bootHealthy = false;
+
+// Power settings. Modem sleep keeps requests and multicast prompt, -DLAMPOMATIC_LIGHT_SLEEP saves the most but adds
+// up to a few hundred ms to requests and can miss fleet packets. powerAwake never sleeps.
+#ifdef LAMPOMATIC_LIGHT_SLEEP
+const powerMode_t powerMode = powerLightSleep;
+#else
+const powerMode_t powerMode = powerModemSleep;
+#endif
+// Longest loop() sleeps for. The default server only picks up requests (and the SSE, NTP and fleet sockets are only
+// polled) in loop(), so it waits a millisecond at a time there, which is still enough for modem sleep between
+// beacons without holding up a request. Deeper sleep needs the async server.
+#ifdef LAMPOMATIC_ASYNC_SERVER
+const unsigned long idleMaxMillis = 1000;
+// While connecting or waiting for NTP, which are polled from loop().
+const unsigned long idleBusyMillis = 5;
+#else
+const unsigned long idleMaxMillis = 1;
+const unsigned long idleBusyMillis = 1;
+#endif
 
 // Function prototypes for HTTP handlers
 void handleRoot();
 void handleNotFound();
 void handleGetTime();
 void handlePostSchedule();
+void handleGetWeek();
+void handleApiState();
+void handleMetrics();
+void writeMetrics();
+void handleLog();
+void handleApiGetSchedule();
+void handleApiPutSchedule();
+#ifndef LAMPOMATIC_ASYNC_SERVER
+void handleEvents();
+#endif
+void publishState();
 #ifdef DEBUG_LAMPOMATIC
 void handleDebugPost();
 void getDebug();
@@ -109,52 +199,193 @@ void getDebug();
 
 // Other declarations
 void setSchedule(Schedule day, Schedule night, bool dst, Schedule weekendDay, Schedule weekendNight);
+void setWeekSchedule(const WeekSchedule &week, bool dst);
+void applySchedule(bool dst);
+bool compileSchedule();
+void updateSun();
+SunDay localSunDay(int32_t localDay);
+int16_t localSunMinute(int32_t utcDay, int32_t localDay, int16_t minute);
+time_t utcFromLocal(time_t local);
+time_t localNow();
+long manualDstOffset(bool dst);
+bool applyConfig(const PersistedConfig &config, uint8_t source);
+void shareConfig();
+void applyFleetConfig(const PersistedConfig &config, uint32_t generation);
 void printScheduleAndTime();
 void startNight();
 void endNight();
 void startDay();
 void endDay();
-void clearOldTimers(int timerIds[], int size);
-void readSavedSettings(int eepromAdress);
-bool saveSettings(int eepromAdress, StateContainer state);
-bool serverHasRequiredArgs();
-bool serverHasOptionalArgs();
-void setAlarms(bool weekendActive);
-String getFormattedHourMinuteConcatenation(scheduleType_t scheduleType);
-void setWeekendTimerState();
-void setOutputState();
-
-const int nightPin = D1;
-const int dayPin = D2;
+void readSavedSettings();
+bool saveSettings(const StateContainer &state);
+bool saveOutputState();
+uint8_t outputRuntime();
+void cacheOutputState();
+void flushOutputState();
+void updateStarting();
+PersistedConfig packConfig(const StateContainer &state);
+void unpackConfig(const PersistedConfig &config, StateContainer &state);
+const char *formatScheduleTime(scheduleType_t scheduleType, char text[endpointTextLength]);
+encoding_t requestedEncoding();
+bool apiNotModified(const char *etag);
+void apiSend(encoding_t encoding, pageProducer_t producer);
+time_t apiNextTransition();
+void writeApiState();
+void writeApiSchedule();
+void encodeSchedule(const Schedule &schedule, bool withChannel);
+bool readSchedule(JsonReader &reader, Schedule &schedule, bool nullable, bool withChannel);
+bool readUintArray(JsonReader &reader, uint16_t values[], uint8_t count, uint16_t max);
+bool readWeek(JsonReader &reader, WeekSchedule &week);
+bool readScheduleDocument(const String &body, PersistedConfig &config);
+#ifdef DEBUG_LAMPOMATIC
+void printSchedule(const char *label, const Schedule &schedule);
+#endif
+void serviceSchedule();
+void setOutputState(bool fade);
+void fadeChannel(channel_t channel, uint8_t percent, bool fade);
+void writeRootPage();
+void writeTimePage();
+void writeWeekPage();
+void renderField(const char *field);
+void pagePrintEndpoint(const Schedule &schedule, bool start);
+void pagePrintScheduleTime(scheduleType_t scheduleType);
+void pagePrintWeekSlots();
+void pagePrintWeekForm();
+void beginWifi();
+void saveClock(unsigned long currentMillis);
+void serviceWifi(unsigned long currentMillis);
+unsigned long idleMillis();
+char *formatTime(time_t t, char text[timeTextLength]);
+
+static_assert(Outputs::count == channelCount, "Every schedule channel needs an output");
 
 StateContainer activeSchedules;
+// The config record is only written when a schedule is posted, transitions write the one byte runtime record.
+static_assert(configMaxEncodedLength <= journalMaxPayload, "PersistedConfig doesn't fit in a journal record");
 
-const int eepromAdress = 0;
 bool currentStatePersisted;
+// CRC of the config record in flash, a config that matches it isn't written again.
+uint32_t savedConfigCrc = 0;
+bool savedConfigKnown = false;
+
+// Bumped whenever the schedule or the output state changes, API clients use them (through the ETag) to skip unchanged polls.
+// bootId keeps ETags from before a reboot from matching.
+uint32_t bootId = 0;
+uint32_t scheduleGeneration = 0;
+uint32_t stateGeneration = 0;
+// Encoding of the API response being sent, see apiSend().
+encoding_t apiEncoding = encodingJson;
+
+// Timings for /metrics, one histogram per route handler.
+typedef enum : uint8_t
+{
+  handlerRoot,
+  handlerGetTime,
+  handlerPostSchedule,
+  handlerGetWeek,
+  handlerApiState,
+  handlerApiGetSchedule,
+  handlerApiPutSchedule,
+  handlerEvents,
+  handlerMetrics,
+  handlerLog,
+  handlerNotFound,
+  handlerCount
+} handler_t;
+
+const char *const handlerLabels[handlerCount] = {
+    "handler=\"root\"", "handler=\"get_time\"", "handler=\"post_time\"", "handler=\"week\"",
+    "handler=\"api_state\"", "handler=\"api_get_schedule\"", "handler=\"api_put_schedule\"",
+    "handler=\"events\"", "handler=\"metrics\"", "handler=\"log\"", "handler=\"not_found\""};
+
+MetricsHistogram loopHistogram;
+MetricsHistogram handlerHistograms[handlerCount];
+
+// Handlers are registered through this, so each call lands in its histogram.
+template <void (*handler)(), handler_t index>
+void timedHandler()
+{
+  uint32_t start = micros();
+  handler();
+  metricsRecord(handlerHistograms[index], micros() - start);
+}
 
 void setup()
 {
-  EEPROM.begin(512);
 #ifdef DEBUG_LAMPOMATIC
   Serial.begin(115200);
 #endif
-  pinMode(nightPin, OUTPUT);
-  pinMode(dayPin, OUTPUT);
-  WiFi.begin(ssid, password);
+  safeMode = bootGuardBegin();
+  eventLogBegin();
+  if (safeMode)
+  {
+    // Whatever crashed the last boots is left out, the lights stay off until a working image is pushed.
+#ifdef DEBUG_LAMPOMATIC
+    Serial.println("Too many failed boots, starting in safe mode");
+#endif
+    beginWifi();
+    otaBegin(otaPassword, updateStarting);
+    return;
+  }
+  rtcCacheBegin();
+  fadeBegin();
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    activeSchedules.fadeInSeconds[channel] = defaultFadeSeconds;
+    activeSchedules.fadeOutSeconds[channel] = defaultFadeSeconds;
+  }
 
-  while (WiFi.status() != WL_CONNECTED)
+  // Restore the outputs straight away, the schedule takes over once time is known.
+  readSavedSettings();
+  if (activeSchedules.persistedInEEPROM == true)
   {
-    delay(500);
+    setOutputState(false);
+  }
+  uint32_t storedGeneration = 0;
+  journalReadLatest(recordFleet, &storedGeneration, sizeof(storedGeneration));
+  fleetBegin(fleetKey, storedGeneration, packConfig(activeSchedules), applyFleetConfig);
+
+  beginWifi();
+  powerBegin(powerMode);
+
+  bootId = ESP.random();
+  if (!tzBegin(timeZone))
+  {
+#ifdef DEBUG_LAMPOMATIC
+    Serial.println("Invalid time zone, using UTC");
+#endif
+    tzBegin("UTC0");
+  }
+  ntpBegin();
+  // After a reset the time cached in RTC memory runs the schedule until NTP answers, so nothing waits for wifi.
+  uint64_t cachedUtcMs;
+  int32_t cachedDriftPpm;
+  if (rtcClockRestore(cachedUtcMs, cachedDriftPpm))
+  {
+    ntpSeed(cachedUtcMs, cachedDriftPpm);
 #ifdef DEBUG_LAMPOMATIC
-    Serial.print(".");
+    Serial.println("Clock restored from RTC memory");
 #endif
   }
-  timeClient.setTimeOffset(utcOffsetInSeconds + dstOffsetInSeconds);
-  timeClient.begin();
-  server.on("/", HTTP_GET, handleRoot);
-  server.on("/time", HTTP_GET, handleGetTime);
-  server.on("/time", HTTP_POST, handlePostSchedule);
-  server.onNotFound(handleNotFound);
+  setSyncProvider(localNow);
+  setSyncInterval(clockSyncIntervall);
+  server.on("/", HTTP_GET, timedHandler<handleRoot, handlerRoot>);
+  server.on("/time", HTTP_GET, timedHandler<handleGetTime, handlerGetTime>);
+  server.on("/time", HTTP_POST, timedHandler<handlePostSchedule, handlerPostSchedule>);
+  server.on("/week", HTTP_GET, timedHandler<handleGetWeek, handlerGetWeek>);
+  server.on("/api/state", HTTP_GET, timedHandler<handleApiState, handlerApiState>);
+  server.on("/api/schedule", HTTP_GET, timedHandler<handleApiGetSchedule, handlerApiGetSchedule>);
+  server.on("/api/schedule", HTTP_PUT, timedHandler<handleApiPutSchedule, handlerApiPutSchedule>);
+#ifdef LAMPOMATIC_ASYNC_SERVER
+  eventsBegin(server, "/events");
+#else
+  server.on("/events", HTTP_GET, timedHandler<handleEvents, handlerEvents>);
+#endif
+  server.on("/metrics", HTTP_GET, timedHandler<handleMetrics, handlerMetrics>);
+  server.on("/log", HTTP_GET, timedHandler<handleLog, handlerLog>);
+  const char *apiHeaders[] = {"Accept", "If-None-Match", "X-Gatekeeper"};
+  server.collectHeaders(apiHeaders, 3);
+  server.onNotFound(timedHandler<handleNotFound, handlerNotFound>);
 #ifdef DEBUG_LAMPOMATIC
   server.on("/debug", HTTP_GET, getDebug);
   server.on("/debug", HTTP_POST, handleDebugPost);
@@ -163,10 +394,26 @@ void setup()
 #ifdef DEBUG_LAMPOMATIC
   Serial.println("HTTP server started");
 #endif
+  otaBegin(otaPassword, updateStarting);
 }
 
 void loop()
 {
+  uint32_t loopStart = micros();
+  // A boot that has kept running for a while is a good one, reset the failure count.
+  if (!bootHealthy && millis() >= bootHealthyMillis)
+  {
+    bootGuardHealthy();
+    bootHealthy = true;
+  }
+  if (safeMode)
+  {
+    serviceWifi(millis());
+    otaService(millis(), wifiState == wifiConnected);
+    eventLogService();
+    delay(idleBusyMillis);
+    return;
+  }
   // First run
   if (firstRun == true && timeStatus() == timeSet)
   {
@@ -177,11 +424,13 @@ void loop()
     Serial.println(activeSchedules.persistedInEEPROM);
 #endif
     firstRun = false;
-    readSavedSettings(eepromAdress);
-    if (activeSchedules.persistedInEEPROM == true)
+    if (activeSchedules.persistedInEEPROM == true && activeSchedules.weeklyActive)
+    {
+      setWeekSchedule(activeSchedules.week, activeSchedules.dstActive);
+    }
+    else if (activeSchedules.persistedInEEPROM == true)
     {
       setSchedule(activeSchedules.day, activeSchedules.night, activeSchedules.dstActive, activeSchedules.weekendDay, activeSchedules.weekendNight);
-      setOutputState();
     }
 #ifdef DEBUG_LAMPOMATIC
     Serial.print("Exiting first run loop, firstRun value: ");
@@ -192,143 +441,791 @@ void loop()
   }
 
   unsigned long currentMillis = millis();
-  // Service alarms.
-  if (timeStatus() == timeSet && (currentMillis - previousServiceAlarmsMillis >= serviceAlarmsIntervall))
-  {
-    previousServiceAlarmsMillis = currentMillis;
+  serviceWifi(currentMillis);
 
-    if (activeSchedules.initialized)
+  // A new local day, move sunrise and sunset along. Only recompiles, the schedule itself is the same.
+  if (timeStatus() != timeNotSet && (int32_t)(now() / SECS_PER_DAY) != sunDay)
+  {
+    updateSun();
+    if (activeSchedules.initialized && compileSchedule())
     {
-      // Enable or disable timers deending on day and if weekend is active.
-      if (activeSchedules.weekendDay.startHour != -1)
-      {
-        setWeekendTimerState();
-      }
-      setOutputState();
+      nextTransitionTime = 0;
     }
+  }
 
-    Alarm.delay(50);
+  // Scheduled transitions, nothing to do in between.
+  if (activeSchedules.initialized && timeStatus() != timeNotSet && now() >= nextTransitionTime)
+  {
+    serviceSchedule();
   }
 
-  // Update the time from NTP source.
-  if (currentMillis - previousNtpUpdateMillis >= updateNtpIntervall)
+  // Update the time from NTP source. Requests and answers are handled over several loops, so this never blocks.
+  if (ntpService(currentMillis, wifiState == wifiConnected))
   {
-    previousNtpUpdateMillis = currentMillis;
-    timeClient.update();
-    setTime(timeClient.getEpochTime());
+    setTime(localNow());
+    saveClock(currentMillis);
+    // The clock may have jumped past (or back over) a transition.
+    nextTransitionTime = 0;
 #ifdef DEBUG_LAMPOMATIC
     printScheduleAndTime();
 #endif
   }
-  server.handleClient();
+  // DST starting or ending. The table is in local time, so it stays as it is and only the clock is moved.
+  else if (ntpNow() != 0 && ntpNow() >= tzNextChange())
+  {
+    setTime(localNow());
+    nextTransitionTime = 0;
+  }
+  else if (ntpNow() != 0 && currentMillis - clockSavedMillis >= rtcClockSaveIntervall)
+  {
+    saveClock(currentMillis);
+  }
+  // A power cut loses RTC memory, so the journal is never more than a day behind.
+  if (!runtimeFlushed && currentMillis - runtimeFlushedMillis >= runtimeFlushIntervall)
+  {
+    saveOutputState();
+  }
+  if (fadeTakeCompleted())
+  {
+    char data[40];
+    snprintf(data, sizeof(data), "{\"day\":%u,\"night\":%u}", fadeTarget(channelDay), fadeTarget(channelNight));
+    eventsPublish("fade", data);
+  }
+  if (eventsTakeConnected())
+  {
+    publishState();
+  }
+  eventsService(currentMillis);
+  eventLogService();
+  server.handleClient(); // Nothing to do for the async server.
+  otaService(currentMillis, wifiState == wifiConnected);
+  fleetService(currentMillis, wifiState == wifiConnected);
+  fadeService();
+  metricsRecord(loopHistogram, micros() - loopStart);
+  powerIdle(idleMillis(), fadePwmActive());
+}
+
+// How long loop() can sleep before anything needs it again.
+unsigned long idleMillis()
+{
+  if (wifiState != wifiConnected || ntpBusy())
+  {
+    return idleBusyMillis;
+  }
+  unsigned long idle = idleMaxMillis;
+  // A bus driver's fade steps are sent from loop(), so it wakes up for each of them.
+  if (Outputs::blockingFlush && fadeActive() && idle > fadeStepMillis)
+  {
+    idle = fadeStepMillis;
+  }
+  if (activeSchedules.initialized && timeStatus() != timeNotSet)
+  {
+    time_t current = now();
+    if (nextTransitionTime <= current)
+    {
+      return 0;
+    }
+    if ((unsigned long)(nextTransitionTime - current) * 1000UL < idle)
+    {
+      idle = (nextTransitionTime - current) * 1000;
+    }
+  }
+  return idle;
+}
+
+void saveClock(unsigned long currentMillis)
+{
+  rtcClockSave(ntpNowMs(), ntpDriftPpm());
+  clockSavedMillis = currentMillis;
+}
+
+// Don't let the SDK write credentials to flash on every begin(), and handle reconnects in serviceWifi().
+void beginWifi()
+{
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);
+  WiFi.begin(ssid, password);
+  wifiStateMillis = millis();
+}
+
+void serviceWifi(unsigned long currentMillis)
+{
+  bool connected = WiFi.status() == WL_CONNECTED;
+  switch (wifiState)
+  {
+  case wifiConnecting:
+    if (connected)
+    {
+      wifiState = wifiConnected;
+      wifiBackoffIntervall = wifiMinBackoff;
+      eventLog(eventWifiUp, 0, WiFi.RSSI());
+#ifdef DEBUG_LAMPOMATIC
+      Serial.print("Wifi connected, IP: ");
+      Serial.println(WiFi.localIP());
+#endif
+    }
+    else if (currentMillis - wifiStateMillis >= wifiConnectTimeout)
+    {
+      WiFi.disconnect();
+      wifiState = wifiBackoff;
+      wifiStateMillis = currentMillis;
+#ifdef DEBUG_LAMPOMATIC
+      Serial.print("Wifi connect timed out, retrying in ");
+      Serial.println(wifiBackoffIntervall);
+#endif
+    }
+    break;
+  case wifiConnected:
+    if (!connected)
+    {
+      wifiState = wifiBackoff;
+      wifiStateMillis = currentMillis;
+      eventLog(eventWifiDown, 0, WiFi.status());
+#ifdef DEBUG_LAMPOMATIC
+      Serial.println("Wifi connection lost");
+#endif
+    }
+    break;
+  case wifiBackoff:
+    if (currentMillis - wifiStateMillis >= wifiBackoffIntervall)
+    {
+      WiFi.begin(ssid, password);
+      wifiState = wifiConnecting;
+      wifiStateMillis = currentMillis;
+      wifiBackoffIntervall = wifiBackoffIntervall * 2 > wifiMaxBackoff ? wifiMaxBackoff : wifiBackoffIntervall * 2;
+    }
+    break;
+  }
 }
 
 // HTTP Handlers
+
+// Page templates, %NAME% fields are filled in by renderField().
+// Schedule times are text inputs, a time input can't take "sunset-30".
+#define ENDPOINT_INPUT "type=\"text\" size=\"11\" placeholder=\"HH:MM\" pattern=\"([01][0-9]|2[0-3]):[0-5][0-9]|sun(rise|set)((\\+|-)[0-9]{1,3})?\""
+const char rootPage[] PROGMEM = "<form action=\"/time\" method=\"POST\">Day start: <input " ENDPOINT_INPUT " name=\"dayStart\" value=\"%DAY_START%\"> - end: <input " ENDPOINT_INPUT " name=\"dayEnd\"value=\"%DAY_END%\"><label for=\"dayIntensity\">Intensity (1-100):</label><input type=\"number\" id=\"dayIntensity\" name=\"dayIntensity\" min=\"1\" max=\"100\" value=\"%DAY_INTENSITY%\"></br>Night start: <input " ENDPOINT_INPUT " name=\"nightStart\" value=\"%NIGHT_START%\"> - end: <input " ENDPOINT_INPUT " name=\"nightEnd\" value=\"%NIGHT_END%\"><label for=\"nightIntensity\">Intensity (1-100):</label><input type=\"number\" id=\"nightIntensity\" name=\"nightIntensity\" min=\"1\" max=\"100\" value=\"%NIGHT_INTENSITY%\"></br><hr><p>Weekend schedule is optional. If omitted, regular schedule will be used.</p>Weekend day start: <input " ENDPOINT_INPUT " name=\"weekendDayStart\" value=\"%WEEKEND_DAY_START%\"> - end: <input " ENDPOINT_INPUT " name=\"weekendDayEnd\"value=\"%WEEKEND_DAY_END%\"></br>Weekend night start: <input " ENDPOINT_INPUT " name=\"weekendNightStart\" value=\"%WEEKEND_NIGHT_START%\"> - end: <input " ENDPOINT_INPUT " name=\"weekendNightEnd\"value=\"%WEEKEND_NIGHT_END%\"><hr>%FADES%</br>%DST%<input type=\"password\" name=\"gatekeeper\" placeholder=\"Key\"> - <input type=\"submit\" formmethod=\"post\" value=\"Submit\"></form><a href=\"/week\">Weekly schedule</a>";
+const char weekPage[] PROGMEM = "<form action=\"/time\" method=\"POST\"><input type=\"hidden\" name=\"weekly\" value=\"1\"><p>Leave start and end empty to disable a slot. A slot ending before it starts runs into the next day.</p>%WEEK_FORM%<hr><label for=\"dayIntensity\">Day intensity (1-100):</label><input type=\"number\" id=\"dayIntensity\" name=\"dayIntensity\" min=\"1\" max=\"100\" value=\"%DAY_INTENSITY%\"></br><label for=\"nightIntensity\">Night intensity (1-100):</label><input type=\"number\" id=\"nightIntensity\" name=\"nightIntensity\" min=\"1\" max=\"100\" value=\"%NIGHT_INTENSITY%\"></br>%FADES%%DST%<input type=\"password\" name=\"gatekeeper\" placeholder=\"Key\"> - <input type=\"submit\" formmethod=\"post\" value=\"Submit\"></form>";
+const char fadeInputs[] PROGMEM = "Day fade in (s): <input type=\"number\" name=\"dayFadeIn\" min=\"0\" max=\"3600\" value=\"%DAY_FADE_IN%\"> - out: <input type=\"number\" name=\"dayFadeOut\" min=\"0\" max=\"3600\" value=\"%DAY_FADE_OUT%\"></br>Night fade in (s): <input type=\"number\" name=\"nightFadeIn\" min=\"0\" max=\"3600\" value=\"%NIGHT_FADE_IN%\"> - out: <input type=\"number\" name=\"nightFadeOut\" min=\"0\" max=\"3600\" value=\"%NIGHT_FADE_OUT%\"></br>";
+const char timePage[] PROGMEM = "<P>Current Time: %TIME%</p><p>Day schedule: %DAY_START%-%DAY_END%, Intensity: %DAY_INTENSITY%</p><p>Night schedule: %NIGHT_START%-%NIGHT_END%, Intensity: %NIGHT_INTENSITY%</p><hr><p>Weekend day: %WEEKEND_DAY_START% - %WEEKEND_DAY_END%</p><p>Weekend night: %WEEKEND_NIGHT_START% - %WEEKEND_NIGHT_END%</p>";
+const char weekTimePage[] PROGMEM = "<P>Current Time: %TIME%</p><p>Weekly schedule, day intensity: %DAY_INTENSITY%, night intensity: %NIGHT_INTENSITY%</p>%WEEK_SLOTS%";
+
 void handleRoot()
 {
-  String dayStartTime = getFormattedHourMinuteConcatenation(dayStart);
-  String dayEndTime = getFormattedHourMinuteConcatenation(dayEnd);
-  String nightStartTime = getFormattedHourMinuteConcatenation(nightStart);
-  String nightEndTime = getFormattedHourMinuteConcatenation(nightEnd);
-  String weekendDayStartTime = getFormattedHourMinuteConcatenation(weekendDayStart);
-  String weekendDayEndTime = getFormattedHourMinuteConcatenation(weekendDayEnd);
-  String weekendNightStartTime = getFormattedHourMinuteConcatenation(weekendNightStart);
-  String weekendNightEndTime = getFormattedHourMinuteConcatenation(weekendNightEnd);
-  server.send(200, "text/html", "<form action=\"/time\" method=\"POST\">Day start: <input type=\"time\" name=\"dayStart\" value=\"" + dayStartTime + "\"> - end: <input type=\"time\" name=\"dayEnd\"value=\"" + dayEndTime + "\"><label for=\"dayIntensity\">Intensity (1-100):</label><input type=\"number\" id=\"dayIntensity\" name=\"dayIntensity\" min=\"1\" max=\"100\" value=\"" + activeSchedules.dayIntensity + "\"></br>Night start: <input type=\"time\" name=\"nightStart\" value=\"" + nightStartTime + "\"> - end: <input type=\"time\" name=\"nightEnd\" value=\"" + nightEndTime + "\"><label for=\"nightIntensity\">Intensity (1-100):</label><input type=\"number\" id=\"nightIntensity\" name=\"nightIntensity\" min=\"1\" max=\"100\" value=\"" + activeSchedules.nightIntensity + "\"></br><hr><p>Weekend schedule is optional. If omitted, regular schedule will be used.</p>Weekend day start: <input type=\"time\" name=\"weekendDayStart\" value=\"" + weekendDayStartTime + "\"> - end: <input type=\"time\" name=\"weekendDayEnd\"value=\"" + weekendDayEndTime + "\"></br>Weekend night start: <input type=\"time\" name=\"weekendNightStart\" value=\"" + weekendNightStartTime + "\"> - end: <input type=\"time\" name=\"weekendNightEnd\"value=\"" + weekendNightEndTime + "\"><hr></br><input type=\"checkbox\" name=\"dst\" id=\"dst\"><label for=\"dst\">Daylight savings time</label></br><input type=\"password\" name=\"gatekeeper\" placeholder=\"Key\"> - <input type=\"submit\" formmethod=\"post\" value=\"Submit\"></form>");
+  pageSend(server, 200, "text/html", writeRootPage);
 }
 
 void handleGetTime()
 {
-  String day = daysOfTheWeek[timeClient.getDay()];
-  String currentTime = day + ", " + timeClient.getFormattedTime();
-
 #ifdef DEBUG_LAMPOMATIC
+  char text[timeTextLength];
   Serial.print("In getTime: ");
-  Serial.println(currentTime);
+  Serial.print(daysOfTheWeek[weekday() - 1]);
+  Serial.print(", ");
+  Serial.println(formatTime(now(), text));
 #endif
 
-  server.send(200, "text/html; charset=utf-8", "<P>Current Time: " + currentTime + "</p><p>Day schedule: " + getFormattedHourMinuteConcatenation(dayStart) + "-" + getFormattedHourMinuteConcatenation(dayEnd) + ", Intensity: " + activeSchedules.dayIntensity + "</p><p>Night schedule: " + getFormattedHourMinuteConcatenation(nightStart) + "-" + getFormattedHourMinuteConcatenation(nightEnd) + ", Intensity: " + activeSchedules.nightIntensity + "</p><hr><p>Weekend day: " + getFormattedHourMinuteConcatenation(weekendDayStart) + " - " + getFormattedHourMinuteConcatenation(weekendDayEnd) + "</p><p>Weekend night: " + getFormattedHourMinuteConcatenation(weekendNightStart) + " - " + getFormattedHourMinuteConcatenation(weekendNightEnd) + "</p>");
+  pageSend(server, 200, "text/html; charset=utf-8", writeTimePage);
+}
+
+void handleGetWeek()
+{
+  pageSend(server, 200, "text/html; charset=utf-8", writeWeekPage);
+}
+
+// Page bodies, run through pageSend().
+void writeRootPage()
+{
+  pageRender_P(rootPage, renderField);
+}
+
+void writeTimePage()
+{
+  pageRender_P(activeSchedules.weeklyActive ? weekTimePage : timePage, renderField);
+}
+
+void writeWeekPage()
+{
+  pageRender_P(weekPage, renderField);
+}
+
+void renderField(const char *field)
+{
+  const char *scheduleFields[] = {"DAY_START", "DAY_END", "NIGHT_START", "NIGHT_END", "WEEKEND_DAY_START", "WEEKEND_DAY_END", "WEEKEND_NIGHT_START", "WEEKEND_NIGHT_END"};
+  for (uint8_t scheduleType = dayStart; scheduleType <= weekendNightEnd; scheduleType++)
+  {
+    if (strcmp(field, scheduleFields[scheduleType]) == 0)
+    {
+      pagePrintScheduleTime(static_cast<scheduleType_t>(scheduleType));
+      return;
+    }
+  }
+
+  if (strcmp(field, "DAY_INTENSITY") == 0)
+  {
+    pagePrintf("%d", activeSchedules.dayIntensity);
+  }
+  else if (strcmp(field, "NIGHT_INTENSITY") == 0)
+  {
+    pagePrintf("%d", activeSchedules.nightIntensity);
+  }
+  else if (strcmp(field, "DAY_FADE_IN") == 0)
+  {
+    pagePrintf("%u", activeSchedules.fadeInSeconds[channelDay]);
+  }
+  else if (strcmp(field, "DAY_FADE_OUT") == 0)
+  {
+    pagePrintf("%u", activeSchedules.fadeOutSeconds[channelDay]);
+  }
+  else if (strcmp(field, "NIGHT_FADE_IN") == 0)
+  {
+    pagePrintf("%u", activeSchedules.fadeInSeconds[channelNight]);
+  }
+  else if (strcmp(field, "NIGHT_FADE_OUT") == 0)
+  {
+    pagePrintf("%u", activeSchedules.fadeOutSeconds[channelNight]);
+  }
+  else if (strcmp(field, "FADES") == 0)
+  {
+    pageRender_P(fadeInputs, renderField);
+  }
+  else if (strcmp(field, "TIME") == 0)
+  {
+    time_t t = now();
+    char text[timeTextLength];
+    pagePrint(daysOfTheWeek[weekday(t) - 1]);
+    pagePrint(", ");
+    pagePrint(formatTime(t, text));
+  }
+  else if (strcmp(field, "WEEK_SLOTS") == 0)
+  {
+    pagePrintWeekSlots();
+  }
+  else if (strcmp(field, "WEEK_FORM") == 0)
+  {
+    pagePrintWeekForm();
+  }
+  else if (strcmp(field, "DST") == 0)
+  {
+    if (tzHasDst())
+    {
+      pagePrint(tzDstActive() ? "<p>Daylight savings time (automatic, in effect)</p>" : "<p>Daylight savings time (automatic)</p>");
+    }
+    else
+    {
+      pagePrint(activeSchedules.dstActive ? "<input type=\"checkbox\" name=\"dst\" id=\"dst\" checked>" : "<input type=\"checkbox\" name=\"dst\" id=\"dst\">");
+      pagePrint("<label for=\"dst\">Daylight savings time</label></br>");
+    }
+  }
 }
 
+void pagePrintEndpoint(const Schedule &schedule, bool start)
+{
+  char text[endpointTextLength];
+  pagePrint(formatScheduleEndpoint(schedule, start, text));
+}
+
+void pagePrintScheduleTime(scheduleType_t scheduleType)
+{
+  char text[endpointTextLength];
+  pagePrint(formatScheduleTime(scheduleType, text));
+}
+
+void pagePrintWeekSlots()
+{
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    pagePrintf("<p>%s:", daysOfTheWeek[weekday]);
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      const Schedule &schedule = activeSchedules.week.slots[weekday][slot];
+      if (scheduleIsEnabled(schedule))
+      {
+        pagePrint(" ");
+        pagePrintEndpoint(schedule, true);
+        pagePrint(" - ");
+        pagePrintEndpoint(schedule, false);
+        pagePrint(scheduleChannel(schedule) == channelNight ? " (night)" : " (day)");
+      }
+    }
+    pagePrint("</p>");
+  }
+}
+
+void pagePrintWeekForm()
+{
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    pagePrintf("<p>%s</br>", daysOfTheWeek[weekday]);
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      const Schedule &schedule = activeSchedules.week.slots[weekday][slot];
+      bool enabled = scheduleIsEnabled(schedule);
+      pagePrintf("Start: <input " ENDPOINT_INPUT " name=\"w%us%uStart\" value=\"", weekday, slot);
+      if (enabled)
+      {
+        pagePrintEndpoint(schedule, true);
+      }
+      pagePrintf("\"> - end: <input " ENDPOINT_INPUT " name=\"w%us%uEnd\" value=\"", weekday, slot);
+      if (enabled)
+      {
+        pagePrintEndpoint(schedule, false);
+      }
+      pagePrintf("\"> <select name=\"w%us%uChannel\"><option value=\"day\">Day</option><option value=\"night\"%s>Night</option></select></br>", weekday, slot, scheduleChannel(schedule) == channelNight ? " selected" : "");
+    }
+    pagePrint("</p>");
+  }
+}
+
+// The form is read in one pass over its fields, see schedule_form.
 void handlePostSchedule()
 {
-  if (!server.hasArg("gatekeeper") || server.arg("gatekeeper") == NULL)
+  ScheduleForm form;
+  formBegin(form, packConfig(activeSchedules), superSecretPassword);
+  for (int i = 0; i < server.args(); i++)
+  {
+    formField(form, server.argName(i).c_str(), server.arg(i).c_str());
+  }
+
+  if (!form.gatekeeperSent)
   {                                                         // If the POST request doesn't contain password data
     server.send(400, "text/plain", "400: Invalid Request"); // The request is invalid, so send HTTP status 400
     return;
   }
-  else if (server.arg("gatekeeper") == superSecretPassword)
-  {
-    if (serverHasRequiredArgs())
-    {
-      activeSchedules.nightIntensity = server.arg("nightIntensity").toInt();
-      activeSchedules.dayIntensity = server.arg("dayIntensity").toInt();
-
-      bool dst = server.hasArg("dst") && (server.arg("dst") == "on");
-      Schedule day;
-      day.startHour = server.arg("dayStart").substring(0, 2).toInt();
-      day.startMinute = server.arg("dayStart").substring(3).toInt();
-      day.endHour = server.arg("dayEnd").substring(0, 2).toInt();
-      day.endMinute = server.arg("dayEnd").substring(3).toInt();
-      Schedule night;
-      night.startHour = server.arg("nightStart").substring(0, 2).toInt();
-      night.startMinute = server.arg("nightStart").substring(3).toInt();
-      night.endHour = server.arg("nightEnd").substring(0, 2).toInt();
-      night.endMinute = server.arg("nightEnd").substring(3).toInt();
-      Schedule weekendDay;
-      weekendDay.startHour = -1;
-      Schedule weekendNight;
-      weekendNight.startHour = -1;
-
-      if (serverHasOptionalArgs())
+  if (!form.gatekeeperOk)
+  { // Password don't match
+    server.send(401, "text/plain", "401: Unauthorized");
+    return;
+  }
+  if (!formFinish(form))
+  {
+    char message[64];
+    snprintf(message, sizeof(message), "400: Invalid %s, expected %s", form.invalidField, form.expected);
+    server.send(400, "text/plain; charset=utf-8", message);
+    return;
+  }
+
+  if (applyConfig(form.config, eventSourcePage))
+  {
+    shareConfig();
+  }
+  handleGetTime();
+}
+
+// Decoded from the binary records only now, oldest first.
+void handleLog()
+{
+  pageSend(server, 200, "text/plain; charset=utf-8", eventLogWrite);
+}
+
+void handleNotFound()
+{
+  server.send(404, "text/plain; charset=utf-8", "404: Not found"); // Send HTTP status 404 (Not Found) when there's no handler for the URI in the request
+}
+
+// Prometheus text format, counters are since boot except the erase count which the journal keeps in flash.
+void handleMetrics()
+{
+  pageSend(server, 200, "text/plain; version=0.0.4; charset=utf-8", writeMetrics);
+}
+
+void writeMetrics()
+{
+  metricsWriteType("lampomatic_loop_seconds", "histogram", "Time spent in one loop() iteration.");
+  metricsWriteHistogram("lampomatic_loop_seconds", nullptr, loopHistogram);
+  metricsWriteType("lampomatic_handler_seconds", "histogram", "Time spent in a web server handler.");
+  for (uint8_t handler = 0; handler < handlerCount; handler++)
+  {
+    metricsWriteHistogram("lampomatic_handler_seconds", handlerLabels[handler], handlerHistograms[handler]);
+  }
+
+  metricsWriteType("lampomatic_flash_writes_total", "counter", "Journal records written to flash.");
+  metricsWriteValue("lampomatic_flash_writes_total", nullptr, journalWriteCount());
+  metricsWriteType("lampomatic_flash_written_bytes_total", "counter", "Bytes written to flash by the journal.");
+  metricsWriteValue("lampomatic_flash_written_bytes_total", nullptr, journalBytesWritten());
+  metricsWriteType("lampomatic_flash_erases_total", "counter", "Journal sector erases, over the life of the sector.");
+  metricsWriteValue("lampomatic_flash_erases_total", nullptr, journalEraseCount());
+
+  metricsWriteType("lampomatic_ntp_answers_total", "counter", "NTP answers received.");
+  metricsWriteValue("lampomatic_ntp_answers_total", nullptr, ntpAnswerCount());
+  metricsWriteType("lampomatic_ntp_failures_total", "counter", "NTP attempts that timed out or failed to resolve.");
+  metricsWriteValue("lampomatic_ntp_failures_total", nullptr, ntpFailureCount());
+  metricsWriteType("lampomatic_ntp_round_trip_seconds", "gauge", "Round trip of the latest NTP answer.");
+  metricsWriteSeconds("lampomatic_ntp_round_trip_seconds", nullptr, (uint64_t)ntpLastRoundTrip() * 1000);
+  metricsWriteType("lampomatic_ntp_drift_ppm", "gauge", "Measured drift of the local clock.");
+  metricsWriteValue("lampomatic_ntp_drift_ppm", nullptr, ntpDriftPpm());
+  metricsWriteType("lampomatic_dst_active", "gauge", "Whether daylight savings time is in effect.");
+  metricsWriteValue("lampomatic_dst_active", nullptr, (uint32_t)(tzHasDst() ? tzDstActive() : activeSchedules.dstActive));
+
+  metricsWriteType("lampomatic_fleet_generation", "gauge", "Generation of the fleet schedule running, 0 without a fleet.");
+  metricsWriteValue("lampomatic_fleet_generation", nullptr, fleetGeneration());
+  metricsWriteType("lampomatic_boot_failures", "gauge", "Failed boots in a row before this one.");
+  metricsWriteValue("lampomatic_boot_failures", nullptr, (uint32_t)bootGuardFailures());
+  metricsWriteType("lampomatic_power_mode", "gauge", "Sleep between loops, 0 awake, 1 modem sleep, 2 light sleep.");
+  metricsWriteValue("lampomatic_power_mode", nullptr, (uint32_t)powerActiveMode());
+  metricsWriteType("lampomatic_heap_free_bytes", "gauge", "Free heap.");
+  metricsWriteValue("lampomatic_heap_free_bytes", nullptr, (uint32_t)ESP.getFreeHeap());
+  metricsWriteType("lampomatic_heap_max_block_bytes", "gauge", "Largest allocatable heap block.");
+  metricsWriteValue("lampomatic_heap_max_block_bytes", nullptr, (uint32_t)ESP.getMaxFreeBlockSize());
+  metricsWriteType("lampomatic_heap_fragmentation_percent", "gauge", "Heap fragmentation.");
+  metricsWriteValue("lampomatic_heap_fragmentation_percent", nullptr, (uint32_t)ESP.getHeapFragmentation());
+}
+
+// JSON (or MessagePack) API
+encoding_t requestedEncoding()
+{
+  return server.arg("format") == "msgpack" || server.header("Accept").indexOf("msgpack") >= 0 ? encodingMsgpack : encodingJson;
+}
+
+// Sends a 304 and returns true when the client already has this version.
+bool apiNotModified(const char *etag)
+{
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Cache-Control", "no-cache");
+  server.sendHeader("Vary", "Accept");
+  if (server.header("If-None-Match") == etag)
+  {
+    server.send(304);
+    return true;
+  }
+  return false;
+}
+
+// The body is written by producer, which starts it with encodeBegin(apiEncoding). It's only set for a page that's
+// going to be sent, the async server may still be running the producer of the one before for its next chunk.
+void apiSend(encoding_t encoding, pageProducer_t producer)
+{
+  if (!pageBusy())
+  {
+    apiEncoding = encoding;
+  }
+  pageSend(server, 200, encoding == encodingMsgpack ? "application/msgpack" : "application/json", producer);
+}
+
+// Unix time of the next transition, 0 until there's a clock and a schedule.
+time_t apiNextTransition()
+{
+  return activeSchedules.initialized && timeStatus() != timeNotSet && nextTransitionTime != 0 ? utcFromLocal(nextTransitionTime) : 0;
+}
+
+void handleApiState()
+{
+  encoding_t encoding = requestedEncoding();
+  bool timeSet = timeStatus() != timeNotSet;
+  time_t nextTransition = apiNextTransition();
+  // The clock and the next transition change without either generation moving, so they're part of the tag too.
+  char etag[48];
+  snprintf(etag, sizeof(etag), "\"%08x-%u-%u-%x%s%s\"", bootId, scheduleGeneration, stateGeneration, (unsigned)nextTransition,
+           timeSet ? "" : "u", encoding == encodingMsgpack ? "m" : "");
+  if (apiNotModified(etag))
+  {
+    return;
+  }
+  apiSend(encoding, writeApiState);
+}
+
+void writeApiState()
+{
+  encodeBegin(apiEncoding);
+  encodeMap(7);
+  encodeKey("day");
+  encodeBool(activeSchedules.currentState.dayActive);
+  encodeKey("night");
+  encodeBool(activeSchedules.currentState.nightActive);
+  encodeKey("dayIntensity");
+  encodeUint(activeSchedules.dayIntensity);
+  encodeKey("nightIntensity");
+  encodeUint(activeSchedules.nightIntensity);
+  encodeKey("timeSet");
+  encodeBool(timeStatus() != timeNotSet);
+  encodeKey("nextTransition");
+  encodeUint(apiNextTransition());
+  encodeKey("generation");
+  encodeUint(scheduleGeneration);
+  encodeEnd();
+}
+
+void encodeSchedule(const Schedule &schedule, bool withChannel)
+{
+  char text[endpointTextLength];
+  if (!scheduleIsEnabled(schedule))
+  {
+    encodeNull();
+    return;
+  }
+  encodeMap(withChannel ? 3 : 2);
+  encodeKey("start");
+  encodeString(formatScheduleEndpoint(schedule, true, text));
+  encodeKey("end");
+  encodeString(formatScheduleEndpoint(schedule, false, text));
+  if (withChannel)
+  {
+    encodeKey("channel");
+    encodeString(scheduleChannel(schedule) == channelNight ? "night" : "day");
+  }
+  encodeEnd();
+}
+
+void handleApiGetSchedule()
+{
+  encoding_t encoding = requestedEncoding();
+  char etag[32];
+  snprintf(etag, sizeof(etag), "\"%08x-%u%s\"", bootId, scheduleGeneration, encoding == encodingMsgpack ? "m" : "");
+  if (apiNotModified(etag))
+  {
+    return;
+  }
+  apiSend(encoding, writeApiSchedule);
+}
+
+void writeApiSchedule()
+{
+  encodeBegin(apiEncoding);
+  encodeMap(11);
+  encodeKey("weekly");
+  encodeBool(activeSchedules.weeklyActive);
+  encodeKey("dst");
+  encodeBool(activeSchedules.dstActive);
+  encodeKey("dayIntensity");
+  encodeUint(activeSchedules.dayIntensity);
+  encodeKey("nightIntensity");
+  encodeUint(activeSchedules.nightIntensity);
+  encodeKey("fadeIn");
+  encodeArray(channelCount);
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    encodeUint(activeSchedules.fadeInSeconds[channel]);
+  }
+  encodeEnd();
+  encodeKey("fadeOut");
+  encodeArray(channelCount);
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    encodeUint(activeSchedules.fadeOutSeconds[channel]);
+  }
+  encodeEnd();
+  encodeKey("day");
+  encodeSchedule(activeSchedules.day, false);
+  encodeKey("night");
+  encodeSchedule(activeSchedules.night, false);
+  encodeKey("weekendDay");
+  encodeSchedule(activeSchedules.weekendDay, false);
+  encodeKey("weekendNight");
+  encodeSchedule(activeSchedules.weekendNight, false);
+  // Only the enabled slots, sunday first.
+  encodeKey("week");
+  encodeArray(daysPerWeek);
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    uint8_t enabled = 0;
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      enabled += scheduleIsEnabled(activeSchedules.week.slots[weekday][slot]);
+    }
+    encodeArray(enabled);
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      if (scheduleIsEnabled(activeSchedules.week.slots[weekday][slot]))
       {
-#ifdef DEBUG_LAMPOMATIC
-        Serial.println(server.arg("weekendDayStart"));
-#endif
-        weekendDay.startHour = server.arg("weekendDayStart").substring(0, 2).toInt();
-        weekendDay.startMinute = server.arg("weekendDayStart").substring(3).toInt();
-        weekendDay.endHour = server.arg("weekendDayEnd").substring(0, 2).toInt();
-        weekendDay.endMinute = server.arg("weekendDayEnd").substring(3).toInt();
+        encodeSchedule(activeSchedules.week.slots[weekday][slot], true);
+      }
+    }
+    encodeEnd();
+  }
+  encodeEnd();
+  encodeEnd();
+}
 
-        weekendNight.startHour = server.arg("weekendNightStart").substring(0, 2).toInt();
-        weekendNight.startMinute = server.arg("weekendNightStart").substring(3).toInt();
-        weekendNight.endHour = server.arg("weekendNightEnd").substring(0, 2).toInt();
-        weekendNight.endMinute = server.arg("weekendNightEnd").substring(3).toInt();
+// {"start":"HH:MM","end":"HH:MM"}, plus "channel" for weekly slots. null disables the schedule where allowed.
+bool readSchedule(JsonReader &reader, Schedule &schedule, bool nullable, bool withChannel)
+{
+  if (jsonReadNull(reader))
+  {
+    schedule = disabledSchedule();
+    return nullable;
+  }
+  char key[16];
+  char value[endpointTextLength];
+  Schedule parsed = makeSchedule(0, 0);
+  bool hasStart = false;
+  bool hasEnd = false;
+  bool night = false;
+  jsonBeginObject(reader);
+  while (jsonNextKey(reader, key, sizeof(key)))
+  {
+    if (strcmp(key, "start") == 0)
+    {
+      hasStart = jsonReadString(reader, value, sizeof(value)) && parseScheduleEndpoint(value, parsed, true);
+    }
+    else if (strcmp(key, "end") == 0)
+    {
+      hasEnd = jsonReadString(reader, value, sizeof(value)) && parseScheduleEndpoint(value, parsed, false);
+    }
+    else if (withChannel && strcmp(key, "channel") == 0)
+    {
+      if (!jsonReadString(reader, value, sizeof(value)) || (strcmp(value, "day") != 0 && strcmp(value, "night") != 0))
+      {
+        return false;
       }
+      night = strcmp(value, "night") == 0;
+    }
+    else
+    {
+      jsonSkip(reader);
+    }
+  }
+  if (!hasStart || !hasEnd || reader.failed)
+  {
+    return false;
+  }
+  schedule = parsed;
+  if (night)
+  {
+    schedule.flags |= scheduleNight;
+  }
+  return true;
+}
 
-      setSchedule(day, night, dst, weekendDay, weekendNight);
+bool readUintArray(JsonReader &reader, uint16_t values[], uint8_t count, uint16_t max)
+{
+  uint8_t index = 0;
+  jsonBeginArray(reader);
+  while (jsonNextElement(reader))
+  {
+    uint32_t value;
+    if (index >= count || !jsonReadUint(reader, value) || value > max)
+    {
+      return false;
+    }
+    values[index++] = value;
+  }
+  return index == count && !reader.failed;
+}
 
-      currentStatePersisted = saveSettings(eepromAdress, activeSchedules);
-      handleGetTime();
-      return;
+bool readWeek(JsonReader &reader, WeekSchedule &week)
+{
+  uint8_t weekday = 0;
+  jsonBeginArray(reader);
+  while (jsonNextElement(reader))
+  {
+    if (weekday >= daysPerWeek)
+    {
+      return false;
     }
-    else
+    uint8_t slot = 0;
+    jsonBeginArray(reader);
+    while (jsonNextElement(reader))
     {
-      server.send(400, "text/plain; charset=utf-8", "400: Invalid Request"); // The request is invalid, so send HTTP status 400
-      return;
+      if (slot >= slotsPerDay || !readSchedule(reader, week.slots[weekday][slot], false, true))
+      {
+        return false;
+      }
+      slot++;
     }
+    for (; slot < slotsPerDay; slot++)
+    {
+      week.slots[weekday][slot] = disabledSchedule();
+    }
+    weekday++;
   }
-  else
-  { // Password don't match
-    server.send(401, "text/plain", "401: Unauthorized");
-    return;
+  return weekday == daysPerWeek && !reader.failed;
+}
+
+// Same document as GET, fields that are left out keep their current value.
+bool readScheduleDocument(const String &body, PersistedConfig &config)
+{
+  JsonReader reader;
+  char key[16];
+  jsonBegin(reader, body.c_str(), body.length());
+  jsonBeginObject(reader);
+  while (jsonNextKey(reader, key, sizeof(key)))
+  {
+    bool ok = true;
+    bool flag;
+    uint32_t value;
+    if (strcmp(key, "weekly") == 0 || strcmp(key, "dst") == 0)
+    {
+      ok = jsonReadBool(reader, flag);
+      (strcmp(key, "weekly") == 0 ? config.weeklyActive : config.dstActive) = flag;
+    }
+    else if (strcmp(key, "dayIntensity") == 0 || strcmp(key, "nightIntensity") == 0)
+    {
+      ok = jsonReadUint(reader, value) && value <= 100;
+      (strcmp(key, "dayIntensity") == 0 ? config.dayIntensity : config.nightIntensity) = value;
+    }
+    else if (strcmp(key, "fadeIn") == 0)
+    {
+      ok = readUintArray(reader, config.fadeInSeconds, channelCount, maxFadeSeconds);
+    }
+    else if (strcmp(key, "fadeOut") == 0)
+    {
+      ok = readUintArray(reader, config.fadeOutSeconds, channelCount, maxFadeSeconds);
+    }
+    else if (strcmp(key, "day") == 0 || strcmp(key, "night") == 0)
+    {
+      ok = readSchedule(reader, strcmp(key, "day") == 0 ? config.day : config.night, false, false);
+    }
+    else if (strcmp(key, "weekendDay") == 0 || strcmp(key, "weekendNight") == 0)
+    {
+      ok = readSchedule(reader, strcmp(key, "weekendDay") == 0 ? config.weekendDay : config.weekendNight, true, false);
+    }
+    else if (strcmp(key, "week") == 0)
+    {
+      ok = readWeek(reader, config.week);
+    }
+    else
+    {
+      jsonSkip(reader);
+    }
+    if (!ok)
+    {
+      return false;
+    }
   }
+  return jsonFinished(reader);
 }
 
-bool serverHasRequiredArgs()
+// The password comes in a header, in the query string it would end up in proxy logs and browser history.
+void handleApiPutSchedule()
 {
-  return server.hasArg("nightStart") && server.hasArg("nightEnd") && server.hasArg("dayStart") && server.hasArg("dayEnd") && server.hasArg("nightIntensity") && server.hasArg("dayIntensity") && server.arg("nightStart") != NULL && server.arg("nightEnd") != NULL && server.arg("dayStart") != NULL && server.arg("dayEnd") != NULL && server.arg("nightIntensity") != NULL && server.arg("dayIntensity") != NULL;
+  if (server.header("X-Gatekeeper") != superSecretPassword)
+  {
+    server.send(401, "text/plain", "401: Unauthorized");
+    return;
+  }
+  PersistedConfig config = packConfig(activeSchedules);
+  if (!server.hasArg("plain") || !readScheduleDocument(server.arg("plain"), config))
+  {
+    server.send(400, "text/plain; charset=utf-8", "400: Invalid schedule document");
+    return;
+  }
+  if (applyConfig(config, eventSourceApi))
+  {
+    shareConfig();
+  }
+  handleApiGetSchedule();
 }
 
-bool serverHasOptionalArgs()
+#ifndef LAMPOMATIC_ASYNC_SERVER
+// Server-Sent Events, the connection is kept by the events module once this returns.
+void handleEvents()
 {
-  return server.hasArg("weekendDayStart") && server.hasArg("weekendDayEnd") && server.hasArg("weekendNightStart") && server.hasArg("weekendNightEnd") && server.arg("weekendDayStart") != NULL && server.arg("weekendDayEnd") != NULL && server.arg("weekendNightStart") != NULL && server.arg("weekendNightEnd") != NULL;
+  if (!eventsAddClient(server.client()))
+  {
+    server.send(503, "text/plain", "503: Too many event clients");
+  }
 }
+#endif
 
-void handleNotFound()
+void publishState()
 {
-  server.send(404, "text/plain; charset=utf-8", "404: Not found"); // Send HTTP status 404 (Not Found) when there's no handler for the URI in the request
+  char data[112];
+  snprintf(data, sizeof(data), "{\"day\":%s,\"night\":%s,\"dayIntensity\":%d,\"nightIntensity\":%d,\"generation\":%u}",
+           activeSchedules.currentState.dayActive ? "true" : "false", activeSchedules.currentState.nightActive ? "true" : "false",
+           activeSchedules.dayIntensity, activeSchedules.nightIntensity, scheduleGeneration);
+  eventsPublish("state", data);
 }
+// API
 
 #ifdef DEBUG_LAMPOMATIC
 void getDebug()
@@ -343,29 +1240,27 @@ void handleDebugPost()
   if (server.hasArg("dayPin") && server.arg("dayPin") != NULL)
   {
     dayPinPWM = server.arg("dayPin").toInt();
-    if (dayPinPWM > 0 && dayPinPWM < 1024)
+    if (dayPinPWM < 0 || dayPinPWM > DayChannel::maxDuty)
     {
-      analogWrite(dayPin, dayPinPWM);
-    }
-    else
-    {
-      digitalWrite(dayPin, LOW);
+      dayPinPWM = 0;
     }
+    DayChannel::write(dayPinPWM);
   }
 
   if (server.hasArg("nightPin") && server.arg("nightPin") != NULL)
   {
     nightPinPWM = server.arg("nightPin").toInt();
-    if (nightPinPWM > 0 && nightPinPWM < 1024)
-    {
-      analogWrite(nightPin, nightPinPWM);
-    }
-    else
+    if (nightPinPWM < 0 || nightPinPWM > NightChannel::maxDuty)
     {
-      digitalWrite(nightPin, LOW);
+      nightPinPWM = 0;
     }
+    NightChannel::write(nightPinPWM);
   }
 
+  Outputs::flush();
+  // The outputs were written behind the fade engine's back.
+  fadeInvalidate();
+
   server.send(200, "text/html", "<form action=\"/debug\" method=\"POST\"><label for=\"dayPin\">DAY PIN PWN OUT (0-1023):</label><input type=\"number\" id=\"dayPin\" name=\"dayPin\" min=\"0\" max=\"1023\" value=\"" + String(dayPinPWM) + "\"><label for=\"nightPin\">NIGHT PIN PWN OUT (0-1023):</label><input type=\"number\" id=\"nightPin\" name=\"nightPin\" min=\"0\" max=\"1023\" value=\"" + String(nightPinPWM) + "\"><input type=\"submit\" formmethod=\"post\" value=\"Submit\"></form>");
 }
 #endif
@@ -376,166 +1271,285 @@ void setSchedule(Schedule day, Schedule night, bool dst, Schedule weekendDay, Sc
 {
 #ifdef DEBUG_LAMPOMATIC
   Serial.println("---- In setSchedule ------ ");
-  Serial.print("Day: ");
-  Serial.print(day.startHour);
-  Serial.print(":");
-  Serial.print(day.startMinute);
-  Serial.print(" - ");
-  Serial.print(day.endHour);
-  Serial.print(":");
-  Serial.println(day.endMinute);
-  Serial.print("Night: ");
-  Serial.print(night.startHour);
-  Serial.print(":");
-  Serial.print(night.startMinute);
-  Serial.print(" - ");
-  Serial.print(night.endHour);
-  Serial.print(":");
-  Serial.println(night.endMinute);
-  Serial.print("Weekend day: ");
-  Serial.print(weekendDay.startHour);
-  Serial.print(":");
-  Serial.print(weekendDay.startMinute);
-  Serial.print(" - ");
-  Serial.print(weekendDay.endHour);
-  Serial.print(":");
-  Serial.println(weekendDay.endMinute);
-  Serial.print("Weekend night: ");
-  Serial.print(weekendNight.startHour);
-  Serial.print(":");
-  Serial.print(weekendNight.startMinute);
-  Serial.print(" - ");
-  Serial.print(weekendNight.endHour);
-  Serial.print(":");
-  Serial.println(weekendNight.endMinute);
+  printSchedule("Day: ", day);
+  printSchedule("Night: ", night);
+  printSchedule("Weekend day: ", weekendDay);
+  printSchedule("Weekend night: ", weekendNight);
 #endif
-  if (activeSchedules.initialized == true)
+  activeSchedules.weeklyActive = false;
+  activeSchedules.day = day;
+  activeSchedules.night = night;
+  activeSchedules.weekendDay = weekendDay;
+  activeSchedules.weekendNight = weekendNight;
+  applySchedule(dst);
+  #ifdef DEBUG_LAMPOMATIC
+  Serial.println("----- Exiting setSchedule -------");
+  #endif
+}
+
+void setWeekSchedule(const WeekSchedule &week, bool dst)
+{
+#ifdef DEBUG_LAMPOMATIC
+  Serial.println("---- In setWeekSchedule ------ ");
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
   {
-    clearOldTimers(activeSchedules.day.timerIds, 2);
-    clearOldTimers(activeSchedules.night.timerIds, 2);
-    if (activeSchedules.weekendDay.startHour != -1)
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
     {
-      clearOldTimers(activeSchedules.weekendDay.timerIds, 6);
-      clearOldTimers(activeSchedules.weekendNight.timerIds, 5);
+      Serial.print(daysOfTheWeek[weekday]);
+      printSchedule(": ", week.slots[weekday][slot]);
     }
   }
+#endif
+  activeSchedules.weeklyActive = true;
+  activeSchedules.week = week;
+  applySchedule(dst);
+}
 
+// Local time from the drift compensated NTP clock, 0 until the first answer. Also used as the TimeLib sync provider.
+time_t localNow()
+{
+  time_t utc = ntpNow();
+  if (utc == 0)
+  {
+    return 0;
+  }
+  return tzLocal(utc) + dstOffsetInSeconds;
+}
+
+// The UTC time a local time of the clock falls on. Looking the offset up twice gets it right everywhere but in the
+// hour a clock change skips or repeats.
+time_t utcFromLocal(time_t local)
+{
+  time_t utc = local - (tzOffsetAt(local) + dstOffsetInSeconds);
+  return local - (tzOffsetAt(utc) + dstOffsetInSeconds);
+}
+
+// The DST checkbox only adds an hour when the time zone has no rules of its own.
+long manualDstOffset(bool dst)
+{
+  return dst && !tzHasDst() ? 3600 : 0;
+}
+
+// Compile whichever schedule is active into the transition table. The state is only evaluated again on the next
+// loop when the table or the clock offset actually changed.
+void applySchedule(bool dst)
+{
   activeSchedules.dstActive = dst;
   activeSchedules.persistedInEEPROM = false;
-  activeSchedules.day = day;
-  activeSchedules.night = night;
-  activeSchedules.weekendDay = weekendDay;
-  activeSchedules.weekendNight = weekendNight;
 
-  dstOffsetInSeconds = dst == true ? 3600 : 0;
-  timeClient.setTimeOffset(utcOffsetInSeconds + dstOffsetInSeconds);
-  timeClient.update();
+  long dstOffset = manualDstOffset(dst);
+  bool changed = !activeSchedules.initialized || dstOffset != dstOffsetInSeconds;
+  if (changed)
+  {
+    dstOffsetInSeconds = dstOffset;
+    if (ntpNow() != 0)
+    {
+      setTime(localNow());
+      updateSun(); // Local sunrise and sunset moved with the clock.
+    }
+  }
 
-  setAlarms(weekendDay.startHour != -1);
+  changed |= compileSchedule();
+  if (changed)
+  {
+    nextTransitionTime = 0;
+  }
+  scheduleGeneration++;
+  stateGeneration++;
+  char data[24];
+  snprintf(data, sizeof(data), "{\"generation\":%u}", scheduleGeneration);
+  eventsPublish("schedule", data);
 
   activeSchedules.initialized = true;
-  #ifdef DEBUG_LAMPOMATIC
-  Serial.println("----- Exiting setSchedule -------");
-  #endif
 }
 
-void setAlarms(bool weekendActive)
-{
-  if (weekendActive)
-  {
-    // Days
-    // Friday
-    activeSchedules.weekendDay.timerIds[0] = Alarm.alarmRepeat(dowFriday, activeSchedules.day.startHour, activeSchedules.day.startMinute, 0, startDay);
-    activeSchedules.weekendDay.timerIds[1] = Alarm.alarmRepeat(dowFriday, activeSchedules.weekendDay.endHour, activeSchedules.weekendDay.endMinute, 0, endDay);
-    // Saturday
-    activeSchedules.weekendDay.timerIds[2] = Alarm.alarmRepeat(dowSaturday, activeSchedules.weekendDay.startHour, activeSchedules.weekendDay.startMinute, 0, startDay);
-    activeSchedules.weekendDay.timerIds[3] = Alarm.alarmRepeat(dowSaturday, activeSchedules.weekendDay.endHour, activeSchedules.weekendDay.endMinute, 0, endDay);
-    // Sunday
-    activeSchedules.weekendDay.timerIds[4] = Alarm.alarmRepeat(dowSunday, activeSchedules.weekendDay.startHour, activeSchedules.weekendDay.startMinute, 0, startDay);
-    activeSchedules.weekendDay.timerIds[5] = Alarm.alarmRepeat(dowSunday, activeSchedules.day.endHour, activeSchedules.day.endMinute, 0, endDay);
-
-    // Nights
-    // Friday (start Fri, end Sat)
-    activeSchedules.weekendNight.timerIds[0] = Alarm.alarmRepeat(dowFriday, activeSchedules.weekendNight.startHour, activeSchedules.weekendNight.startMinute, 0, startNight);
-    activeSchedules.weekendNight.timerIds[1] = Alarm.alarmRepeat(dowSaturday, activeSchedules.weekendNight.endHour, activeSchedules.weekendNight.endMinute, 0, endNight);
-    // Saturday (start Sat, end Sun)
-    activeSchedules.weekendNight.timerIds[2] = Alarm.alarmRepeat(dowSaturday, activeSchedules.weekendNight.startHour, activeSchedules.weekendNight.startMinute, 0, startNight);
-    activeSchedules.weekendNight.timerIds[3] = Alarm.alarmRepeat(dowSunday, activeSchedules.weekendNight.endHour, activeSchedules.weekendNight.endMinute, 0, endNight);
-    // Sunday (start sat, ends with regular schedule that gets activated sun-mon midnight rollover)
-    activeSchedules.weekendNight.timerIds[4] = Alarm.alarmRepeat(dowSunday, activeSchedules.night.startHour, activeSchedules.night.startMinute, 0, startNight);
-  }
-  // Regular programming
-  activeSchedules.day.timerIds[0] = Alarm.alarmRepeat(activeSchedules.day.startHour, activeSchedules.day.startMinute, 0, startDay);
-  activeSchedules.day.timerIds[1] = Alarm.alarmRepeat(activeSchedules.day.endHour, activeSchedules.day.endMinute, 0, endDay);
-  activeSchedules.night.timerIds[0] = Alarm.alarmRepeat(activeSchedules.night.startHour, activeSchedules.night.startMinute, 0, startNight);
-  activeSchedules.night.timerIds[1] = Alarm.alarmRepeat(activeSchedules.night.endHour, activeSchedules.night.endMinute, 0, endNight);
-#ifdef DEBUG_LAMPOMATIC
-  Serial.println("---- In setAlarms ---- ");
-  Serial.println("Day TimerIds");
-  for (size_t i = 0; i < 2; i++)
+bool compileSchedule()
+{
+  if (activeSchedules.weeklyActive)
   {
-    Serial.println(activeSchedules.day.timerIds[i]);
+    return schedulerCompileWeek(activeSchedules.week);
   }
-  Serial.println("Night TimerIds");
-  for (size_t i = 0; i < 2; i++)
+  return schedulerCompile(activeSchedules.day, activeSchedules.night, activeSchedules.weekendDay, activeSchedules.weekendNight);
+}
+
+// Sunrise and sunset for today and the six days after, each under its local weekday, so the table always covers the
+// week ahead. Once a local day is enough, they move a few minutes a day at most.
+void updateSun()
+{
+  int32_t today = now() / SECS_PER_DAY;
+  SunDay days[daysPerWeek];
+  for (uint8_t i = 0; i < daysPerWeek; i++)
   {
-    Serial.println(activeSchedules.night.timerIds[i]);
+    // 1970-01-01 was a thursday.
+    days[(today + i + 4) % daysPerWeek] = localSunDay(today + i);
   }
-  Serial.println("Weekend day TimerIds");
-  for (size_t i = 0; i < 6; i++)
+  schedulerSetSun(days);
+  sunDay = today;
+}
+
+// Sunrise and sunset of a local day, from its local midnight. They're the ones around the solar noon that falls on
+// that day, which zones far from their meridian have on the UTC day before or after, and they're carried past
+// midnight instead of clamped, so a sunset at 00:20 stays that evening's.
+SunDay localSunDay(int32_t localDay)
+{
+  static const int8_t utcDayShifts[] = {0, -1, 1};
+  int32_t utcDay = localDay;
+  int16_t sunrise = 0;
+  int16_t sunset = 0;
+  for (int8_t shift : utcDayShifts)
   {
-    Serial.println(activeSchedules.weekendDay.timerIds[i]);
+    utcDay = localDay + shift;
+    sunTimes(utcDay, latitude, longitude, sunrise, sunset);
+    time_t noon = (time_t)utcDay * SECS_PER_DAY + (sunrise + sunset) * 30L;
+    if ((int32_t)((noon + tzOffsetAt(noon) + dstOffsetInSeconds) / SECS_PER_DAY) == localDay)
+    {
+      break;
+    }
   }
-  Serial.println("Weekend night TimerIds");
-  for (size_t i = 0; i < 5; i++)
+  return {localSunMinute(utcDay, localDay, sunrise), localSunMinute(utcDay, localDay, sunset)};
+}
+
+// Minutes from midnight UTC of utcDay to minutes from local midnight of localDay, at the offset in effect at the time.
+int16_t localSunMinute(int32_t utcDay, int32_t localDay, int16_t minute)
+{
+  time_t utc = (time_t)utcDay * SECS_PER_DAY + minute * 60L;
+  return (int16_t)((utc + tzOffsetAt(utc) + dstOffsetInSeconds - (time_t)localDay * SECS_PER_DAY) / 60);
+}
+
+// Make a posted config the running one. Posting the running config again recompiles nothing, and it's only
+// written when it differs from the config in flash, so that costs a compare and a CRC. True when it changed.
+bool applyConfig(const PersistedConfig &config, uint8_t source)
+{
+  PersistedConfig current = packConfig(activeSchedules);
+  bool changed = !activeSchedules.initialized || memcmp(&current, &config, sizeof(config)) != 0;
+  if (changed)
   {
-    Serial.println(activeSchedules.weekendNight.timerIds[i]);
+    eventLog(eventSchedule, source, crc32(&config, sizeof(config)));
+    unpackConfig(config, activeSchedules);
+    applySchedule(config.dstActive);
+    setOutputState(true); // Picks up a changed intensity, the schedule is evaluated on the next loop.
   }
-  Serial.println("---- Exiting setAlarms ---- ");
-#endif
+  currentStatePersisted = saveSettings(activeSchedules);
+  return changed;
+}
+
+// Send a schedule changed here to the rest of the fleet. Its generation is kept so an older one is never taken back.
+void shareConfig()
+{
+  if (!fleetEnabled())
+  {
+    return;
+  }
+  uint32_t generation = fleetShare(packConfig(activeSchedules), ntpNow());
+  journalAppend(recordFleet, &generation, sizeof(generation));
 }
 
-void clearOldTimers(int timerIds[], int size)
+// A newer schedule from the fleet, applied like a posted one.
+void applyFleetConfig(const PersistedConfig &config, uint32_t generation)
 {
 #ifdef DEBUG_LAMPOMATIC
-  Serial.println("Clearing old timers");
+  Serial.print("Fleet schedule, generation ");
+  Serial.println(generation);
+#endif
+  applyConfig(config, eventSourceFleet);
+  journalAppend(recordFleet, &generation, sizeof(generation));
+}
+
+// Bring the outputs to the state the schedule says they should be in right now, and note when that next changes.
+void serviceSchedule()
+{
+  time_t t = now();
+  uint16_t minute = minuteOfWeek(t);
+  OutputState scheduled = schedulerStateAt(minute);
+  OutputState &current = activeSchedules.currentState;
+  bool changed = scheduled.dayActive != current.dayActive || scheduled.nightActive != current.nightActive;
 
-  for (int i = 0; i < size; i++)
+  if (scheduled.dayActive != current.dayActive)
   {
-    Serial.print("ID: ");
-    int timerID = timerIds[i];
-    Serial.println(timerID);
+    scheduled.dayActive ? startDay() : endDay();
   }
-#endif
-  for (int i = 0; i < size; i++)
+  if (scheduled.nightActive != current.nightActive)
+  {
+    scheduled.nightActive ? startNight() : endNight();
+  }
+  if (changed)
   {
-    Alarm.free(timerIds[i]);
+    eventLog(eventTransition, (scheduled.dayActive ? runtimeDayActive : 0) | (scheduled.nightActive ? runtimeNightActive : 0), minute);
+    cacheOutputState();
+    setOutputState(true);
+    stateGeneration++;
+    publishState();
   }
+
+  uint16_t minutesToNext = schedulerMinutesToNextTransition(minute);
+  nextTransitionTime = t - second(t) + (minutesToNext == 0 ? minutesPerWeek : minutesToNext) * SECS_PER_MIN;
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("Next transition in (min): ");
+  Serial.println(minutesToNext);
+#endif
 }
 
 // EEPROM stuff
-void readSavedSettings(int eepromAdress)
+void readSavedSettings()
 {
 #ifdef DEBUG_LAMPOMATIC
-  Serial.print("Reading from eeprom, adress: ");
-  Serial.println(eepromAdress);
+  Serial.println("Reading from journal");
 #endif
-  StateContainer savedSchedule;
-  savedSchedule = EEPROM.get(eepromAdress, savedSchedule);
+  StateContainer savedSchedule = activeSchedules;
+  savedSchedule.persistedInEEPROM = false;
+  PersistedConfig config;
+  uint8_t runtime = 0;
+  uint8_t buffer[journalMaxPayload];
+  bool legacy = false;
+  if (journalBegin())
+  {
+    int16_t length = journalReadLatest(recordConfig, buffer, sizeof(buffer));
+    if (length > 0 && decodeConfig(buffer, length, config))
+    {
+      savedSchedule.persistedInEEPROM = true;
+      // Known to be in flash, a save of the same config writes nothing.
+      savedConfigCrc = crc32(&config, sizeof(config));
+      savedConfigKnown = true;
+      // A transition since the last flush is only in RTC memory, which is newer than the journal when it's there.
+      bool flushed = true;
+      if (!rtcRuntimeRestore(runtime, savedConfigCrc, flushed))
+      {
+        journalReadLatest(recordRuntime, &runtime, sizeof(runtime));
+      }
+      runtimeFlushed = flushed;
+    }
+  }
+  else if (journalReadRaw(0, buffer, legacyConfigLength()))
+  {
+    // No journal yet, pick up settings stored with EEPROM.put at adress 0 by older firmware.
+    savedSchedule.persistedInEEPROM = decodeLegacyConfig(buffer, legacyConfigLength(), config, runtime);
+    legacy = savedSchedule.persistedInEEPROM;
+  }
+  if (savedSchedule.persistedInEEPROM == true)
+  {
+    unpackConfig(config, savedSchedule);
+    savedSchedule.currentState.dayActive = runtime & runtimeDayActive;
+    savedSchedule.currentState.nightActive = runtime & runtimeNightActive;
+  }
   if (savedSchedule.persistedInEEPROM == true)
   {
     savedSchedule.initialized = false;
-    dstOffsetInSeconds = savedSchedule.dstActive == true ? 3600 : 0;
+    dstOffsetInSeconds = manualDstOffset(savedSchedule.dstActive);
     activeSchedules = savedSchedule;
   }
+  if (legacy)
+  {
+    // The first append formats the sector and erases the old settings with it, so they go into the journal right away.
+    currentStatePersisted = saveSettings(activeSchedules) && saveOutputState();
+  }
 #ifdef DEBUG_LAMPOMATIC
   if (savedSchedule.persistedInEEPROM == true)
   {
     Serial.println("Read successful.");
-    Serial.println("Read data, day: " + getFormattedHourMinuteConcatenation(dayStart) + "-" + getFormattedHourMinuteConcatenation(dayEnd));
-    Serial.println("Read data, night: " + getFormattedHourMinuteConcatenation(nightStart) + "-" + getFormattedHourMinuteConcatenation(nightEnd));
-    Serial.println("Read data, weekendDay: " + getFormattedHourMinuteConcatenation(weekendDayStart) + "-" + getFormattedHourMinuteConcatenation(weekendDayEnd));
-    Serial.println("Read data, weekendNight: " + getFormattedHourMinuteConcatenation(weekendNightStart) + "-" + getFormattedHourMinuteConcatenation(weekendNightEnd));
+    printSchedule("Read data, day: ", savedSchedule.day);
+    printSchedule("Read data, night: ", savedSchedule.night);
+    printSchedule("Read data, weekendDay: ", savedSchedule.weekendDay);
+    printSchedule("Read data, weekendNight: ", savedSchedule.weekendNight);
     Serial.print("DST: ");
     Serial.println(savedSchedule.dstActive);
     Serial.print("Day brightness: ");
@@ -550,50 +1564,29 @@ void readSavedSettings(int eepromAdress)
 #endif
 }
 
-bool saveSettings(int eepromAdress, StateContainer currentState)
+bool saveSettings(const StateContainer &toSave)
 {
-  StateContainer toSave = currentState;
 #ifdef DEBUG_LAMPOMATIC
   Serial.println("----- In saveSettings ------");
-  Serial.println("Starting save to eeprom adress: ");
-  Serial.print(eepromAdress);
   Serial.println("Schedules to save: ");
-  Serial.print("Day: ");
-  Serial.print(toSave.day.startHour);
-  Serial.print(":");
-  Serial.print(toSave.day.startMinute);
-  Serial.print(" - ");
-  Serial.print(toSave.day.endHour);
-  Serial.print(":");
-  Serial.println(toSave.day.endMinute);
-  Serial.print("Night: ");
-  Serial.print(toSave.night.startHour);
-  Serial.print(":");
-  Serial.print(toSave.night.startMinute);
-  Serial.print(" - ");
-  Serial.print(toSave.night.endHour);
-  Serial.print(":");
-  Serial.println(toSave.night.endMinute);
-  Serial.print("Weekend day: ");
-  Serial.print(toSave.weekendDay.startHour);
-  Serial.print(":");
-  Serial.print(toSave.weekendDay.startMinute);
-  Serial.print(" - ");
-  Serial.print(toSave.weekendDay.endHour);
-  Serial.print(":");
-  Serial.println(toSave.weekendDay.endMinute);
-  Serial.print("Weekend night: ");
-  Serial.print(toSave.weekendNight.startHour);
-  Serial.print(":");
-  Serial.print(toSave.weekendNight.startMinute);
-  Serial.print(" - ");
-  Serial.print(toSave.weekendNight.endHour);
-  Serial.print(":");
-  Serial.println(toSave.weekendNight.endMinute);
+  printSchedule("Day: ", toSave.day);
+  printSchedule("Night: ", toSave.night);
+  printSchedule("Weekend day: ", toSave.weekendDay);
+  printSchedule("Weekend night: ", toSave.weekendNight);
 #endif
-  toSave.persistedInEEPROM = true;
-  EEPROM.put(eepromAdress, toSave);
-  bool saveOk = EEPROM.commit();
+  PersistedConfig config = packConfig(toSave);
+  uint32_t crc = crc32(&config, sizeof(config));
+  bool saveOk = savedConfigKnown && crc == savedConfigCrc;
+  if (!saveOk)
+  {
+    uint8_t buffer[configMaxEncodedLength];
+    uint16_t length = encodeConfig(config, buffer, sizeof(buffer));
+    saveOk = length > 0 && journalAppend(recordConfig, buffer, length);
+    savedConfigKnown = saveOk;
+    savedConfigCrc = crc;
+    // The cached runtime belongs to the config it was saved with.
+    rtcRuntimeSave(outputRuntime(), savedConfigCrc, runtimeFlushed);
+  }
   activeSchedules.persistedInEEPROM = saveOk;
 #ifdef DEBUG_LAMPOMATIC
   Serial.print("Save status: ");
@@ -604,53 +1597,105 @@ bool saveSettings(int eepromAdress, StateContainer currentState)
   return saveOk;
 }
 
-void setWeekendTimerState()
+uint8_t outputRuntime()
 {
-  // Weekend baby.
-  if (weekday() == static_cast<int>(dowFriday) || weekday() == static_cast<int>(dowSaturday) || weekday() == static_cast<int>(dowSunday))
-  {
-    Alarm.disable(activeSchedules.day.timerIds[0]);
-    Alarm.disable(activeSchedules.day.timerIds[1]);
+  return (activeSchedules.currentState.dayActive ? runtimeDayActive : 0) | (activeSchedules.currentState.nightActive ? runtimeNightActive : 0);
+}
 
-    Alarm.disable(activeSchedules.night.timerIds[0]);
-    Alarm.disable(activeSchedules.night.timerIds[1]);
-  }
-  else // Not weekend. :-(
-  {
-    Alarm.enable(activeSchedules.night.timerIds[0]);
-    Alarm.enable(activeSchedules.night.timerIds[1]);
+// A transition only goes to RTC memory, loop() flushes it to the journal later.
+void cacheOutputState()
+{
+  rtcRuntimeSave(outputRuntime(), savedConfigCrc, false);
+  runtimeFlushed = false;
+}
 
-    Alarm.enable(activeSchedules.day.timerIds[0]);
-    Alarm.enable(activeSchedules.day.timerIds[1]);
+void flushOutputState()
+{
+  if (!runtimeFlushed)
+  {
+    saveOutputState();
   }
 }
 
+// Last chance before an update restarts the lamp.
+void updateStarting()
+{
+  eventLog(eventUpdate, 0, 0);
+  flushOutputState();
+  eventLogFlush();
+}
+
+// Only appends the runtime byte, the config record is untouched. A failed write is retried after the interval, not every loop.
+bool saveOutputState()
+{
+  uint8_t runtime = outputRuntime();
+  currentStatePersisted = journalAppend(recordRuntime, &runtime, sizeof(runtime));
+  runtimeFlushed = currentStatePersisted;
+  runtimeFlushedMillis = millis();
+  rtcRuntimeSave(runtime, savedConfigCrc, runtimeFlushed);
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("Output state save status: ");
+  Serial.println(currentStatePersisted == true ? "OK" : "FAILED");
+#endif
+  return currentStatePersisted;
+}
+
+PersistedConfig packConfig(const StateContainer &state)
+{
+  PersistedConfig config;
+  memset(&config, 0, sizeof(config)); // Compared and CRC'd whole, so no stray padding.
+  config.dstActive = state.dstActive;
+  config.dayIntensity = state.dayIntensity;
+  config.nightIntensity = state.nightIntensity;
+  config.day = state.day;
+  config.night = state.night;
+  config.weekendDay = state.weekendDay;
+  config.weekendNight = state.weekendNight;
+  config.weeklyActive = state.weeklyActive;
+  config.week = state.week;
+  memcpy(config.fadeInSeconds, state.fadeInSeconds, sizeof(config.fadeInSeconds));
+  memcpy(config.fadeOutSeconds, state.fadeOutSeconds, sizeof(config.fadeOutSeconds));
+  return config;
+}
+
+void unpackConfig(const PersistedConfig &config, StateContainer &state)
+{
+  state.dstActive = config.dstActive;
+  state.dayIntensity = config.dayIntensity;
+  state.nightIntensity = config.nightIntensity;
+  state.day = config.day;
+  state.night = config.night;
+  state.weekendDay = config.weekendDay;
+  state.weekendNight = config.weekendNight;
+  state.weeklyActive = config.weeklyActive;
+  state.week = config.week;
+  memcpy(state.fadeInSeconds, config.fadeInSeconds, sizeof(state.fadeInSeconds));
+  memcpy(state.fadeOutSeconds, config.fadeOutSeconds, sizeof(state.fadeOutSeconds));
+}
+
 // Blinkenlights
 void startDay()
 {
   activeSchedules.currentState.dayActive = true;
-  saveSettings(0, activeSchedules);
 }
 
 void endDay()
 {
   activeSchedules.currentState.dayActive = false;
-  saveSettings(0, activeSchedules);
 }
 
 void startNight()
 {
   activeSchedules.currentState.nightActive = true;
-  saveSettings(0, activeSchedules);
 }
 
 void endNight()
 {
   activeSchedules.currentState.nightActive = false;
-  saveSettings(0, activeSchedules);
 }
 
-void setOutputState()
+// Fade the outputs to the current state, or set them straight away.
+void setOutputState(bool fade)
 {
 #ifdef DEBUG_LAMPOMATIC
   Serial.print("currentState.dayActive: ");
@@ -662,115 +1707,78 @@ void setOutputState()
   Serial.print("nightIntensity: ");
   Serial.println(activeSchedules.nightIntensity);
 #endif
-  if (activeSchedules.currentState.dayActive)
-  {
-    int pwmOut = map(activeSchedules.dayIntensity, 0, 100, 0, 1023);
-    analogWrite(dayPin, pwmOut);
-  }
-  else
+  const bool active[channelCount] = {activeSchedules.currentState.dayActive, activeSchedules.currentState.nightActive};
+  const int intensity[channelCount] = {activeSchedules.dayIntensity, activeSchedules.nightIntensity};
+  for (uint8_t channel = 0; channel < channelCount; channel++)
   {
-    digitalWrite(dayPin, LOW);
+    fadeChannel(static_cast<channel_t>(channel), active[channel] ? intensity[channel] : 0, fade);
   }
+  fadeFlush();
+}
 
-  if (activeSchedules.currentState.nightActive)
-  {
-    int pwmOut = map(activeSchedules.nightIntensity, 0, 100, 0, 1023);
-    analogWrite(nightPin, pwmOut);
-  }
-  else
+void fadeChannel(channel_t channel, uint8_t percent, bool fade)
+{
+  uint32_t duration = 0;
+  if (fade)
   {
-    digitalWrite(nightPin, LOW);
+    duration = (percent > fadeTarget(channel) ? activeSchedules.fadeInSeconds[channel] : activeSchedules.fadeOutSeconds[channel]) * 1000UL;
   }
+  fadeTo(channel, percent, duration);
 }
 
-String getFormattedHourMinuteConcatenation(scheduleType_t scheduleType)
+// Start and end of each schedule, in scheduleType_t order.
+const char *formatScheduleTime(scheduleType_t scheduleType, char text[endpointTextLength])
 {
-  String hoursStr;
-  String minuteStr;
-  switch (scheduleType)
+  const Schedule *schedules[] = {&activeSchedules.day, &activeSchedules.night, &activeSchedules.weekendDay, &activeSchedules.weekendNight};
+  const Schedule &schedule = *schedules[scheduleType / 2];
+  if (!scheduleIsEnabled(schedule))
   {
-  case dayStart:
-    hoursStr = activeSchedules.day.startHour < 10 ? "0" + String(activeSchedules.day.startHour) : String(activeSchedules.day.startHour);
-    minuteStr = activeSchedules.day.startMinute < 10 ? "0" + String(activeSchedules.day.startMinute) : String(activeSchedules.day.startMinute);
-    break;
-  case dayEnd:
-    hoursStr = activeSchedules.day.endHour < 10 ? "0" + String(activeSchedules.day.endHour) : String(activeSchedules.day.endHour);
-    minuteStr = activeSchedules.day.endMinute < 10 ? "0" + String(activeSchedules.day.endMinute) : String(activeSchedules.day.endMinute);
-    break;
-  case nightStart:
-    hoursStr = activeSchedules.night.startHour < 10 ? "0" + String(activeSchedules.night.startHour) : String(activeSchedules.night.startHour);
-    minuteStr = activeSchedules.night.startMinute < 10 ? "0" + String(activeSchedules.night.startMinute) : String(activeSchedules.night.startMinute);
-    break;
-  case nightEnd:
-    hoursStr = activeSchedules.night.endHour < 10 ? "0" + String(activeSchedules.night.endHour) : String(activeSchedules.night.endHour);
-    minuteStr = activeSchedules.night.endMinute < 10 ? "0" + String(activeSchedules.night.endMinute) : String(activeSchedules.night.endMinute);
-    break;
-  case weekendDayStart:
-    if (activeSchedules.weekendDay.startHour != -1)
-    {
-      hoursStr = activeSchedules.weekendDay.startHour < 10 ? "0" + String(activeSchedules.weekendDay.startHour) : String(activeSchedules.weekendDay.startHour);
-      minuteStr = activeSchedules.weekendDay.startMinute < 10 ? "0" + String(activeSchedules.weekendDay.startMinute) : String(activeSchedules.weekendDay.startMinute);
-    }
-    break;
-  case weekendDayEnd:
-    if (activeSchedules.weekendDay.startHour != -1)
-    {
-      hoursStr = activeSchedules.weekendDay.endHour < 10 ? "0" + String(activeSchedules.weekendDay.endHour) : String(activeSchedules.weekendDay.endHour);
-      minuteStr = activeSchedules.weekendDay.endMinute < 10 ? "0" + String(activeSchedules.weekendDay.endMinute) : String(activeSchedules.weekendDay.endMinute);
-    }
-    break;
-  case weekendNightStart:
-    if (activeSchedules.weekendNight.startHour != -1)
-    {
-      hoursStr = activeSchedules.weekendNight.startHour < 10 ? "0" + String(activeSchedules.weekendNight.startHour) : String(activeSchedules.weekendNight.startHour);
-      minuteStr = activeSchedules.weekendNight.startMinute < 10 ? "0" + String(activeSchedules.weekendNight.startMinute) : String(activeSchedules.weekendNight.startMinute);
-    }
-    break;
-  case weekendNightEnd:
-    if (activeSchedules.weekendNight.startHour != -1)
-    {
-      hoursStr = activeSchedules.weekendNight.endHour < 10 ? "0" + String(activeSchedules.weekendNight.endHour) : String(activeSchedules.weekendNight.endHour);
-      minuteStr = activeSchedules.weekendNight.endMinute < 10 ? "0" + String(activeSchedules.weekendNight.endMinute) : String(activeSchedules.weekendNight.endMinute);
-    }
-    break;
+    return ""; // Weekend schedule that isn't set, an empty input rather than one failing its pattern.
   }
+  return formatScheduleEndpoint(schedule, scheduleType % 2 == 0, text);
+}
 
-  return hoursStr + ":" + minuteStr;
+char *formatTime(time_t t, char text[timeTextLength])
+{
+  return formatTimeOfDay(hour(t), minute(t), second(t), text);
 }
 
 // Print some debug stuff to serial
 #ifdef DEBUG_LAMPOMATIC
+void printSchedule(const char *label, const Schedule &schedule)
+{
+  char text[endpointTextLength];
+  Serial.print(label);
+  if (!scheduleIsEnabled(schedule))
+  {
+    Serial.println("disabled");
+    return;
+  }
+  Serial.print(formatScheduleEndpoint(schedule, true, text));
+  Serial.print(" - ");
+  Serial.println(formatScheduleEndpoint(schedule, false, text));
+}
+
 void printScheduleAndTime()
 {
-  Serial.print("Day schedule: ");
-  Serial.println(getFormattedHourMinuteConcatenation(dayStart));
-  Serial.println(" - ");
-  Serial.println(getFormattedHourMinuteConcatenation(dayEnd));
-  Serial.print("Night schedule: ");
-  Serial.println(getFormattedHourMinuteConcatenation(nightStart));
-  Serial.println(" - ");
-  Serial.println(getFormattedHourMinuteConcatenation(nightEnd));
-
-  Serial.print("Weekend day schedule: ");
-  Serial.println(getFormattedHourMinuteConcatenation(weekendDayStart));
-  Serial.println(" - ");
-  Serial.println(getFormattedHourMinuteConcatenation(weekendDayEnd));
-
-  Serial.print("Weekend night schedule: ");
-  Serial.println(getFormattedHourMinuteConcatenation(weekendNightStart));
-  Serial.println(" - ");
-  Serial.println(getFormattedHourMinuteConcatenation(weekendNightEnd));
+  char text[timeTextLength];
+  printSchedule("Day schedule: ", activeSchedules.day);
+  printSchedule("Night schedule: ", activeSchedules.night);
+  printSchedule("Weekend day schedule: ", activeSchedules.weekendDay);
+  printSchedule("Weekend night schedule: ", activeSchedules.weekendNight);
 
   Serial.print("WeekDay");
   Serial.println(weekday());
-  Serial.print(daysOfTheWeek[timeClient.getDay()]);
+  Serial.print(daysOfTheWeek[weekday() - 1]);
   Serial.print(", ");
-  Serial.println(timeClient.getFormattedTime());
+  Serial.println(formatTime(now(), text));
 
   Serial.print("Time epoch time: ");
   Serial.println(now());
-  Serial.print("NTPClient epoch time: ");
-  Serial.println(timeClient.getEpochTime());
+  Serial.print("NTP epoch time: ");
+  Serial.println(ntpNow());
+  Serial.print("NTP drift (ppm): ");
+  Serial.println(ntpDriftPpm());
 
   Serial.print("DST Offset: ");
   Serial.println(dstOffsetInSeconds);
@@ -0,0 +1,72 @@
+#include <Arduino.h>
+#include "metrics.h"
+#include "page.h"
+
+// "{labels}" or "{labels," ahead of another label, nothing at all without labels.
+static void writeLabels(const char *labels, bool more)
+{
+  if (labels != nullptr)
+  {
+    pagePrintf("{%s%s", labels, more ? "," : "}");
+  }
+  else if (more)
+  {
+    pagePrint("{");
+  }
+}
+
+static void writeSeconds(uint64_t micros)
+{
+  pagePrintf(" %u.%06u\n", (unsigned)(micros / 1000000), (unsigned)(micros % 1000000));
+}
+
+void metricsWriteType(const char *name, const char *type, const char *help)
+{
+  pagePrintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metricsWriteHistogram(const char *name, const char *labels, const MetricsHistogram &histogram)
+{
+  // Prometheus buckets are cumulative.
+  uint32_t count = 0;
+  for (uint8_t bucket = 0; bucket < metricsBuckets; bucket++)
+  {
+    count += histogram.buckets[bucket];
+    uint32_t bound = metricsFirstBound << bucket;
+    pagePrintf("%s_bucket", name);
+    writeLabels(labels, true);
+    pagePrintf("le=\"%u.%06u\"} %u\n", (unsigned)(bound / 1000000), (unsigned)(bound % 1000000), count);
+  }
+  count += histogram.buckets[metricsBuckets];
+  pagePrintf("%s_bucket", name);
+  writeLabels(labels, true);
+  pagePrintf("le=\"+Inf\"} %u\n", count);
+
+  pagePrintf("%s_sum", name);
+  writeLabels(labels, false);
+  writeSeconds(histogram.sumMicros);
+  pagePrintf("%s_count", name);
+  writeLabels(labels, false);
+  pagePrintf(" %u\n", count);
+}
+
+void metricsWriteValue(const char *name, const char *labels, uint32_t value)
+{
+  pagePrint(name);
+  writeLabels(labels, false);
+  pagePrintf(" %u\n", value);
+}
+
+void metricsWriteValue(const char *name, const char *labels, int32_t value)
+{
+  pagePrint(name);
+  writeLabels(labels, false);
+  pagePrintf(" %d\n", value);
+}
+
+void metricsWriteSeconds(const char *name, const char *labels, uint64_t micros)
+{
+  pagePrint(name);
+  writeLabels(labels, false);
+  writeSeconds(micros);
+}
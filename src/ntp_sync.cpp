@@ -0,0 +1,328 @@
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include <lwip/dns.h>
+#include "ntp_sync.h"
+#include "event_log.h"
+
+// Servers are tried in order, moving on to the next one when an answer times out.
+static const char *ntpServers[] = {"pool.ntp.org", "time.google.com", "time.cloudflare.com"};
+static const uint8_t ntpServerCount = sizeof(ntpServers) / sizeof(ntpServers[0]);
+
+static const uint16_t ntpPort = 123;
+static const uint16_t ntpLocalPort = 2390;
+static const uint8_t ntpPacketSize = 48;
+static const uint32_t seventyYears = 2208988800UL;
+
+static const unsigned long ntpTimeout = 2000;
+static const unsigned long ntpRetryIntervall = 15000;
+static const unsigned long ntpMinIntervall = 60000;
+static const unsigned long ntpMaxIntervall = 4 * 3600000UL;
+// Don't fold errors into the drift estimate over spans short enough for network jitter to dominate.
+static const unsigned long ntpMinDriftSpan = 300000;
+// Move the anchor forward well before millis() wraps, in case no answer arrives for a long time.
+static const unsigned long ntpReanchorIntervall = 24 * 3600000UL;
+static const int32_t ntpSettledErrorMs = 250;
+static const int32_t ntpMaxDriftPpm = 500;
+
+typedef enum
+{
+  ntpIdle,
+  ntpResolving,
+  ntpWaiting
+} ntpState_t;
+
+static WiFiUDP ntpUDP;
+static ntpState_t state = ntpIdle;
+static unsigned long stateMillis = 0;
+static unsigned long lastAttemptMillis = 0;
+static unsigned long nextAttemptDelay = 0;
+static unsigned long syncIntervall = ntpMinIntervall;
+static uint8_t serverIndex = 0;
+static uint8_t consecutiveFailures = 0;
+
+// Set from the lwIP dns callback.
+static volatile uint8_t requestId = 0;
+static volatile bool resolved = false;
+static volatile bool resolveFailed = false;
+static IPAddress serverAddress;
+static uint32_t requestNonce = 0;
+
+// UTC time in ms of the latest answer, and the millis() it was received at.
+static bool synced = false;
+// Synced from a cached time rather than an answer, the first answer replaces it without being taken as drift.
+static bool seeded = false;
+static uint64_t anchorEpochMs = 0;
+static unsigned long anchorMillis = 0;
+static int32_t driftPpm = 0;
+
+// Since boot, for the metrics.
+static uint32_t answerCount = 0;
+static uint32_t failureCount = 0;
+static unsigned long lastRoundTrip = 0;
+
+static uint64_t expectedEpochMs(unsigned long atMillis)
+{
+  int64_t elapsed = (unsigned long)(atMillis - anchorMillis);
+  return anchorEpochMs + elapsed + elapsed * driftPpm / 1000000;
+}
+
+static uint32_t readBigEndian(const uint8_t *data)
+{
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+static void dnsFound(const char *, const ip_addr_t *ipaddr, void *callbackArg)
+{
+  if (state != ntpResolving || reinterpret_cast<uintptr_t>(callbackArg) != requestId)
+  {
+    return; // Answer to a lookup we already gave up on.
+  }
+  if (ipaddr)
+  {
+    serverAddress = IPAddress(ip4_addr_get_u32(ip_2_ip4(ipaddr)));
+    resolved = true;
+  }
+  else
+  {
+    resolveFailed = true;
+  }
+}
+
+static void startResolve(unsigned long currentMillis)
+{
+  ip_addr_t address;
+  requestId++;
+  resolved = false;
+  resolveFailed = false;
+  state = ntpResolving;
+  stateMillis = currentMillis;
+
+  err_t err = dns_gethostbyname(ntpServers[serverIndex], &address, dnsFound, reinterpret_cast<void *>(static_cast<uintptr_t>(requestId)));
+  if (err == ERR_OK)
+  {
+    serverAddress = IPAddress(ip4_addr_get_u32(ip_2_ip4(&address)));
+    resolved = true;
+  }
+  else if (err != ERR_INPROGRESS)
+  {
+    resolveFailed = true;
+  }
+}
+
+static void sendRequest()
+{
+  uint8_t packet[ntpPacketSize];
+  memset(packet, 0, sizeof(packet));
+  packet[0] = 0b11100011; // Unsynchronized, version 4, client mode
+  // The server echoes our transmit timestamp as its originate timestamp, a nonce there ties the answer to this request.
+  requestNonce = micros() ^ (requestId << 24);
+  memcpy(&packet[40], &requestNonce, sizeof(requestNonce));
+
+  while (ntpUDP.parsePacket() > 0)
+  {
+    ntpUDP.flush(); // Drop late answers to earlier requests.
+  }
+  ntpUDP.beginPacket(serverAddress, ntpPort);
+  ntpUDP.write(packet, sizeof(packet));
+  ntpUDP.endPacket();
+  state = ntpWaiting;
+  stateMillis = millis();
+}
+
+// Returns how far the clock was off, 0 when there was none yet.
+static int64_t applyAnswer(uint64_t epochMs, unsigned long receivedMillis)
+{
+  int64_t error = synced ? (int64_t)epochMs - (int64_t)expectedEpochMs(receivedMillis) : 0;
+  if (synced && !seeded)
+  {
+    unsigned long span = receivedMillis - anchorMillis;
+    if (span >= ntpMinDriftSpan)
+    {
+      // Halve the correction to damp jitter.
+      driftPpm += (int32_t)(error * 1000000 / (int64_t)span) / 2;
+      driftPpm = constrain(driftPpm, -ntpMaxDriftPpm, ntpMaxDriftPpm);
+    }
+    if (error >= -ntpSettledErrorMs && error <= ntpSettledErrorMs)
+    {
+      syncIntervall = syncIntervall * 2 > ntpMaxIntervall ? ntpMaxIntervall : syncIntervall * 2;
+    }
+    else
+    {
+      syncIntervall = syncIntervall / 2 < ntpMinIntervall ? ntpMinIntervall : syncIntervall / 2;
+    }
+#ifdef DEBUG_LAMPOMATIC
+    Serial.print("NTP error (ms): ");
+    Serial.print((long)error);
+    Serial.print(", drift (ppm): ");
+    Serial.print(driftPpm);
+    Serial.print(", next sync in (s): ");
+    Serial.println(syncIntervall / 1000);
+#endif
+  }
+  anchorEpochMs = epochMs;
+  anchorMillis = receivedMillis;
+  synced = true;
+  seeded = false;
+  return error;
+}
+
+static bool receiveAnswer()
+{
+  int size = ntpUDP.parsePacket();
+  if (size <= 0)
+  {
+    return false;
+  }
+  unsigned long receivedMillis = millis();
+  uint8_t packet[ntpPacketSize];
+  if (size < ntpPacketSize || ntpUDP.read(packet, sizeof(packet)) < ntpPacketSize)
+  {
+    ntpUDP.flush();
+    return false;
+  }
+  ntpUDP.flush();
+  // Must be a server answer to our nonce, stratum 0 is a kiss-o'-death.
+  if ((packet[0] & 0x07) != 4 || packet[1] == 0 || memcmp(&packet[24], &requestNonce, sizeof(requestNonce)) != 0)
+  {
+    return false;
+  }
+
+  uint32_t seconds = readBigEndian(&packet[40]);
+  uint32_t fraction = readBigEndian(&packet[44]);
+  unsigned long roundTrip = receivedMillis - stateMillis;
+  uint64_t epochMs = (uint64_t)(seconds - seventyYears) * 1000 + (((uint64_t)fraction * 1000) >> 32) + roundTrip / 2;
+  int64_t error = applyAnswer(epochMs, receivedMillis);
+  eventLog(eventNtpAnswer, serverIndex, constrain(error, (int64_t)INT32_MIN, (int64_t)INT32_MAX));
+  answerCount++;
+  lastRoundTrip = roundTrip;
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("NTP answer from ");
+  Serial.print(ntpServers[serverIndex]);
+  Serial.print(", round trip (ms): ");
+  Serial.println(roundTrip);
+#endif
+  return true;
+}
+
+static void attemptFailed(unsigned long currentMillis)
+{
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("NTP request failed: ");
+  Serial.println(ntpServers[serverIndex]);
+#endif
+  state = ntpIdle;
+  consecutiveFailures++;
+  failureCount++;
+  eventLog(eventNtpFailure, serverIndex, consecutiveFailures);
+  serverIndex = (serverIndex + 1) % ntpServerCount;
+  // Go straight on to the next server, back off once all of them have failed.
+  nextAttemptDelay = consecutiveFailures % ntpServerCount == 0 ? ntpRetryIntervall : 0;
+  lastAttemptMillis = currentMillis;
+}
+
+void ntpBegin()
+{
+  ntpUDP.begin(ntpLocalPort);
+}
+
+bool ntpService(unsigned long currentMillis, bool online)
+{
+  if (synced && currentMillis - anchorMillis >= ntpReanchorIntervall)
+  {
+    anchorEpochMs = expectedEpochMs(currentMillis);
+    anchorMillis = currentMillis;
+  }
+
+  switch (state)
+  {
+  case ntpIdle:
+    if (online && currentMillis - lastAttemptMillis >= nextAttemptDelay)
+    {
+      lastAttemptMillis = currentMillis;
+      startResolve(currentMillis);
+    }
+    break;
+  case ntpResolving:
+    if (resolved)
+    {
+      sendRequest();
+    }
+    else if (resolveFailed || currentMillis - stateMillis >= ntpTimeout)
+    {
+      attemptFailed(currentMillis);
+    }
+    break;
+  case ntpWaiting:
+    if (receiveAnswer())
+    {
+      state = ntpIdle;
+      consecutiveFailures = 0;
+      nextAttemptDelay = syncIntervall;
+      lastAttemptMillis = currentMillis;
+      return true;
+    }
+    else if (currentMillis - stateMillis >= ntpTimeout)
+    {
+      attemptFailed(currentMillis);
+    }
+    break;
+  }
+  return false;
+}
+
+void ntpSeed(uint64_t epochMs, int32_t drift)
+{
+  if (synced)
+  {
+    return;
+  }
+  anchorEpochMs = epochMs;
+  anchorMillis = millis();
+  driftPpm = drift;
+  synced = true;
+  seeded = true;
+}
+
+bool ntpBusy()
+{
+  return state != ntpIdle;
+}
+
+time_t ntpNow()
+{
+  if (!synced)
+  {
+    return 0;
+  }
+  return expectedEpochMs(millis()) / 1000;
+}
+
+uint64_t ntpNowMs()
+{
+  return synced ? expectedEpochMs(millis()) : 0;
+}
+
+int32_t ntpDriftPpm()
+{
+  return driftPpm;
+}
+
+unsigned long ntpSyncIntervall()
+{
+  return syncIntervall;
+}
+
+uint32_t ntpAnswerCount()
+{
+  return answerCount;
+}
+
+uint32_t ntpFailureCount()
+{
+  return failureCount;
+}
+
+unsigned long ntpLastRoundTrip()
+{
+  return lastRoundTrip;
+}
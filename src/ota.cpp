@@ -0,0 +1,110 @@
+#include <Arduino.h>
+#include <ArduinoOTA.h>
+#include "ota.h"
+#ifdef LAMPOMATIC_UPDATE_URL
+#include <ESP8266WiFi.h>
+#include <ESP8266httpUpdate.h>
+#endif
+#ifdef LAMPOMATIC_UPDATE_PUBLIC_KEY
+#include <BearSSLHelpers.h>
+#include <Updater.h>
+#endif
+
+#if defined(LAMPOMATIC_UPDATE_URL) && !defined(LAMPOMATIC_UPDATE_PUBLIC_KEY)
+#error "Pulled updates need LAMPOMATIC_UPDATE_PUBLIC_KEY, nothing else proves who built the image"
+#endif
+
+#ifdef LAMPOMATIC_UPDATE_PUBLIC_KEY
+// Images, pushed or pulled, are only installed with a valid signature from the matching private key. The MD5 checks
+// only catch a broken transfer, anyone who can answer the request can send a matching one.
+static BearSSL::PublicKey signingKey(LAMPOMATIC_UPDATE_PUBLIC_KEY);
+static BearSSL::HashSHA256 signingHash;
+static BearSSL::SigningVerifier signingVerifier(&signingKey);
+#endif
+
+#ifdef LAMPOMATIC_UPDATE_URL
+#ifndef LAMPOMATIC_VERSION
+#define LAMPOMATIC_VERSION "1.2.1"
+#endif
+// The server gets the version and the running sketch's MD5 in the x-ESP8266-* headers, and answers 304 when
+// there's nothing newer. Plain HTTP is fine, the signature is what's trusted.
+static const char updateUrl[] = LAMPOMATIC_UPDATE_URL;
+static const unsigned long updateCheckIntervall = 6 * 3600000UL;
+// Give NTP and the first requests a moment after connecting, the download blocks loop() while it runs.
+static const unsigned long updateFirstCheckDelay = 60000;
+
+static bool checkScheduled = false;
+static unsigned long nextCheckMillis = 0;
+
+static void checkForUpdate()
+{
+  WiFiClient client;
+  ESPhttpUpdate.rebootOnUpdate(true);
+  t_httpUpdate_return result = ESPhttpUpdate.update(client, updateUrl, LAMPOMATIC_VERSION);
+#ifdef DEBUG_LAMPOMATIC
+  if (result == HTTP_UPDATE_FAILED)
+  {
+    Serial.print("Update failed: ");
+    Serial.println(ESPhttpUpdate.getLastErrorString());
+  }
+#else
+  (void)result;
+#endif
+}
+#endif
+
+static void (*beforeUpdateCallback)() = nullptr;
+
+static void updateStarting()
+{
+#ifdef DEBUG_LAMPOMATIC
+  Serial.println("OTA update started");
+#endif
+  if (beforeUpdateCallback != nullptr)
+  {
+    beforeUpdateCallback();
+  }
+}
+
+void otaBegin(const char *password, void (*beforeUpdate)())
+{
+  beforeUpdateCallback = beforeUpdate;
+#ifdef LAMPOMATIC_UPDATE_PUBLIC_KEY
+  Update.installSignature(&signingHash, &signingVerifier);
+#endif
+  if (password != nullptr && password[0] != '\0')
+  {
+    ArduinoOTA.setPassword(password);
+  }
+  ArduinoOTA.onStart(updateStarting);
+#ifdef LAMPOMATIC_UPDATE_URL
+  ESPhttpUpdate.onStart(updateStarting);
+#endif
+#ifdef DEBUG_LAMPOMATIC
+  ArduinoOTA.onError([](ota_error_t error) {
+    Serial.print("OTA update failed: ");
+    Serial.println(error);
+  });
+#endif
+  ArduinoOTA.begin();
+}
+
+void otaService(unsigned long currentMillis, bool online)
+{
+  ArduinoOTA.handle();
+#ifdef LAMPOMATIC_UPDATE_URL
+  if (online && !checkScheduled)
+  {
+    nextCheckMillis = currentMillis + updateFirstCheckDelay;
+    checkScheduled = true;
+  }
+  if (online && (long)(currentMillis - nextCheckMillis) >= 0)
+  {
+    nextCheckMillis = currentMillis + updateCheckIntervall;
+    checkForUpdate();
+  }
+#else
+  (void)currentMillis;
+  (void)online;
+#endif
+}
@@ -0,0 +1,284 @@
+#include <Arduino.h>
+#include <stdarg.h>
+#include "page.h"
+
+static char buffer[pageBufferSize];
+static uint16_t used = 0;
+
+#ifdef LAMPOMATIC_ASYNC_SERVER
+
+// The page being streamed, nullptr when there's none. id tells its end apart from that of an earlier one.
+static pageProducer_t producer = nullptr;
+static uint32_t streamId = 0;
+// The buffer only holds a formatted piece that didn't fit the last chunk, sent is how much of it did.
+static uint16_t sent = 0;
+// Pieces counted on this run of the producer, the first one not handed out yet and how much of that one was.
+static uint32_t piece = 0;
+static uint32_t nextPiece = 0;
+static size_t pieceOffset = 0;
+// What's left of the chunk being filled.
+static uint8_t *chunk = nullptr;
+static size_t room = 0;
+
+static void drain()
+{
+  size_t pending = used - sent;
+  size_t copy = pending < room ? pending : room;
+  memcpy(chunk, buffer + sent, copy);
+  chunk += copy;
+  room -= copy;
+  sent += copy;
+  if (sent == used)
+  {
+    used = 0;
+    sent = 0;
+  }
+}
+
+// True for the pieces before the first one not handed out, and for all of them once the chunk is full.
+static bool skipPiece()
+{
+  return piece++ < nextPiece || room == 0;
+}
+
+// The next part of a piece that comes out the same on every run, split between chunks wherever they end.
+static void handOut(const char *data, size_t length, bool progmem)
+{
+  size_t copy = length - pieceOffset < room ? length - pieceOffset : room;
+  if (progmem)
+  {
+    memcpy_P(chunk, data + pieceOffset, copy);
+  }
+  else
+  {
+    memcpy(chunk, data + pieceOffset, copy);
+  }
+  chunk += copy;
+  room -= copy;
+  pieceOffset += copy;
+  if (pieceOffset == length)
+  {
+    nextPiece++;
+    pieceOffset = 0;
+  }
+}
+
+// The buffer holds a formatted piece, it's handed out from there.
+static void handOutBuffer()
+{
+  nextPiece++;
+  drain();
+}
+
+static void writeStatic(PGM_P text, size_t length)
+{
+  if (!skipPiece())
+  {
+    handOut(text, length, true);
+  }
+}
+
+static void writeDynamic(const char *data, size_t length)
+{
+  if (skipPiece())
+  {
+    return;
+  }
+  if (length > sizeof(buffer))
+  {
+    handOut(data, length, false); // Too long to hold back, they're never formatted anyway.
+    return;
+  }
+  memcpy(buffer, data, length);
+  used = length;
+  handOutBuffer();
+}
+
+static void finish()
+{
+  producer = nullptr;
+  used = 0;
+  sent = 0;
+  nextPiece = 0;
+  pieceOffset = 0;
+}
+
+static size_t fill(uint8_t *data, size_t length)
+{
+  chunk = data;
+  room = length;
+  drain();
+  if (room > 0 && producer != nullptr)
+  {
+    piece = 0;
+    producer();
+  }
+  size_t written = length - room;
+  if (written == 0 && length > 0)
+  {
+    finish(); // That was the end of the body, the next page can start before this connection closes.
+  }
+  return written;
+}
+
+void pageSend(HttpServer &server, int code, const char *contentType, pageProducer_t body)
+{
+  if (producer != nullptr)
+  {
+    server.sendHeader("Retry-After", "1");
+    server.send(503, "text/plain", "503: Busy, try again");
+    return;
+  }
+  finish();
+  producer = body;
+  uint32_t id = ++streamId;
+  server.sendChunked(code, contentType, fill, [id]() {
+    if (id == streamId)
+    {
+      finish();
+    }
+  });
+}
+
+bool pageBusy()
+{
+  return producer != nullptr;
+}
+
+#else
+
+static HttpServer *pageServer = nullptr;
+
+static void flush()
+{
+  if (used > 0 && pageServer != nullptr)
+  {
+    pageServer->sendContent(buffer, used);
+  }
+  used = 0;
+}
+
+static void append(char c)
+{
+  if (used == sizeof(buffer))
+  {
+    flush();
+  }
+  buffer[used++] = c;
+}
+
+static void writeStatic(PGM_P text, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    append(pgm_read_byte(text + i));
+  }
+}
+
+static void writeDynamic(const char *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    append(data[i]);
+  }
+}
+
+void pageSend(HttpServer &server, int code, const char *contentType, pageProducer_t producer)
+{
+  pageServer = &server;
+  used = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(code, contentType, "");
+  producer();
+  flush();
+  server.sendContent("");
+  pageServer = nullptr;
+}
+
+bool pageBusy()
+{
+  return false;
+}
+
+#endif
+
+void pagePrint(const char *text)
+{
+  writeDynamic(text, strlen(text));
+}
+
+void pageWrite(const uint8_t *data, size_t length)
+{
+  writeDynamic(reinterpret_cast<const char *>(data), length);
+}
+
+void pagePrint_P(PGM_P text)
+{
+  writeStatic(text, strlen_P(text));
+}
+
+void pagePrintf(const char *format, ...)
+{
+#ifdef LAMPOMATIC_ASYNC_SERVER
+  if (skipPiece())
+  {
+    return; // Sent already or after this chunk, either way not formatted on this run.
+  }
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  used = length < 0 ? 0 : (length >= (int)sizeof(buffer) ? sizeof(buffer) - 1 : length);
+  handOutBuffer();
+#else
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer + used, sizeof(buffer) - used, format, args);
+  va_end(args);
+  if (length >= 0 && (size_t)(used + length) >= sizeof(buffer))
+  {
+    // Didn't fit behind what's already buffered, send that and format again into the empty buffer.
+    flush();
+    va_start(args, format);
+    length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    length = length >= (int)sizeof(buffer) ? sizeof(buffer) - 1 : length;
+  }
+  if (length > 0)
+  {
+    used += length;
+  }
+#endif
+}
+
+void pageRender_P(PGM_P pageTemplate, pageProcessor_t processor)
+{
+  char field[pageMaxFieldLength + 1];
+  while (true)
+  {
+    // The text up to the next field is one piece.
+    PGM_P text = pageTemplate;
+    char c = pgm_read_byte(pageTemplate);
+    while (c != '%' && c != '\0')
+    {
+      c = pgm_read_byte(++pageTemplate);
+    }
+    writeStatic(text, pageTemplate - text);
+    if (c == '\0')
+    {
+      return;
+    }
+    uint8_t length = 0;
+    for (c = pgm_read_byte(++pageTemplate); c != '%' && c != '\0' && length < pageMaxFieldLength; c = pgm_read_byte(++pageTemplate))
+    {
+      field[length++] = c;
+    }
+    if (c != '%')
+    {
+      return; // Unterminated field, the template is broken.
+    }
+    field[length] = '\0';
+    processor(field);
+    pageTemplate++;
+  }
+}
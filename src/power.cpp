@@ -0,0 +1,57 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "power.h"
+
+static powerMode_t allowedMode = powerAwake;
+static powerMode_t activeMode = powerAwake;
+
+// Reconfiguring the sleep type renegotiates with the access point, so it's only done on a change.
+static void setMode(powerMode_t mode)
+{
+  if (mode == activeMode)
+  {
+    return;
+  }
+  switch (mode)
+  {
+  case powerAwake:
+    WiFi.setSleepMode(WIFI_NONE_SLEEP);
+    break;
+  case powerModemSleep:
+    WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+    break;
+  case powerLightSleep:
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP, powerListenInterval);
+    break;
+  }
+  activeMode = mode;
+#ifdef DEBUG_LAMPOMATIC
+  Serial.print("Power mode: ");
+  Serial.println(mode);
+#endif
+}
+
+void powerBegin(powerMode_t mode)
+{
+  allowedMode = mode;
+  setMode(mode == powerAwake ? powerAwake : powerModemSleep);
+}
+
+void powerIdle(unsigned long idleMillis, bool pwmNeeded)
+{
+  if (allowedMode == powerAwake)
+  {
+    return;
+  }
+  setMode(allowedMode == powerLightSleep && !pwmNeeded ? powerLightSleep : powerModemSleep);
+  if (idleMillis > 0)
+  {
+    // The SDK only sleeps while the CPU waits in delay(), timers and network callbacks still run.
+    delay(idleMillis);
+  }
+}
+
+powerMode_t powerActiveMode()
+{
+  return activeMode;
+}
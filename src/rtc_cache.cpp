@@ -0,0 +1,110 @@
+#include <Arduino.h>
+#include <string.h>
+#include "rtc_cache.h"
+#include "config_format.h"
+
+extern "C"
+{
+#include <user_interface.h>
+}
+
+// Blocks of 4 bytes. The first 32 belong to the bootloader's update command, boot_guard sits at 32.
+static const uint32_t rtcCacheBlock = 40;
+static const uint32_t rtcCacheMagic = 0x4C4D5243; // "LMRC"
+
+// Flags
+static const uint8_t rtcClockValid = 0x01;
+static const uint8_t rtcRuntimeValid = 0x02;
+static const uint8_t rtcRuntimeFlushed = 0x04;
+
+struct RtcCacheRecord
+{
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t utcMs;
+  // RTC timer ticks at utcMs, a tick is about 6 us and the calibration says exactly how long.
+  uint32_t rtcTicks;
+  int32_t driftPpm;
+  // Config the runtime record goes with, a cached state for another schedule isn't used.
+  uint32_t configCrc;
+  uint8_t runtime;
+  uint8_t flags;
+  uint16_t reserved;
+};
+
+static_assert(sizeof(RtcCacheRecord) % 4 == 0, "RTC memory is read and written in 4 byte blocks");
+
+// Kept in RAM as well, every change is written through whole, it's 32 bytes.
+static RtcCacheRecord cache;
+
+static uint32_t recordCrc(const RtcCacheRecord &record)
+{
+  return crc32(&record.utcMs, sizeof(record) - offsetof(RtcCacheRecord, utcMs));
+}
+
+static void writeCache()
+{
+  cache.magic = rtcCacheMagic;
+  cache.crc = recordCrc(cache);
+  ESP.rtcUserMemoryWrite(rtcCacheBlock, reinterpret_cast<uint32_t *>(&cache), sizeof(cache));
+}
+
+static uint64_t ticksToMs(uint32_t ticks)
+{
+  // Calibration is us per tick in 20.12 fixed point.
+  return ((uint64_t)ticks * system_rtc_clock_cali_proc() >> 12) / 1000;
+}
+
+void rtcCacheBegin()
+{
+  if (!ESP.rtcUserMemoryRead(rtcCacheBlock, reinterpret_cast<uint32_t *>(&cache), sizeof(cache)) ||
+      cache.magic != rtcCacheMagic || cache.crc != recordCrc(cache))
+  {
+    memset(&cache, 0, sizeof(cache));
+  }
+}
+
+void rtcClockSave(uint64_t utcMs, int32_t driftPpm)
+{
+  cache.utcMs = utcMs;
+  cache.rtcTicks = system_get_rtc_time();
+  cache.driftPpm = driftPpm;
+  cache.flags |= rtcClockValid;
+  writeCache();
+}
+
+bool rtcClockRestore(uint64_t &utcMs, int32_t &driftPpm)
+{
+  if (!(cache.flags & rtcClockValid))
+  {
+    return false;
+  }
+  // Wraps after some 7 hours, which is far beyond the gap that's accepted.
+  uint64_t gapMs = ticksToMs(system_get_rtc_time() - cache.rtcTicks);
+  if (gapMs > rtcClockMaxGapMs)
+  {
+    return false;
+  }
+  utcMs = cache.utcMs + gapMs;
+  driftPpm = cache.driftPpm;
+  return true;
+}
+
+void rtcRuntimeSave(uint8_t runtime, uint32_t configCrc, bool flushed)
+{
+  cache.runtime = runtime;
+  cache.configCrc = configCrc;
+  cache.flags = (cache.flags & rtcClockValid) | rtcRuntimeValid | (flushed ? rtcRuntimeFlushed : 0);
+  writeCache();
+}
+
+bool rtcRuntimeRestore(uint8_t &runtime, uint32_t configCrc, bool &flushed)
+{
+  if (!(cache.flags & rtcRuntimeValid) || cache.configCrc != configCrc)
+  {
+    return false;
+  }
+  runtime = cache.runtime;
+  flushed = cache.flags & rtcRuntimeFlushed;
+  return true;
+}
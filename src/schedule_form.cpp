@@ -0,0 +1,309 @@
+#include <string.h>
+#include <stdio.h>
+#include "schedule_form.h"
+#include "sun.h"
+
+typedef enum : uint8_t
+{
+  // Start and end of day, night, weekend day and weekend night, in ScheduleForm::schedules order.
+  formDayStart,
+  formDayEnd,
+  formNightStart,
+  formNightEnd,
+  formWeekendDayStart,
+  formWeekendDayEnd,
+  formWeekendNightStart,
+  formWeekendNightEnd,
+  formDayIntensity,
+  formNightIntensity,
+  // Fade fields in channel order.
+  formDayFadeIn,
+  formNightFadeIn,
+  formDayFadeOut,
+  formNightFadeOut,
+  formDst,
+  formWeekly,
+  formGatekeeper,
+  formFieldCount
+} formField_t;
+
+static const char *const formFieldNames[formFieldCount] = {
+    "dayStart", "dayEnd", "nightStart", "nightEnd",
+    "weekendDayStart", "weekendDayEnd", "weekendNightStart", "weekendNightEnd",
+    "dayIntensity", "nightIntensity",
+    "dayFadeIn", "nightFadeIn", "dayFadeOut", "nightFadeOut",
+    "dst", "weekly", "gatekeeper"};
+
+// Times can be relative to the sun as well, see sun.h.
+static const char expectedTime[] = "HH:MM or sunset-30";
+
+static const uint8_t maxIntensity = 100;
+
+static void invalid(ScheduleForm &form, const char *name, const char *expected)
+{
+  if (form.invalidField[0] != '\0')
+  {
+    return; // Only the first one is reported.
+  }
+  strncpy(form.invalidField, name, sizeof(form.invalidField) - 1);
+  form.invalidField[sizeof(form.invalidField) - 1] = '\0';
+  form.expected = expected;
+}
+
+// Plain decimal, no sign or spaces.
+static bool parseDecimal(const char *text, uint16_t max, uint16_t &value)
+{
+  uint32_t parsed = 0;
+  for (const char *digit = text; *digit != '\0'; digit++)
+  {
+    if (*digit < '0' || *digit > '9')
+    {
+      return false;
+    }
+    parsed = parsed * 10 + (*digit - '0');
+    if (parsed > max)
+    {
+      return false;
+    }
+  }
+  value = parsed;
+  return true;
+}
+
+static bool parseTime(ScheduleForm &form, const char *name, const char *value, Schedule &schedule, bool start)
+{
+  if (!parseScheduleEndpoint(value, schedule, start))
+  {
+    invalid(form, name, expectedTime);
+    return false;
+  }
+  return true;
+}
+
+static formField_t findField(const char *name)
+{
+  uint8_t field = 0;
+  for (; field < formFieldCount && strcmp(name, formFieldNames[field]) != 0; field++)
+    ;
+  return (formField_t)field;
+}
+
+// Slots come as w<weekday>s<slot>Start/End/Channel, weekday 0 being sunday. False if name isn't one.
+static bool slotField(ScheduleForm &form, const char *name, const char *value)
+{
+  if (name[0] != 'w' || name[1] < '0' || name[1] >= '0' + daysPerWeek || name[2] != 's' || name[3] < '0' || name[3] >= '0' + slotsPerDay)
+  {
+    return false;
+  }
+  uint8_t weekday = name[1] - '0';
+  uint8_t slot = name[3] - '0';
+  const char *part = &name[4];
+  Schedule &schedule = form.week.slots[weekday][slot];
+  uint32_t bit = (uint32_t)1 << (weekday * slotsPerDay + slot);
+  if (strcmp(part, "Start") == 0 || strcmp(part, "End") == 0)
+  {
+    bool start = part[0] == 'S';
+    if (!parseTime(form, name, value, schedule, start))
+    {
+      return true;
+    }
+    (start ? form.slotStarts : form.slotEnds) |= bit;
+  }
+  else if (strcmp(part, "Channel") == 0)
+  {
+    if (strcmp(value, "night") == 0)
+    {
+      schedule.flags |= scheduleNight;
+    }
+    else if (strcmp(value, "day") == 0)
+    {
+      schedule.flags &= ~scheduleNight;
+    }
+    else
+    {
+      invalid(form, name, "day or night");
+    }
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+void formBegin(ScheduleForm &form, const PersistedConfig &current, const char *password)
+{
+  form.config = current;
+  form.config.dstActive = false; // An unchecked checkbox isn't sent at all.
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    form.schedules[i] = disabledSchedule();
+  }
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      form.week.slots[weekday][slot] = disabledSchedule();
+    }
+  }
+  form.weekly = false;
+  form.present = 0;
+  form.slotStarts = 0;
+  form.slotEnds = 0;
+  form.password = password;
+  form.gatekeeperSent = false;
+  form.gatekeeperOk = false;
+  form.invalidField[0] = '\0';
+  form.expected = "";
+}
+
+void formField(ScheduleForm &form, const char *name, const char *value)
+{
+  if (value[0] == '\0')
+  {
+    return;
+  }
+  if (slotField(form, name, value))
+  {
+    return;
+  }
+  formField_t field = findField(name);
+  if (field == formFieldCount)
+  {
+    return;
+  }
+  form.present |= (uint32_t)1 << field;
+
+  uint16_t number;
+  if (field <= formWeekendNightEnd)
+  {
+    Schedule &schedule = form.schedules[field / 2];
+    parseTime(form, name, value, schedule, field % 2 == 0);
+  }
+  else if (field == formDayIntensity || field == formNightIntensity)
+  {
+    if (!parseDecimal(value, maxIntensity, number))
+    {
+      invalid(form, name, "0-100");
+    }
+    else if (field == formDayIntensity)
+    {
+      form.config.dayIntensity = number;
+    }
+    else
+    {
+      form.config.nightIntensity = number;
+    }
+  }
+  else if (field <= formNightFadeOut)
+  {
+    if (!parseDecimal(value, maxFadeSeconds, number))
+    {
+      invalid(form, name, "0-3600 seconds");
+    }
+    else if (field < formDayFadeOut)
+    {
+      form.config.fadeInSeconds[field - formDayFadeIn] = number;
+    }
+    else
+    {
+      form.config.fadeOutSeconds[field - formDayFadeOut] = number;
+    }
+  }
+  else if (field == formDst)
+  {
+    if (strcmp(value, "on") != 0)
+    {
+      invalid(form, name, "on");
+    }
+    form.config.dstActive = true;
+  }
+  else if (field == formWeekly)
+  {
+    form.weekly = true;
+  }
+  else
+  {
+    form.gatekeeperSent = true;
+    form.gatekeeperOk = strcmp(value, form.password) == 0;
+  }
+}
+
+// Both ends or neither, a start without an end is reported as the end missing and vice versa.
+static bool pairComplete(ScheduleForm &form, bool hasStart, bool hasEnd, const char *startName, const char *endName)
+{
+  if (hasStart != hasEnd)
+  {
+    invalid(form, hasStart ? endName : startName, expectedTime);
+  }
+  return hasStart && hasEnd;
+}
+
+bool formFinish(ScheduleForm &form)
+{
+  for (uint8_t field = formDayIntensity; field <= formNightIntensity; field++)
+  {
+    if (!(form.present & ((uint32_t)1 << field)))
+    {
+      invalid(form, formFieldNames[field], "0-100");
+    }
+  }
+
+  if (form.weekly)
+  {
+    char startName[formFieldNameLength];
+    char endName[formFieldNameLength];
+    for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+    {
+      for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+      {
+        uint32_t bit = (uint32_t)1 << (weekday * slotsPerDay + slot);
+        bool hasStart = form.slotStarts & bit;
+        bool hasEnd = form.slotEnds & bit;
+        if (hasStart != hasEnd)
+        {
+          snprintf(startName, sizeof(startName), "w%us%uStart", weekday, slot);
+          snprintf(endName, sizeof(endName), "w%us%uEnd", weekday, slot);
+        }
+        if (pairComplete(form, hasStart, hasEnd, startName, endName))
+        {
+          form.week.slots[weekday][slot].flags |= scheduleEnabled;
+        }
+        else
+        {
+          form.week.slots[weekday][slot] = disabledSchedule();
+        }
+      }
+    }
+    form.config.weeklyActive = true;
+    form.config.week = form.week;
+  }
+  else
+  {
+    // Day and night are required, either half of the weekend can be left out.
+    for (uint8_t i = 0; i < 4; i++)
+    {
+      uint8_t start = i * 2;
+      bool hasStart = form.present & ((uint32_t)1 << start);
+      bool hasEnd = form.present & ((uint32_t)1 << (start + 1));
+      if (i < 2 && !hasStart && !hasEnd)
+      {
+        invalid(form, formFieldNames[start], expectedTime);
+      }
+      if (pairComplete(form, hasStart, hasEnd, formFieldNames[start], formFieldNames[start + 1]))
+      {
+        form.schedules[i].flags |= scheduleEnabled; // Keeps the sun flags of the times.
+      }
+      else
+      {
+        form.schedules[i] = disabledSchedule();
+      }
+    }
+    form.config.weeklyActive = false;
+    form.config.day = form.schedules[0];
+    form.config.night = form.schedules[1];
+    form.config.weekendDay = form.schedules[2];
+    form.config.weekendNight = form.schedules[3];
+  }
+  return form.invalidField[0] == '\0';
+}
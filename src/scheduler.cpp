@@ -0,0 +1,283 @@
+#include "scheduler.h"
+
+// A window is active from start up to, but not including, end. Both are minutes of the week, start within it and
+// end past minutesPerWeek when a window wraps into sunday.
+struct Window
+{
+  uint16_t start;
+  uint16_t end;
+  uint8_t channel;
+};
+
+static const uint8_t maxWindows = daysPerWeek * slotsPerDay;
+
+// One entry per change of a channel, sorted by minute. state holds every channel's level after the change,
+// so looking up the state at any minute is a binary search and a read.
+struct Transition
+{
+  uint16_t minuteOfWeek;
+  uint8_t channel;
+  uint8_t level;
+  uint8_t state;
+};
+
+static const uint8_t sunday = 0;
+static const uint8_t friday = 5;
+static const uint8_t saturday = 6;
+
+struct TransitionTable
+{
+  Transition transitions[schedulerMaxTransitions];
+  uint8_t count;
+  // State when the table is empty, i.e. nothing ever changes.
+  uint8_t constantState;
+};
+
+// The running table and the one the next compile builds into. Swapping is a single pointer store.
+static TransitionTable tables[2];
+static const TransitionTable *table = &tables[0];
+
+static SunDay sun[daysPerWeek] = {{360, 1080}, {360, 1080}, {360, 1080}, {360, 1080}, {360, 1080}, {360, 1080}, {360, 1080}};
+
+// Minute of the start or end of schedule on weekday, from its midnight. Sun relative ones fall outside the day when
+// the sun or the offset takes them past midnight, they stay that day's rather than moving a day.
+static int16_t endpointMinute(const Schedule &schedule, bool start, uint8_t weekday)
+{
+  uint16_t minute = start ? schedule.startMinute : schedule.endMinute;
+  if (!(schedule.flags & (start ? scheduleStartSun : scheduleEndSun)))
+  {
+    return minute;
+  }
+  return (schedule.flags & (start ? scheduleStartSunset : scheduleEndSunset) ? sun[weekday].sunset : sun[weekday].sunrise) + (int16_t)minute;
+}
+
+// From the start of startSchedule on weekday to the end of endSchedule, the same day or, when that comes out
+// earlier, the next one. Sun to sun windows go by the order of the events instead: sunrise to sunset is always the
+// same day, empty when the offsets cross, and sunset to sunrise always runs to the next day's sunrise. In polar night
+// both are at noon and under the midnight sun 24 hours apart (see sunTimes()), so that's always night and always
+// day, with the offsets counted from noon or midnight.
+static Window makeWindow(uint8_t channel, uint8_t weekday, const Schedule &startSchedule, const Schedule &endSchedule)
+{
+  int16_t startMinute = endpointMinute(startSchedule, true, weekday);
+  int16_t endMinute = endpointMinute(endSchedule, false, weekday);
+  bool sunToSun = (startSchedule.flags & scheduleStartSun) && (endSchedule.flags & scheduleEndSun);
+  bool fromSunset = startSchedule.flags & scheduleStartSunset;
+  bool toSunset = endSchedule.flags & scheduleEndSunset;
+  int32_t start = (int32_t)weekday * minutesPerDay + startMinute;
+  int32_t end = (int32_t)weekday * minutesPerDay + endMinute;
+  if (sunToSun ? fromSunset && !toSunset : endMinute < startMinute)
+  {
+    // Ends the next day, at that day's sunrise or sunset.
+    end = (int32_t)(weekday + 1) * minutesPerDay + endpointMinute(endSchedule, false, (weekday + 1) % daysPerWeek);
+  }
+  end = end < start ? start : end;
+  // A sun time carried past midnight can put the start in the week before or after, it's the same window a week over.
+  int32_t shift = start < 0 ? minutesPerWeek : (start >= minutesPerWeek ? -(int32_t)minutesPerWeek : 0);
+  Window window;
+  window.channel = channel;
+  window.start = start + shift;
+  window.end = end + shift;
+  return window;
+}
+
+static bool windowContains(const Window &window, uint16_t minuteOfWeek)
+{
+  return (minuteOfWeek >= window.start && minuteOfWeek < window.end) ||
+         (minuteOfWeek + minutesPerWeek >= window.start && minuteOfWeek + minutesPerWeek < window.end);
+}
+
+static uint8_t stateFromWindows(const Window windows[], uint8_t windowCount, uint16_t minuteOfWeek)
+{
+  uint8_t state = 0;
+  for (uint8_t i = 0; i < windowCount; i++)
+  {
+    if (windowContains(windows[i], minuteOfWeek))
+    {
+      state |= 1 << windows[i].channel;
+    }
+  }
+  return state;
+}
+
+// Index of the first transition after minuteOfWeek, count if there's none later in the week.
+static uint8_t upperBound(const TransitionTable &current, uint16_t minuteOfWeek)
+{
+  uint8_t low = 0;
+  uint8_t high = current.count;
+  while (low < high)
+  {
+    uint8_t middle = (low + high) / 2;
+    if (current.transitions[middle].minuteOfWeek <= minuteOfWeek)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static bool tablesEqual(const TransitionTable &a, const TransitionTable &b)
+{
+  if (a.count != b.count || a.constantState != b.constantState)
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < a.count; i++)
+  {
+    const Transition &x = a.transitions[i];
+    const Transition &y = b.transitions[i];
+    if (x.minuteOfWeek != y.minuteOfWeek || x.channel != y.channel || x.level != y.level || x.state != y.state)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool buildTable(const Window windows[], uint8_t windowCount)
+{
+  TransitionTable &next = tables[table == &tables[0] ? 1 : 0];
+  // Every window edge is a candidate minute, the state at each is worked out once here so that
+  // overlapping windows come out right. Only minutes where the state actually changes are kept.
+  uint16_t edges[maxWindows * 2];
+  uint8_t edgeCount = 0;
+  for (uint8_t i = 0; i < windowCount; i++)
+  {
+    if (windows[i].start != windows[i].end)
+    {
+      edges[edgeCount++] = windows[i].start % minutesPerWeek;
+      edges[edgeCount++] = windows[i].end % minutesPerWeek;
+    }
+  }
+  // Insertion sort, there are only a few dozen edges.
+  for (uint8_t i = 1; i < edgeCount; i++)
+  {
+    uint16_t edge = edges[i];
+    uint8_t j = i;
+    for (; j > 0 && edges[j - 1] > edge; j--)
+    {
+      edges[j] = edges[j - 1];
+    }
+    edges[j] = edge;
+  }
+
+  next.count = 0;
+  next.constantState = stateFromWindows(windows, windowCount, 0);
+  uint8_t previous = stateFromWindows(windows, windowCount, minutesPerWeek - 1);
+  for (uint8_t i = 0; i < edgeCount; i++)
+  {
+    if (i > 0 && edges[i] == edges[i - 1])
+    {
+      continue;
+    }
+    uint8_t state = stateFromWindows(windows, windowCount, edges[i]);
+    for (uint8_t channel = 0; channel < channelCount; channel++)
+    {
+      uint8_t mask = 1 << channel;
+      if ((state & mask) != (previous & mask) && next.count < schedulerMaxTransitions)
+      {
+        // Channels changing on the same minute get one entry each, the last one carries the full state.
+        Transition &transition = next.transitions[next.count++];
+        transition.minuteOfWeek = edges[i];
+        transition.channel = channel;
+        transition.level = (state & mask) ? 1 : 0;
+        transition.state = (previous & ~mask) | (state & mask);
+        previous = transition.state;
+      }
+    }
+  }
+
+  if (tablesEqual(next, *table))
+  {
+    return false;
+  }
+  table = &next;
+  return true;
+}
+
+bool schedulerCompile(const Schedule &day, const Schedule &night, const Schedule &weekendDay, const Schedule &weekendNight)
+{
+  Window windows[channelCount * daysPerWeek];
+  uint8_t windowCount = 0;
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    // Mornings (night end, day start) follow the weekend schedule on saturday and sunday,
+    // evenings (day end, night start) on friday and saturday.
+    uint8_t tomorrow = (weekday + 1) % daysPerWeek;
+    bool weekendEvening = weekday == friday || weekday == saturday;
+    bool weekendMorning = weekday == saturday || weekday == sunday;
+    bool weekendTomorrowMorning = tomorrow == saturday || tomorrow == sunday;
+
+    const Schedule &morningDay = weekendMorning && scheduleIsEnabled(weekendDay) ? weekendDay : day;
+    const Schedule &eveningDay = weekendEvening && scheduleIsEnabled(weekendDay) ? weekendDay : day;
+    const Schedule &eveningNight = weekendEvening && scheduleIsEnabled(weekendNight) ? weekendNight : night;
+    const Schedule &tomorrowNight = weekendTomorrowMorning && scheduleIsEnabled(weekendNight) ? weekendNight : night;
+
+    windows[windowCount++] = makeWindow(channelDay, weekday, morningDay, eveningDay);
+    windows[windowCount++] = makeWindow(channelNight, weekday, eveningNight, tomorrowNight);
+  }
+  return buildTable(windows, windowCount);
+}
+
+bool schedulerCompileWeek(const WeekSchedule &week)
+{
+  Window windows[maxWindows];
+  uint8_t windowCount = 0;
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      const Schedule &schedule = week.slots[weekday][slot];
+      if (scheduleIsEnabled(schedule))
+      {
+        windows[windowCount++] = makeWindow(scheduleChannel(schedule), weekday, schedule, schedule);
+      }
+    }
+  }
+  return buildTable(windows, windowCount);
+}
+
+void schedulerSetSun(const SunDay days[daysPerWeek])
+{
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    sun[weekday] = days[weekday];
+  }
+}
+
+OutputState schedulerStateAt(uint16_t minuteOfWeek)
+{
+  const TransitionTable &current = *table;
+  uint8_t state = current.constantState;
+  if (current.count > 0)
+  {
+    uint8_t next = upperBound(current, minuteOfWeek);
+    // Before the first transition of the week, last week's final state still holds.
+    state = current.transitions[next == 0 ? current.count - 1 : next - 1].state;
+  }
+  OutputState outputState = {(state & (1 << channelDay)) != 0, (state & (1 << channelNight)) != 0};
+  return outputState;
+}
+
+uint16_t schedulerMinutesToNextTransition(uint16_t minuteOfWeek)
+{
+  const TransitionTable &current = *table;
+  if (current.count == 0)
+  {
+    return 0;
+  }
+  uint8_t next = upperBound(current, minuteOfWeek);
+  if (next == current.count)
+  {
+    return current.transitions[0].minuteOfWeek + minutesPerWeek - minuteOfWeek;
+  }
+  return current.transitions[next].minuteOfWeek - minuteOfWeek;
+}
+
+uint8_t schedulerTransitionCount()
+{
+  return table->count;
+}
@@ -0,0 +1,128 @@
+#include <math.h>
+#include <string.h>
+#include "sun.h"
+#include "time_format.h"
+
+static const double radiansPerDegree = M_PI / 180;
+// Civil twilight, 90 degrees plus 6 below the horizon.
+static const double civilZenith = 96 * radiansPerDegree;
+// Days from 1970-01-01 to 2000-01-01, where the fractional year starts.
+static const int32_t epochDay2000 = 10957;
+static const double daysPerYear = 365.2422;
+
+static const char sunriseText[] = "sunrise";
+static const char sunsetText[] = "sunset";
+
+// NOAA's general solar position approximation, within a minute or two at latitudes people live at.
+bool sunTimes(int32_t utcDay, double latitude, double longitude, int16_t &sunrise, int16_t &sunset)
+{
+  // Fractional year in radians at noon UTC. Counting from 2000 instead of every new year drifts less than a day.
+  double gamma = 2 * M_PI * (utcDay - epochDay2000) / daysPerYear;
+  double equationOfTime = 229.18 * (0.000075 + 0.001868 * cos(gamma) - 0.032077 * sin(gamma) -
+                                    0.014615 * cos(2 * gamma) - 0.040849 * sin(2 * gamma));
+  double declination = 0.006918 - 0.399912 * cos(gamma) + 0.070257 * sin(gamma) - 0.006758 * cos(2 * gamma) +
+                       0.000907 * sin(2 * gamma) - 0.002697 * cos(3 * gamma) + 0.00148 * sin(3 * gamma);
+  double noon = 720 - 4 * longitude - equationOfTime;
+
+  double phi = latitude * radiansPerDegree;
+  double cosHourAngle = cos(civilZenith) / (cos(phi) * cos(declination)) - tan(phi) * tan(declination);
+  bool crosses = cosHourAngle >= -1 && cosHourAngle <= 1;
+  // Minutes from noon to either side, 4 per degree of hour angle. A day that never ends gets a minute more either
+  // side, so it still meets the next one after noon moves with the equation of time.
+  double halfDay = cosHourAngle > 1 ? 0 : (cosHourAngle < -1 ? 721 : 4 * acos(cosHourAngle) / radiansPerDegree);
+  sunrise = (int16_t)lround(noon - halfDay);
+  sunset = (int16_t)lround(noon + halfDay);
+  return crosses;
+}
+
+char *formatScheduleEndpoint(const Schedule &schedule, bool start, char text[endpointTextLength])
+{
+  uint16_t minute = start ? schedule.startMinute : schedule.endMinute;
+  if (!(schedule.flags & (start ? scheduleStartSun : scheduleEndSun)))
+  {
+    return formatMinuteOfDay(minute, text);
+  }
+  const char *name = schedule.flags & (start ? scheduleStartSunset : scheduleEndSunset) ? sunsetText : sunriseText;
+  int16_t offset = (int16_t)minute;
+  offset = offset < -sunMaxOffset ? -sunMaxOffset : (offset > sunMaxOffset ? sunMaxOffset : offset);
+  strcpy(text, name);
+  char *end = text + strlen(name);
+  if (offset != 0)
+  {
+    *end++ = offset < 0 ? '-' : '+';
+    uint16_t magnitude = offset < 0 ? -offset : offset;
+    if (magnitude >= 100)
+    {
+      *end++ = '0' + magnitude / 100;
+    }
+    if (magnitude >= 10)
+    {
+      *end++ = '0' + magnitude / 10 % 10;
+    }
+    *end++ = '0' + magnitude % 10;
+  }
+  *end = '\0';
+  return text;
+}
+
+bool parseScheduleEndpoint(const char *text, Schedule &schedule, bool start)
+{
+  uint8_t sunFlags = start ? scheduleStartSun | scheduleStartSunset : scheduleEndSun | scheduleEndSunset;
+  uint16_t minute;
+  uint8_t flags = 0;
+  const char *offsetText;
+  if (parseMinuteOfDay(text, minute))
+  {
+    offsetText = nullptr;
+  }
+  else if (strncmp(text, sunriseText, sizeof(sunriseText) - 1) == 0)
+  {
+    offsetText = text + sizeof(sunriseText) - 1;
+    flags = start ? scheduleStartSun : scheduleEndSun;
+  }
+  else if (strncmp(text, sunsetText, sizeof(sunsetText) - 1) == 0)
+  {
+    offsetText = text + sizeof(sunsetText) - 1;
+    flags = sunFlags;
+  }
+  else
+  {
+    return false;
+  }
+
+  if (offsetText != nullptr)
+  {
+    // Nothing, or a sign and one to three digits.
+    int16_t offset = 0;
+    if (*offsetText != '\0')
+    {
+      bool negative = *offsetText == '-';
+      if (!negative && *offsetText != '+')
+      {
+        return false;
+      }
+      const char *digit = offsetText + 1;
+      for (; *digit >= '0' && *digit <= '9' && digit - offsetText <= 3; digit++)
+      {
+        offset = offset * 10 + (*digit - '0');
+      }
+      if (*digit != '\0' || digit == offsetText + 1 || offset > sunMaxOffset)
+      {
+        return false;
+      }
+      offset = negative ? -offset : offset;
+    }
+    minute = (uint16_t)offset;
+  }
+
+  schedule.flags = (schedule.flags & ~sunFlags) | flags;
+  if (start)
+  {
+    schedule.startMinute = minute;
+  }
+  else
+  {
+    schedule.endMinute = minute;
+  }
+  return true;
+}
@@ -0,0 +1,60 @@
+#include "time_format.h"
+
+// Two digits for every value up to 59.
+static const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859";
+
+static char *writePair(uint8_t value, char *text)
+{
+  const char *pair = &digitPairs[(value > 59 ? 59 : value) * 2];
+  text[0] = pair[0];
+  text[1] = pair[1];
+  return text + 2;
+}
+
+char *formatMinuteOfDay(uint16_t minute, char text[minuteTextLength])
+{
+  char *end = writePair(minute / 60, text);
+  *end++ = ':';
+  end = writePair(minute % 60, end);
+  *end = '\0';
+  return text;
+}
+
+char *formatTimeOfDay(uint8_t hour, uint8_t minute, uint8_t second, char text[timeTextLength])
+{
+  char *end = writePair(hour, text);
+  *end++ = ':';
+  end = writePair(minute, end);
+  *end++ = ':';
+  end = writePair(second, end);
+  *end = '\0';
+  return text;
+}
+
+static bool isDecimal(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+bool parseMinuteOfDay(const char *text, uint16_t &minute)
+{
+  // Checked in order, so the scan stops at an early terminator.
+  if (!isDecimal(text[0]) || !isDecimal(text[1]) || text[2] != ':' || !isDecimal(text[3]) || !isDecimal(text[4]) || text[5] != '\0')
+  {
+    return false;
+  }
+  uint8_t hours = (text[0] - '0') * 10 + (text[1] - '0');
+  uint8_t minutes = (text[3] - '0') * 10 + (text[4] - '0');
+  if (hours > 23 || minutes > 59)
+  {
+    return false;
+  }
+  minute = hours * 60 + minutes;
+  return true;
+}
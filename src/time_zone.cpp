@@ -0,0 +1,322 @@
+#include "time_zone.h"
+
+static const int32_t secondsPerHour = 3600;
+static const int32_t secondsPerDay = 24 * secondsPerHour;
+static const int64_t farFuture = INT64_C(1) << 62;
+
+typedef enum : uint8_t
+{
+  ruleMonthWeekDay, // Mm.w.d, day d (0 sunday) of week w (5 is the last) of month m.
+  ruleJulian,       // Jn, day 1-365, february 29th never counted.
+  ruleDayOfYear     // n, day 0-365, counting february 29th.
+} ruleType_t;
+
+struct Rule
+{
+  ruleType_t type;
+  uint8_t month;
+  uint8_t week;
+  uint16_t day;
+  // Local time of day the clocks change at, can be negative or past 24h.
+  int32_t time;
+};
+
+struct Zone
+{
+  // Seconds east of UTC, i.e. the opposite sign of the TZ string.
+  int32_t standardOffset;
+  int32_t dstOffset;
+  bool hasDst;
+  Rule start;
+  Rule end;
+};
+
+static Zone zone = {0, 0, false, {ruleMonthWeekDay, 0, 0, 0, 0}, {ruleMonthWeekDay, 0, 0, 0, 0}};
+
+// The period the previous conversion fell in.
+static int64_t cacheStart = 0;
+static int64_t cacheEnd = 0;
+static int32_t cacheOffset = 0;
+static bool cacheDst = false;
+
+// Days since 1970-01-01 of year-month-day, month 1-12. Howard Hinnant's days_from_civil.
+static int64_t daysFromCivil(int32_t year, uint8_t month, uint8_t day)
+{
+  year -= month <= 2;
+  int32_t era = (year >= 0 ? year : year - 399) / 400;
+  uint32_t yearOfEra = year - era * 400;
+  uint32_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return (int64_t)era * 146097 + dayOfEra - 719468;
+}
+
+static int32_t yearFromDays(int64_t days)
+{
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  uint32_t dayOfEra = days - era * 146097;
+  uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  uint32_t monthIndex = (5 * dayOfYear + 2) / 153;
+  return yearOfEra + era * 400 + (monthIndex >= 10);
+}
+
+static bool isLeapYear(int32_t year)
+{
+  return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static uint8_t daysInMonth(int32_t year, uint8_t month)
+{
+  static const uint8_t days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  return month == 2 && isLeapYear(year) ? 29 : days[month - 1];
+}
+
+// UTC of a rule in year, offset being the one in effect up until the change.
+static int64_t ruleInstant(const Rule &rule, int32_t year, int32_t offset)
+{
+  int64_t days;
+  if (rule.type == ruleMonthWeekDay)
+  {
+    int64_t first = daysFromCivil(year, rule.month, 1);
+    uint8_t firstWeekday = (first % 7 + 11) % 7; // 1970-01-01 was a thursday.
+    uint8_t day = 1 + (rule.day + 7 - firstWeekday) % 7 + (rule.week - 1) * 7;
+    if (day > daysInMonth(year, rule.month))
+    {
+      day -= 7;
+    }
+    days = first + day - 1;
+  }
+  else
+  {
+    days = daysFromCivil(year, 1, 1) + rule.day;
+    if (rule.type == ruleJulian)
+    {
+      days += (isLeapYear(year) && rule.day >= 60) ? 0 : -1;
+    }
+  }
+  return days * secondsPerDay + rule.time - offset;
+}
+
+static bool parseNumber(const char *&text, int32_t min, int32_t max, int32_t &value)
+{
+  if (*text < '0' || *text > '9')
+  {
+    return false;
+  }
+  value = 0;
+  while (*text >= '0' && *text <= '9')
+  {
+    value = value * 10 + (*text++ - '0');
+    if (value > max)
+    {
+      return false;
+    }
+  }
+  return value >= min;
+}
+
+// [+-]hh[:mm[:ss]], as seconds.
+static bool parseTime(const char *&text, int32_t maxHours, int32_t &seconds)
+{
+  int32_t sign = 1;
+  if (*text == '+' || *text == '-')
+  {
+    sign = *text++ == '-' ? -1 : 1;
+  }
+  int32_t hours;
+  int32_t minutes = 0;
+  int32_t secs = 0;
+  if (!parseNumber(text, 0, maxHours, hours))
+  {
+    return false;
+  }
+  if (*text == ':' && !parseNumber(++text, 0, 59, minutes))
+  {
+    return false;
+  }
+  if (*text == ':' && !parseNumber(++text, 0, 59, secs))
+  {
+    return false;
+  }
+  seconds = sign * (hours * secondsPerHour + minutes * 60 + secs);
+  return true;
+}
+
+// Three or more letters, or anything but '>' between angle brackets.
+static bool skipName(const char *&text)
+{
+  const char *start = text;
+  if (*text == '<')
+  {
+    while (*++text != '>')
+    {
+      if (*text == '\0')
+      {
+        return false;
+      }
+    }
+    return text++ - start > 3;
+  }
+  while ((*text >= 'A' && *text <= 'Z') || (*text >= 'a' && *text <= 'z'))
+  {
+    text++;
+  }
+  return text - start >= 3;
+}
+
+static bool parseRule(const char *&text, Rule &rule)
+{
+  int32_t value;
+  if (*text == 'M')
+  {
+    int32_t week;
+    int32_t day;
+    text++;
+    if (!parseNumber(text, 1, 12, value) || *text++ != '.' || !parseNumber(text, 1, 5, week) || *text++ != '.' || !parseNumber(text, 0, 6, day))
+    {
+      return false;
+    }
+    rule.type = ruleMonthWeekDay;
+    rule.month = value;
+    rule.week = week;
+    rule.day = day;
+  }
+  else if (*text == 'J')
+  {
+    text++;
+    if (!parseNumber(text, 1, 365, value))
+    {
+      return false;
+    }
+    rule.type = ruleJulian;
+    rule.day = value;
+  }
+  else
+  {
+    if (!parseNumber(text, 0, 365, value))
+    {
+      return false;
+    }
+    rule.type = ruleDayOfYear;
+    rule.day = value;
+  }
+  rule.time = 2 * secondsPerHour;
+  // The extended format allows -167 to 167 hours, so rules like "the day after" can be written.
+  return *text != '/' || parseTime(++text, 167, rule.time);
+}
+
+bool tzBegin(const char *rules)
+{
+  Zone parsed = zone;
+  const char *text = rules;
+  int32_t offset;
+  if (!skipName(text) || !parseTime(text, 24, offset))
+  {
+    return false;
+  }
+  parsed.standardOffset = -offset;
+  parsed.hasDst = *text != '\0';
+  if (parsed.hasDst)
+  {
+    if (!skipName(text))
+    {
+      return false;
+    }
+    parsed.dstOffset = parsed.standardOffset + secondsPerHour;
+    if (*text != ',' && *text != '\0')
+    {
+      if (!parseTime(text, 24, offset))
+      {
+        return false;
+      }
+      parsed.dstOffset = -offset;
+    }
+    // Without rules POSIX leaves the dates up to the implementation, insist on them instead of guessing.
+    if (*text++ != ',' || !parseRule(text, parsed.start) || *text++ != ',' || !parseRule(text, parsed.end) || *text != '\0')
+    {
+      return false;
+    }
+  }
+  zone = parsed;
+  cacheStart = 0;
+  cacheEnd = 0;
+  return true;
+}
+
+bool tzHasDst()
+{
+  return zone.hasDst;
+}
+
+struct Period
+{
+  int64_t start;
+  int64_t end;
+  int32_t offset;
+  bool dst;
+};
+
+// Find the period between two clock changes that utc falls in.
+static Period periodAt(int64_t utc)
+{
+  Period period = {-farFuture, farFuture, zone.standardOffset, false};
+  if (!zone.hasDst)
+  {
+    return period;
+  }
+  // Changes of the year before and after too, the local year may not be the UTC year and either can be the closest.
+  int32_t year = yearFromDays(utc >= 0 ? utc / secondsPerDay : (utc - secondsPerDay + 1) / secondsPerDay);
+  for (int32_t y = year - 1; y <= year + 1; y++)
+  {
+    int64_t starts = ruleInstant(zone.start, y, zone.standardOffset);
+    int64_t ends = ruleInstant(zone.end, y, zone.dstOffset);
+    const int64_t changes[2] = {starts, ends};
+    for (uint8_t i = 0; i < 2; i++)
+    {
+      if (changes[i] <= utc && changes[i] > period.start)
+      {
+        period.start = changes[i];
+        period.dst = i == 0;
+        period.offset = period.dst ? zone.dstOffset : zone.standardOffset;
+      }
+      else if (changes[i] > utc && changes[i] < period.end)
+      {
+        period.end = changes[i];
+      }
+    }
+  }
+  return period;
+}
+
+time_t tzLocal(time_t utc)
+{
+  if ((int64_t)utc < cacheStart || (int64_t)utc >= cacheEnd)
+  {
+    Period period = periodAt(utc);
+    cacheStart = period.start;
+    cacheEnd = period.end;
+    cacheOffset = period.offset;
+    cacheDst = period.dst;
+  }
+  return utc + cacheOffset;
+}
+
+int32_t tzOffsetAt(time_t utc)
+{
+  if ((int64_t)utc >= cacheStart && (int64_t)utc < cacheEnd)
+  {
+    return cacheOffset;
+  }
+  return periodAt(utc).offset;
+}
+
+time_t tzNextChange()
+{
+  return cacheEnd > (int64_t)INT32_MAX ? (time_t)INT32_MAX : (time_t)cacheEnd;
+}
+
+bool tzDstActive()
+{
+  return cacheDst;
+}
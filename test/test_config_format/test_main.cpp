@@ -0,0 +1,172 @@
+// Config records: the current format round trip, corrupt records, and settings left by firmware 1.2.1.
+//   pio test -e native
+#include <unity.h>
+#include <string.h>
+#include "config_format.h"
+
+void setUp() {}
+void tearDown() {}
+
+// The 1.2.1 StateContainer as EEPROM.put wrote it, built by hand so a layout change in config_format.cpp shows up
+// here. Three bools, four schedules of ten int32s (six alarm ids, start hour and minute, end hour and minute), the
+// intensities as int32 and the two active bools.
+static const uint16_t legacyLength = 176;
+static const uint16_t legacyDay = 4;
+static const uint16_t legacyNight = 44;
+static const uint16_t legacyWeekendDay = 84;
+static const uint16_t legacyWeekendNight = 124;
+static const uint16_t legacyIntensities = 164;
+static const uint16_t legacyActive = 172;
+
+static void putInt32(uint8_t *buffer, uint16_t offset, int32_t value)
+{
+  memcpy(buffer + offset, &value, sizeof(value));
+}
+
+static void putLegacySchedule(uint8_t *buffer, uint16_t offset, int32_t startHour, int32_t startMinute, int32_t endHour, int32_t endMinute)
+{
+  for (uint8_t alarm = 0; alarm < 6; alarm++)
+  {
+    putInt32(buffer, offset + 4 * alarm, 255);
+  }
+  putInt32(buffer, offset + 24, startHour);
+  putInt32(buffer, offset + 28, startMinute);
+  putInt32(buffer, offset + 32, endHour);
+  putInt32(buffer, offset + 36, endMinute);
+}
+
+// Saved settings with a weekend night but no weekend day, which 1.2.1 marked with -1.
+static void legacyRecord(uint8_t buffer[legacyLength])
+{
+  memset(buffer, 0, legacyLength);
+  buffer[0] = true; // persistedInEEPROM
+  buffer[1] = true; // initialized
+  buffer[2] = true; // dstActive
+  putLegacySchedule(buffer, legacyDay, 7, 30, 21, 15);
+  putLegacySchedule(buffer, legacyNight, 21, 15, 7, 30);
+  putLegacySchedule(buffer, legacyWeekendDay, -1, -1, -1, -1);
+  putLegacySchedule(buffer, legacyWeekendNight, 23, 0, 9, 45);
+  putInt32(buffer, legacyIntensities, 80);
+  putInt32(buffer, legacyIntensities + 4, 20);
+  buffer[legacyActive] = false;
+  buffer[legacyActive + 1] = true;
+}
+
+static void test_legacy_length()
+{
+  TEST_ASSERT_EQUAL_UINT16(legacyLength, legacyConfigLength());
+}
+
+static void test_legacy_migrates_to_current()
+{
+  uint8_t legacy[legacyLength];
+  legacyRecord(legacy);
+  PersistedConfig config;
+  uint8_t runtime = 0;
+  TEST_ASSERT_TRUE(decodeLegacyConfig(legacy, sizeof(legacy), config, runtime));
+
+  TEST_ASSERT_EQUAL_UINT8(runtimeNightActive, runtime);
+  TEST_ASSERT_EQUAL_UINT8(1, config.dstActive);
+  TEST_ASSERT_EQUAL_UINT8(80, config.dayIntensity);
+  TEST_ASSERT_EQUAL_UINT8(20, config.nightIntensity);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(7, 30), config.day.startMinute);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(21, 15), config.day.endMinute);
+  TEST_ASSERT_EQUAL_UINT8(scheduleEnabled, config.day.flags);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(21, 15), config.night.startMinute);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(7, 30), config.night.endMinute);
+  TEST_ASSERT_FALSE(scheduleIsEnabled(config.weekendDay));
+  TEST_ASSERT_TRUE(scheduleIsEnabled(config.weekendNight));
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(23, 0), config.weekendNight.startMinute);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(9, 45), config.weekendNight.endMinute);
+  TEST_ASSERT_EQUAL_UINT8(0, config.weeklyActive);
+  for (uint8_t channel = 0; channel < channelCount; channel++)
+  {
+    TEST_ASSERT_EQUAL_UINT16(defaultFadeSeconds, config.fadeInSeconds[channel]);
+    TEST_ASSERT_EQUAL_UINT16(defaultFadeSeconds, config.fadeOutSeconds[channel]);
+  }
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    for (uint8_t slot = 0; slot < slotsPerDay; slot++)
+    {
+      TEST_ASSERT_FALSE(scheduleIsEnabled(config.week.slots[weekday][slot]));
+    }
+  }
+
+  // Saved again it's a current record like any other.
+  uint8_t record[configMaxEncodedLength];
+  uint16_t length = encodeConfig(config, record, sizeof(record));
+  TEST_ASSERT_EQUAL_UINT16(configMaxEncodedLength, length);
+  PersistedConfig decoded;
+  TEST_ASSERT_TRUE(decodeConfig(record, length, decoded));
+  TEST_ASSERT_EQUAL_MEMORY(&config, &decoded, sizeof(config));
+}
+
+static void test_legacy_rejects_unsaved_and_out_of_range()
+{
+  uint8_t legacy[legacyLength];
+  PersistedConfig config;
+  uint8_t runtime;
+
+  legacyRecord(legacy);
+  legacy[0] = false; // Never saved, or an erased sector read as 0xFF isn't true either.
+  TEST_ASSERT_FALSE(decodeLegacyConfig(legacy, sizeof(legacy), config, runtime));
+  memset(legacy, 0xFF, sizeof(legacy));
+  TEST_ASSERT_FALSE(decodeLegacyConfig(legacy, sizeof(legacy), config, runtime));
+
+  legacyRecord(legacy);
+  putInt32(legacy, legacyIntensities, 101);
+  TEST_ASSERT_FALSE(decodeLegacyConfig(legacy, sizeof(legacy), config, runtime));
+
+  legacyRecord(legacy);
+  TEST_ASSERT_FALSE(decodeLegacyConfig(legacy, sizeof(legacy) - 4, config, runtime));
+
+  // A nonsense time disables that schedule rather than failing the whole record.
+  legacyRecord(legacy);
+  putLegacySchedule(legacy, legacyDay, 25, 0, 21, 15);
+  TEST_ASSERT_TRUE(decodeLegacyConfig(legacy, sizeof(legacy), config, runtime));
+  TEST_ASSERT_FALSE(scheduleIsEnabled(config.day));
+}
+
+static void test_decode_rejects_corrupt_records()
+{
+  uint8_t legacy[legacyLength];
+  legacyRecord(legacy);
+  PersistedConfig config;
+  uint8_t runtime;
+  TEST_ASSERT_TRUE(decodeLegacyConfig(legacy, sizeof(legacy), config, runtime));
+  uint8_t record[configMaxEncodedLength];
+  uint16_t length = encodeConfig(config, record, sizeof(record));
+  PersistedConfig decoded;
+
+  TEST_ASSERT_FALSE(decodeConfig(record, length - 1, decoded));
+  TEST_ASSERT_EQUAL_UINT16(0, encodeConfig(config, record, configMaxEncodedLength - 1));
+
+  record[length - 1] ^= 0x01;
+  TEST_ASSERT_FALSE(decodeConfig(record, length, decoded));
+  record[length - 1] ^= 0x01;
+
+  // A newer version isn't guessed at, even with a good CRC.
+  ConfigHeader header;
+  memcpy(&header, record, sizeof(header));
+  header.version = configFormatVersion + 1;
+  memcpy(record, &header, sizeof(header));
+  TEST_ASSERT_FALSE(decodeConfig(record, length, decoded));
+
+  // A good CRC over invalid contents.
+  header.version = configFormatVersion;
+  config.dayIntensity = 200;
+  header.crc = crc32(&config, sizeof(config));
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), &config, sizeof(config));
+  TEST_ASSERT_FALSE(decodeConfig(record, length, decoded));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_legacy_length);
+  RUN_TEST(test_legacy_migrates_to_current);
+  RUN_TEST(test_legacy_rejects_unsaved_and_out_of_range);
+  RUN_TEST(test_decode_rejects_corrupt_records);
+  return UNITY_END();
+}
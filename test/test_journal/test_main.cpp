@@ -0,0 +1,169 @@
+// The flash journal on the fake sectors of bench/native: latest records, torn writes and power cuts while compacting.
+//   pio test -e native
+#include <Arduino.h>
+#include <unity.h>
+#include "journal.h"
+
+void setUp()
+{
+  fakeFlashErase();
+}
+
+void tearDown()
+{
+  fakeFlashRestorePower();
+}
+
+static const char configA[] = "config a";
+static const char configB[] = "config b, longer";
+
+static void assertConfig(const char *expected)
+{
+  char payload[32];
+  int16_t length = journalReadLatest(recordConfig, payload, sizeof(payload));
+  TEST_ASSERT_EQUAL_INT16(strlen(expected) + 1, length);
+  TEST_ASSERT_EQUAL_STRING(expected, payload);
+}
+
+// 0 when there's none, the tests count from 1.
+static uint32_t latestRuntime()
+{
+  uint32_t value = 0;
+  return journalReadLatest(recordRuntime, &value, sizeof(value)) == sizeof(value) ? value : 0;
+}
+
+static bool appendRuntime(uint32_t value)
+{
+  return journalAppend(recordRuntime, &value, sizeof(value));
+}
+
+// Runtime records after the config until the append that compacts, the erase count goes up in it.
+static uint32_t appendsUntilCompaction()
+{
+  journalBegin();
+  journalAppend(recordConfig, configA, sizeof(configA));
+  uint32_t erases = journalEraseCount();
+  uint32_t appends = 0;
+  while (journalEraseCount() == erases)
+  {
+    appendRuntime(++appends);
+  }
+  fakeFlashErase();
+  return appends;
+}
+
+static void test_erased_flash_has_no_journal()
+{
+  TEST_ASSERT_FALSE(journalBegin());
+  char payload[8];
+  TEST_ASSERT_EQUAL_INT16(-1, journalReadLatest(recordConfig, payload, sizeof(payload)));
+  // The first append formats it.
+  TEST_ASSERT_TRUE(journalAppend(recordConfig, configA, sizeof(configA)));
+  TEST_ASSERT_TRUE(journalBegin());
+  assertConfig(configA);
+}
+
+static void test_latest_record_of_each_type()
+{
+  journalBegin();
+  TEST_ASSERT_TRUE(journalAppend(recordConfig, configA, sizeof(configA)));
+  TEST_ASSERT_TRUE(appendRuntime(1));
+  TEST_ASSERT_TRUE(journalAppend(recordConfig, configB, sizeof(configB)));
+  TEST_ASSERT_TRUE(appendRuntime(2));
+  assertConfig(configB);
+  TEST_ASSERT_EQUAL_UINT32(2, latestRuntime());
+
+  // And the same after a reboot.
+  TEST_ASSERT_TRUE(journalBegin());
+  assertConfig(configB);
+  TEST_ASSERT_EQUAL_UINT32(2, latestRuntime());
+
+  char small[4];
+  TEST_ASSERT_EQUAL_INT16(-1, journalReadLatest(recordConfig, small, sizeof(small)));
+  TEST_ASSERT_EQUAL_INT16(-1, journalReadLatest(recordFleet, small, sizeof(small)));
+  TEST_ASSERT_FALSE(journalAppend(recordConfig, configA, journalMaxPayload + 1));
+}
+
+static void test_torn_write_keeps_the_record_before()
+{
+  journalBegin();
+  TEST_ASSERT_TRUE(journalAppend(recordConfig, configA, sizeof(configA)));
+  TEST_ASSERT_TRUE(appendRuntime(1));
+  fakeFlashCutAfter(0);
+  TEST_ASSERT_FALSE(appendRuntime(2));
+  fakeFlashRestorePower();
+
+  TEST_ASSERT_TRUE(journalBegin());
+  assertConfig(configA);
+  TEST_ASSERT_EQUAL_UINT32(1, latestRuntime());
+  // Nothing after the torn record is trusted, so the next append compacts past it.
+  uint32_t erases = journalEraseCount();
+  TEST_ASSERT_TRUE(appendRuntime(3));
+  TEST_ASSERT_EQUAL_UINT32(erases + 1, journalEraseCount());
+  TEST_ASSERT_TRUE(journalBegin());
+  assertConfig(configA);
+  TEST_ASSERT_EQUAL_UINT32(3, latestRuntime());
+}
+
+static void test_compaction_keeps_the_latest_records()
+{
+  uint32_t appends = appendsUntilCompaction();
+  TEST_ASSERT_TRUE(appends > 100);
+
+  journalBegin();
+  uint32_t fleet = 7;
+  TEST_ASSERT_TRUE(journalAppend(recordFleet, &fleet, sizeof(fleet)));
+  TEST_ASSERT_TRUE(journalAppend(recordConfig, configA, sizeof(configA)));
+  // Several compactions, taking turns between the two sectors.
+  for (uint32_t value = 1; value <= 4 * appends; value++)
+  {
+    TEST_ASSERT_TRUE(appendRuntime(value));
+  }
+  TEST_ASSERT_TRUE(journalEraseCount() >= 4);
+  TEST_ASSERT_TRUE(journalBegin());
+  assertConfig(configA);
+  TEST_ASSERT_EQUAL_UINT32(4 * appends, latestRuntime());
+  uint32_t readFleet = 0;
+  TEST_ASSERT_EQUAL_INT16(sizeof(readFleet), journalReadLatest(recordFleet, &readFleet, sizeof(readFleet)));
+  TEST_ASSERT_EQUAL_UINT32(fleet, readFleet);
+}
+
+// Power goes out at every step of a compaction in turn: erasing the spare, copying the records, writing its header
+// and the record that needed the room. Either the old sector or the new one has to come back.
+static void test_power_cut_while_compacting()
+{
+  uint32_t appends = appendsUntilCompaction();
+  for (int32_t cut = 0; cut < 8; cut++)
+  {
+    fakeFlashErase();
+    journalBegin();
+    TEST_ASSERT_TRUE(journalAppend(recordConfig, configA, sizeof(configA)));
+    for (uint32_t value = 1; value < appends; value++)
+    {
+      TEST_ASSERT_TRUE(appendRuntime(value));
+    }
+    fakeFlashCutAfter(cut);
+    bool appended = appendRuntime(appends);
+    fakeFlashRestorePower();
+
+    TEST_ASSERT_TRUE_MESSAGE(journalBegin(), "no journal after the cut");
+    assertConfig(configA);
+    uint32_t runtime = latestRuntime();
+    TEST_ASSERT_EQUAL_UINT32(appended ? appends : appends - 1, runtime);
+    TEST_ASSERT_TRUE(appendRuntime(appends + 1));
+    TEST_ASSERT_TRUE(journalBegin());
+    assertConfig(configA);
+    TEST_ASSERT_EQUAL_UINT32(appends + 1, latestRuntime());
+  }
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_erased_flash_has_no_journal);
+  RUN_TEST(test_latest_record_of_each_type);
+  RUN_TEST(test_torn_write_keeps_the_record_before);
+  RUN_TEST(test_compaction_keeps_the_latest_records);
+  RUN_TEST(test_power_cut_while_compacting);
+  return UNITY_END();
+}
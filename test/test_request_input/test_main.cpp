@@ -0,0 +1,211 @@
+// What the API and the form get sent: malformed JSON bodies and bad form fields are rejected, and say where.
+//   pio test -e native
+#include <unity.h>
+#include <string.h>
+#include "json_reader.h"
+#include "schedule_form.h"
+
+void setUp() {}
+void tearDown() {}
+
+static bool wellFormed(const char *text)
+{
+  JsonReader reader;
+  jsonBegin(reader, text, strlen(text));
+  jsonSkip(reader);
+  return jsonFinished(reader);
+}
+
+static void test_well_formed_json()
+{
+  TEST_ASSERT_TRUE(wellFormed("{}"));
+  TEST_ASSERT_TRUE(wellFormed(" { \"a\" : [1, true, null, \"x\\\"y\"], \"b\": {\"c\": false} } "));
+  TEST_ASSERT_TRUE(wellFormed("[[[]]]"));
+}
+
+static void test_malformed_json()
+{
+  const char *documents[] = {
+      "",
+      "{",
+      "{\"a\":}",
+      "{\"a\":1,}",
+      "{\"a\" 1}",
+      "{a:1}",
+      "[1 2]",
+      "[1,]",
+      "\"unterminated",
+      "{\"a\":1}}",
+      "{\"a\":1} x",
+      "tru",
+      "nul",
+      "{\"a\":[1,2}",
+  };
+  for (const char *document : documents)
+  {
+    TEST_ASSERT_FALSE_MESSAGE(wellFormed(document), document);
+  }
+}
+
+// Arrays nested depth deep.
+static bool nested(uint8_t depth)
+{
+  char text[2 * (jsonMaxDepth + 1) + 1];
+  memset(text, '[', depth);
+  memset(text + depth, ']', depth);
+  text[2 * depth] = '\0';
+  return wellFormed(text);
+}
+
+static void test_json_limits()
+{
+  TEST_ASSERT_TRUE(nested(jsonMaxDepth));
+  TEST_ASSERT_FALSE(nested(jsonMaxDepth + 1));
+
+  // Numbers that don't fit, and a key too long for its buffer.
+  JsonReader reader;
+  uint32_t value;
+  const char *tooBig = "4294967296";
+  jsonBegin(reader, tooBig, strlen(tooBig));
+  TEST_ASSERT_FALSE(jsonReadUint(reader, value));
+  const char *fits = "4294967295";
+  jsonBegin(reader, fits, strlen(fits));
+  TEST_ASSERT_TRUE(jsonReadUint(reader, value));
+  TEST_ASSERT_EQUAL_UINT32(4294967295u, value);
+
+  const char *longKey = "{\"averyveryverylongkey\":1}";
+  char key[8];
+  jsonBegin(reader, longKey, strlen(longKey));
+  TEST_ASSERT_TRUE(jsonBeginObject(reader));
+  TEST_ASSERT_FALSE(jsonNextKey(reader, key, sizeof(key)));
+  TEST_ASSERT_FALSE(jsonFinished(reader));
+}
+
+static const char password[] = "zuul";
+
+static PersistedConfig currentConfig()
+{
+  PersistedConfig config;
+  memset(&config, 0, sizeof(config));
+  config.dayIntensity = 50;
+  config.nightIntensity = 10;
+  config.day = makeSchedule(minuteOfDay(7, 0), minuteOfDay(22, 0));
+  config.night = makeSchedule(minuteOfDay(22, 0), minuteOfDay(7, 0));
+  return config;
+}
+
+struct Field
+{
+  const char *name;
+  const char *value;
+};
+
+static const Field validForm[] = {
+    {"dayStart", "07:30"}, {"dayEnd", "sunset-30"}, {"nightStart", "sunset"}, {"nightEnd", "07:30"},
+    {"dayIntensity", "80"}, {"nightIntensity", "5"}, {"gatekeeper", password},
+};
+static const uint8_t validFields = sizeof(validForm) / sizeof(validForm[0]);
+
+// The valid form with one field replaced (or added, when it isn't in it), finished.
+static bool postForm(ScheduleForm &form, const char *name, const char *value)
+{
+  formBegin(form, currentConfig(), password);
+  bool replaced = false;
+  for (uint8_t i = 0; i < validFields; i++)
+  {
+    bool replace = name != nullptr && strcmp(validForm[i].name, name) == 0;
+    formField(form, validForm[i].name, replace ? value : validForm[i].value);
+    replaced |= replace;
+  }
+  if (name != nullptr && !replaced)
+  {
+    formField(form, name, value);
+  }
+  return formFinish(form);
+}
+
+static void test_valid_form()
+{
+  ScheduleForm form;
+  TEST_ASSERT_TRUE(postForm(form, nullptr, nullptr));
+  TEST_ASSERT_TRUE(form.gatekeeperSent && form.gatekeeperOk);
+  TEST_ASSERT_EQUAL_STRING("", form.invalidField);
+  TEST_ASSERT_EQUAL_UINT8(80, form.config.dayIntensity);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(7, 30), form.config.day.startMinute);
+  TEST_ASSERT_TRUE(form.config.day.flags & scheduleEndSunset);
+  TEST_ASSERT_FALSE(scheduleIsEnabled(form.config.weekendDay));
+}
+
+static void assertRejected(const char *name, const char *value, const char *invalidField)
+{
+  ScheduleForm form;
+  TEST_ASSERT_FALSE_MESSAGE(postForm(form, name, value), value);
+  TEST_ASSERT_EQUAL_STRING(invalidField, form.invalidField);
+}
+
+static void test_bad_form_fields()
+{
+  assertRejected("dayStart", "24:00", "dayStart");
+  assertRejected("dayStart", "7:3", "dayStart");
+  assertRejected("dayEnd", "sunset+241", "dayEnd");
+  assertRejected("nightStart", "moonrise", "nightStart");
+  assertRejected("dayIntensity", "101", "dayIntensity");
+  assertRejected("dayIntensity", "-1", "dayIntensity");
+  assertRejected("nightIntensity", "5x", "nightIntensity");
+  assertRejected("dayFadeIn", "3601", "dayFadeIn");
+  assertRejected("dst", "yes", "dst");
+  // Half a weekend schedule names the half that's missing.
+  assertRejected("weekendDayStart", "09:00", "weekendDayEnd");
+  assertRejected("weekendNightEnd", "09:00", "weekendNightStart");
+  // Required fields left empty count as missing.
+  assertRejected("dayIntensity", "", "dayIntensity");
+}
+
+static void test_bad_weekly_slots()
+{
+  ScheduleForm form;
+  formBegin(form, currentConfig(), password);
+  formField(form, "weekly", "1");
+  formField(form, "dayIntensity", "50");
+  formField(form, "nightIntensity", "50");
+  formField(form, "w3s1Start", "08:00");
+  TEST_ASSERT_FALSE(formFinish(form));
+  TEST_ASSERT_EQUAL_STRING("w3s1End", form.invalidField);
+
+  formBegin(form, currentConfig(), password);
+  formField(form, "weekly", "1");
+  formField(form, "dayIntensity", "50");
+  formField(form, "nightIntensity", "50");
+  formField(form, "w0s0Start", "08:00");
+  formField(form, "w0s0End", "09:00");
+  formField(form, "w0s0Channel", "evening");
+  TEST_ASSERT_FALSE(formFinish(form));
+  TEST_ASSERT_EQUAL_STRING("w0s0Channel", form.invalidField);
+}
+
+static void test_gatekeeper()
+{
+  ScheduleForm form;
+  formBegin(form, currentConfig(), password);
+  formField(form, "dayIntensity", "50");
+  TEST_ASSERT_FALSE(form.gatekeeperSent);
+
+  postForm(form, "gatekeeper", "zuu");
+  TEST_ASSERT_TRUE(form.gatekeeperSent);
+  TEST_ASSERT_FALSE(form.gatekeeperOk);
+  postForm(form, "gatekeeper", "zuull");
+  TEST_ASSERT_FALSE(form.gatekeeperOk);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_well_formed_json);
+  RUN_TEST(test_malformed_json);
+  RUN_TEST(test_json_limits);
+  RUN_TEST(test_valid_form);
+  RUN_TEST(test_bad_form_fields);
+  RUN_TEST(test_bad_weekly_slots);
+  RUN_TEST(test_gatekeeper);
+  return UNITY_END();
+}
@@ -0,0 +1,154 @@
+// The compiled schedule around the weekend: the weekend override only takes friday and saturday evenings and
+// saturday and sunday mornings, so thursday night ends on the regular friday morning.
+//   pio test -e native
+#include <unity.h>
+#include "scheduler.h"
+#include "sun.h"
+
+static const uint8_t sunday = 0;
+static const uint8_t thursday = 4;
+static const uint8_t friday = 5;
+static const uint8_t saturday = 6;
+
+static uint16_t at(uint8_t weekday, int hour, int minute)
+{
+  return weekday * minutesPerDay + minuteOfDay(hour, minute);
+}
+
+static void assertState(uint8_t weekday, int hour, int minute, bool day, bool night)
+{
+  OutputState state = schedulerStateAt(at(weekday, hour, minute));
+  TEST_ASSERT_EQUAL(day, state.dayActive);
+  TEST_ASSERT_EQUAL(night, state.nightActive);
+}
+
+// Weekdays 07:00-22:00 and 22:00-07:00, weekends 09:00-23:00 and 23:00-09:00.
+void setUp()
+{
+  schedulerCompile(makeSchedule(minuteOfDay(7, 0), minuteOfDay(22, 0)), makeSchedule(minuteOfDay(22, 0), minuteOfDay(7, 0)),
+                   makeSchedule(minuteOfDay(9, 0), minuteOfDay(23, 0)), makeSchedule(minuteOfDay(23, 0), minuteOfDay(9, 0)));
+}
+
+void tearDown() {}
+
+static void test_thursday_night_ends_on_a_weekday_morning()
+{
+  assertState(thursday, 21, 59, true, false);
+  assertState(thursday, 22, 0, false, true);
+  assertState(friday, 6, 59, false, true);
+  assertState(friday, 7, 0, true, false);
+  TEST_ASSERT_EQUAL_UINT16(minuteOfDay(9, 0), schedulerMinutesToNextTransition(at(thursday, 22, 0)));
+}
+
+static void test_weekend_evenings_and_mornings()
+{
+  // Friday evening is the weekend's, saturday morning too.
+  assertState(friday, 22, 30, true, false);
+  assertState(friday, 23, 0, false, true);
+  assertState(saturday, 8, 59, false, true);
+  assertState(saturday, 9, 0, true, false);
+  assertState(saturday, 22, 30, true, false);
+  assertState(sunday, 8, 30, false, true);
+  // Sunday evening is a weekday's again, ending on monday's regular morning.
+  assertState(sunday, 22, 0, false, true);
+  assertState(sunday + 1, 7, 0, true, false);
+}
+
+// Without a weekend schedule every day is the same.
+static void test_no_weekend_schedule()
+{
+  schedulerCompile(makeSchedule(minuteOfDay(7, 0), minuteOfDay(22, 0)), makeSchedule(minuteOfDay(22, 0), minuteOfDay(7, 0)),
+                   disabledSchedule(), disabledSchedule());
+  for (uint8_t weekday = sunday; weekday <= saturday; weekday++)
+  {
+    assertState(weekday, 6, 59, false, true);
+    assertState(weekday, 7, 0, true, false);
+    assertState(weekday, 22, 0, false, true);
+  }
+  // Both channels on and off once a day.
+  TEST_ASSERT_EQUAL_UINT8(2 * channelCount * daysPerWeek, schedulerTransitionCount());
+}
+
+static void sunSchedules(Schedule &day, Schedule &night)
+{
+  day = disabledSchedule();
+  night = disabledSchedule();
+  TEST_ASSERT_TRUE(parseScheduleEndpoint("sunrise", day, true) && parseScheduleEndpoint("sunset", day, false));
+  TEST_ASSERT_TRUE(parseScheduleEndpoint("sunset-30", night, true) && parseScheduleEndpoint("sunrise+30", night, false));
+  day.flags |= scheduleEnabled;
+  night.flags |= scheduleEnabled;
+}
+
+static void setSunEveryDay(int16_t sunrise, int16_t sunset)
+{
+  SunDay days[daysPerWeek];
+  for (uint8_t weekday = 0; weekday < daysPerWeek; weekday++)
+  {
+    days[weekday] = {sunrise, sunset};
+  }
+  schedulerSetSun(days);
+}
+
+// Sunrise and sunset both at noon, as sunTimes() has them in polar night: night around the clock, no day.
+static void test_polar_night_is_always_night()
+{
+  Schedule day;
+  Schedule night;
+  sunSchedules(day, night);
+  setSunEveryDay(minuteOfDay(12, 0), minuteOfDay(12, 0));
+  schedulerCompile(day, night, disabledSchedule(), disabledSchedule());
+  for (uint16_t minute = 0; minute < minutesPerWeek; minute += 15)
+  {
+    OutputState state = schedulerStateAt(minute);
+    TEST_ASSERT_FALSE(state.dayActive);
+    TEST_ASSERT_TRUE(state.nightActive);
+  }
+  setSunEveryDay(360, 1080);
+}
+
+// Under the midnight sun they're 24 hours apart, and a minute more either side: day around the clock, the night
+// light only for its offsets around midnight.
+static void test_midnight_sun_is_always_day()
+{
+  Schedule day;
+  Schedule night;
+  sunSchedules(day, night);
+  setSunEveryDay(minuteOfDay(12, 0) - 721, minuteOfDay(12, 0) + 721);
+  schedulerCompile(day, night, disabledSchedule(), disabledSchedule());
+  for (uint16_t minute = 0; minute < minutesPerWeek; minute += 15)
+  {
+    TEST_ASSERT_TRUE(schedulerStateAt(minute).dayActive);
+  }
+  assertState(thursday, 23, 45, true, true);
+  assertState(friday, 0, 15, true, true);
+  assertState(friday, 1, 0, true, false);
+  setSunEveryDay(360, 1080);
+}
+
+// A sunset past midnight stays that evening's instead of being cut off at 23:59.
+static void test_sun_times_carry_past_midnight()
+{
+  Schedule day;
+  Schedule night;
+  sunSchedules(day, night);
+  setSunEveryDay(minuteOfDay(3, 0), minutesPerDay + minuteOfDay(0, 20));
+  schedulerCompile(day, night, disabledSchedule(), disabledSchedule());
+  assertState(thursday, 23, 30, true, false);
+  assertState(friday, 0, 10, true, true);
+  assertState(friday, 0, 30, false, true);
+  assertState(friday, 2, 50, false, true);
+  assertState(friday, 3, 30, true, false);
+  setSunEveryDay(360, 1080);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_thursday_night_ends_on_a_weekday_morning);
+  RUN_TEST(test_weekend_evenings_and_mornings);
+  RUN_TEST(test_no_weekend_schedule);
+  RUN_TEST(test_polar_night_is_always_night);
+  RUN_TEST(test_midnight_sun_is_always_day);
+  RUN_TEST(test_sun_times_carry_past_midnight);
+  return UNITY_END();
+}
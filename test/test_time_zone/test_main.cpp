@@ -0,0 +1,96 @@
+// POSIX TZ rules at their edges: a southern hemisphere zone whose DST spans the new year, and the Jn and n day rules
+// around february 29th.
+//   pio test -e native
+#include <unity.h>
+#include "time_zone.h"
+
+void setUp() {}
+
+void tearDown()
+{
+  tzBegin("UTC0");
+}
+
+static const int32_t hour = 3600;
+
+// Sydney: standard +10, daylight +11 from the first sunday of october 02:00 to the first sunday of april 03:00.
+static void test_southern_hemisphere_dst()
+{
+  TEST_ASSERT_TRUE(tzBegin("AEST-10AEDT,M10.1.0,M4.1.0/3"));
+  TEST_ASSERT_TRUE(tzHasDst());
+
+  const time_t january = 1705276800; // 2024-01-15 00:00 UTC
+  const time_t july = 1719792000;    // 2024-07-01 00:00 UTC
+  TEST_ASSERT_EQUAL_INT32(11 * hour, tzOffsetAt(january));
+  TEST_ASSERT_EQUAL_INT32(10 * hour, tzOffsetAt(july));
+  TEST_ASSERT_EQUAL(january + 11 * hour, tzLocal(january));
+  TEST_ASSERT_TRUE(tzDstActive());
+  TEST_ASSERT_EQUAL(july + 10 * hour, tzLocal(july));
+  TEST_ASSERT_FALSE(tzDstActive());
+
+  // Back to standard time on 2024-04-07 03:00 daylight time, 2024-04-06 16:00 UTC.
+  const time_t dstEnd = 1712419200;
+  TEST_ASSERT_EQUAL_INT32(11 * hour, tzOffsetAt(dstEnd - 1));
+  TEST_ASSERT_EQUAL_INT32(10 * hour, tzOffsetAt(dstEnd));
+  tzLocal(dstEnd - 1);
+  TEST_ASSERT_EQUAL(dstEnd, tzNextChange());
+
+  // Forward on 2024-10-06 02:00 standard time, 2024-10-05 16:00 UTC, and still daylight time over the new year.
+  const time_t dstStart = 1728144000;
+  TEST_ASSERT_EQUAL_INT32(10 * hour, tzOffsetAt(dstStart - 1));
+  TEST_ASSERT_EQUAL_INT32(11 * hour, tzOffsetAt(dstStart));
+  TEST_ASSERT_EQUAL_INT32(11 * hour, tzOffsetAt(1735650000)); // 2024-12-31 13:00 UTC, new year's eve midnight local
+  TEST_ASSERT_EQUAL_INT32(11 * hour, tzOffsetAt(1735650000 + hour));
+}
+
+// Jn counts 1-365 and never february 29th, so J60 is march 1st every year.
+static void test_julian_day_rule()
+{
+  TEST_ASSERT_TRUE(tzBegin("XST-1XDT,J60/2,J300/2"));
+  const time_t march1st2024 = 1709254800; // 02:00 standard time, 01:00 UTC
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(march1st2024 - 1));
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(march1st2024));
+  const time_t march1st2023 = 1677632400;
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(march1st2023 - 1));
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(march1st2023));
+  // J300 is october 27th in a leap year too, 02:00 daylight time is 00:00 UTC.
+  const time_t october27th2024 = 1729987200;
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(october27th2024 - 1));
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(october27th2024));
+}
+
+// n counts from 0 and does count february 29th, so 59 is march 1st, or february 29th in a leap year.
+static void test_zero_based_day_rule()
+{
+  TEST_ASSERT_TRUE(tzBegin("XST-1XDT,59/2,299/2"));
+  const time_t february29th2024 = 1709168400;
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(february29th2024 - 1));
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(february29th2024));
+  const time_t march1st2023 = 1677632400;
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(march1st2023 - 1));
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(march1st2023));
+  const time_t october26th2024 = 1729900800;
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(october26th2024 - 1));
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(october26th2024));
+}
+
+static void test_bad_rules_keep_the_zone()
+{
+  TEST_ASSERT_TRUE(tzBegin("CET-1CEST,M3.5.0,M10.5.0/3"));
+  TEST_ASSERT_FALSE(tzBegin("CET-1CEST,M13.5.0,M10.5.0/3"));
+  TEST_ASSERT_FALSE(tzBegin("XST-1XDT,J0/2,J300/2"));
+  TEST_ASSERT_FALSE(tzBegin("XST-1XDT,366/2,299/2"));
+  TEST_ASSERT_FALSE(tzBegin("CET"));
+  TEST_ASSERT_EQUAL_INT32(1 * hour, tzOffsetAt(1705276800));
+  TEST_ASSERT_EQUAL_INT32(2 * hour, tzOffsetAt(1719792000));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_southern_hemisphere_dst);
+  RUN_TEST(test_julian_day_rule);
+  RUN_TEST(test_zero_based_day_rule);
+  RUN_TEST(test_bad_rules_keep_the_zone);
+  return UNITY_END();
+}